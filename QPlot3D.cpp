@@ -18,6 +18,8 @@
 
 #include "QPlot3D.h"
 #include <limits>
+#include <algorithm>
+#include <cstring>
 
 static void Draw3DPlane(QVector3D topLeft, QVector3D bottomRight, QColor color) {
   QVector3D normal = QVector3D::crossProduct(topLeft,bottomRight);
@@ -51,6 +53,560 @@ static void Draw2DLine(QVector2D from, QVector2D to, int lineWidth, QColor color
   glEnd();
 }
 
+// Draws a line between the screen coordinates from and to, which fades out
+// over its width. The orthographic projection of the view must be set.
+static void DrawScreenLine(const QVector3D& from, const QVector3D& to, double lineWidth, const QColor& color) {
+  const QVector3D v = to-from;
+  const QVector3D n1 = QVector3D::crossProduct(to,from);
+  const QVector3D n = QVector3D::crossProduct(v,n1).normalized();
+
+  // Keeps the blend function, which is separate for alpha inside layers
+  glEnable(GL_BLEND);
+
+  const QVector3D d = 0.5*lineWidth*n;
+  const QVector3D v1 = from - d;
+  const QVector3D v2 = to   - d;
+  const QVector3D v3 = from;
+  const QVector3D v4 = to;  
+  const QVector3D v5 = from + d;
+  const QVector3D v6 = to   + d;
+
+  float vertexVec[] = { 
+    v1.x(),v1.y(),v1.z(),
+    v2.x(),v2.y(),v2.z(),
+    v3.x(),v3.y(),v3.z(),
+    v4.x(),v4.y(),v4.z(),
+    v5.x(),v5.y(),v5.z(),
+    v6.x(),v6.y(),v6.z()
+  };
+
+  float colorVec[] = { 
+    color.redF(), color.greenF(), color.blueF(), 0.0,
+    color.redF(), color.greenF(), color.blueF(), 0.0,
+    color.redF(), color.greenF(), color.blueF(), 1.0,
+    color.redF(), color.greenF(), color.blueF(), 1.0,
+    color.redF(), color.greenF(), color.blueF(), 0.0,
+    color.redF(), color.greenF(), color.blueF(), 0.0,
+  };
+
+  glVertexPointer(3,GL_FLOAT, 0, vertexVec);
+  glColorPointer(4,GL_FLOAT, 0, colorVec);
+  glEnableClientState(GL_VERTEX_ARRAY);    
+  glEnableClientState(GL_COLOR_ARRAY);    
+  glDrawArrays(GL_TRIANGLE_STRIP,0,6);
+  glDisableClientState(GL_COLOR_ARRAY);    
+  glDisableClientState(GL_VERTEX_ARRAY);    
+
+  glDisable(GL_BLEND);
+}
+
+// Number of consecutive vertices bounded by one leaf in the pick index, and
+// number of leaves bounded by one node.
+static const int PICK_LEAF_SIZE = 64;
+static const int PICK_NODE_SIZE = 64;
+
+// Number of vertices a worker processes between checks if its job is stale.
+static const int JOB_CANCEL_INTERVAL = 65536;
+
+// Number of pixel buffers frames are read back through, and number of
+// frames that may wait to be written before rendering is held back.
+static const int RECORD_RING_SIZE   = 3;
+static const int RECORD_WRITE_QUEUE = 16;
+
+// Scene file header, and number of elements per chunk of curve data.
+static const quint32 SCENE_MAGIC      = 0x51503344; // "QP3D"
+static const quint32 SCENE_VERSION    = 5;
+static const int     SCENE_CHUNK_SIZE = 1 << 20;
+
+// Largest number of voxels along each axis of a density grid, number of
+// vertices below which binning is not split over more jobs, the interval in
+// ms at which a plot looks for a finished density grid, and the largest size
+// in pixels of a drawn voxel.
+static const int DENSITY_MAX_RESOLUTION = 128;
+static const int DENSITY_JOB_SIZE       = 1 << 18;
+static const int DENSITY_POLL_INTERVAL  = 20;
+static const int MAX_VOXEL_POINT_SIZE   = 64;
+
+// Octree clouds: the default memory budget in bytes and smallest node size
+// in pixels, the most nodes read at once, and the interval in ms at which a
+// plot looks for nodes that have been read.
+static const qint64 OCTREE_MEMORY_BUDGET = (qint64)256 << 20;
+static const double OCTREE_MIN_NODE_SIZE = 100.0;
+static const int    OCTREE_MAX_REQUESTS  = 16;
+static const int    OCTREE_POLL_INTERVAL = 30;
+
+// Arrow mesh of quivers: sides around the arrow, radius of the shaft and
+// the head, and where the head starts, for an arrow of length 1.
+static const int    ARROW_SIDES        = 8;
+static const double ARROW_SHAFT_RADIUS = 0.03;
+static const double ARROW_HEAD_RADIUS  = 0.08;
+static const double ARROW_HEAD_START   = 0.75;
+
+// Number of alpha steps used to draw the fading trail behind a time window.
+static const int TRAIL_BANDS = 8;
+
+// Number of texels in a colormap texture.
+static const int COLORMAP_SIZE = 256;
+
+// Number of colors a curve colored by scalars is split into when exported.
+// Every change of color starts a new polyline in the figure.
+static const int EXPORT_COLOR_STEPS = 32;
+
+// Number of vertices an exported polyline is simplified in at a time. Bounds
+// the cost of Douglas-Peucker on long polylines that loop over themselves.
+static const int EXPORT_SIMPLIFY_WINDOW = 1024;
+
+#ifndef GL_CLAMP_TO_EDGE
+#define GL_CLAMP_TO_EDGE 0x812F
+#endif
+
+#ifndef GL_BGRA
+#define GL_BGRA 0x80E1
+#endif
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+typedef void (APIENTRY *MultiDrawArraysFunc)(GLenum mode, const GLint* first, const GLsizei* count, GLsizei drawCount);
+typedef void (APIENTRY *VertexAttribDivisorFunc)(GLuint index, GLuint divisor);
+typedef void (APIENTRY *DrawArraysInstancedFunc)(GLenum mode, GLint first, GLsizei count, GLsizei instanceCount);
+typedef void (APIENTRY *BlendFuncSeparateFunc)(GLenum srcRGB, GLenum dstRGB, GLenum srcAlpha, GLenum dstAlpha);
+
+// Makes a tube or ribbon segment between the vertices p0 and p1 of a curve
+// in eye space. Each template corner is an angle around the segment and
+// the end of the segment it is at.
+static const char* TUBE_VERTEX_SHADER =
+  "#version 120\n"
+  "attribute vec2  corner;\n"
+  "attribute vec3  p0, p1;\n"
+  "attribute float s0, s1, r0, r1;\n"
+  "uniform float radius;\n"
+  "uniform bool  ribbon;\n"
+  "varying vec3  normal;\n"
+  "varying float scalar;\n"
+  "void main() {\n"
+  "  vec3 e0 = (gl_ModelViewMatrix*vec4(p0,1.0)).xyz;\n"
+  "  vec3 e1 = (gl_ModelViewMatrix*vec4(p1,1.0)).xyz;\n"
+  "  vec3 t  = length(e1-e0) > 0.0 ? normalize(e1-e0) : vec3(0.0,0.0,1.0);\n"
+  "  vec3 up = ribbon ? gl_NormalMatrix*vec3(0.0,0.0,1.0) : (abs(t.z) < 0.9 ? vec3(0.0,0.0,1.0) : vec3(1.0,0.0,0.0));\n"
+  "  vec3 side = cross(t, up);\n"
+  "  side = length(side) > 1e-4 ? normalize(side) : normalize(cross(t, vec3(0.0,1.0,0.0)));\n"
+  "  up = cross(side, t);\n"
+  "  vec3 n = cos(corner.x)*side + sin(corner.x)*up;\n"
+  "  vec3 e = mix(e0, e1, corner.y) + radius*mix(r0, r1, corner.y)*n;\n"
+  "  normal = ribbon ? up : n;\n"
+  "  scalar = (gl_TextureMatrix[0]*vec4(mix(s0, s1, corner.y),0.0,0.0,1.0)).x;\n"
+  "  gl_ClipVertex = vec4(e,1.0);\n"
+  "  gl_Position = gl_ProjectionMatrix*vec4(e,1.0);\n"
+  "}\n";
+
+// Places the arrow mesh, which points along z from 0 to 1, at the position
+// of a quiver sample with its z axis along the vector of the sample. The
+// scalar is the length of the vector within the magnitude range.
+static const char* QUIVER_VERTEX_SHADER =
+  "#version 120\n"
+  "attribute vec3  corner, cornerNormal;\n"
+  "attribute vec3  position, vector;\n"
+  "uniform float scale;\n"
+  "uniform float magnitudeMin, magnitudeMax;\n"
+  "varying vec3  normal;\n"
+  "varying float scalar;\n"
+  "void main() {\n"
+  "  float len = length(vector);\n"
+  "  vec3 z = len > 0.0 ? vector/len : vec3(0.0,0.0,1.0);\n"
+  "  vec3 x = normalize(cross(abs(z.z) < 0.9 ? vec3(0.0,0.0,1.0) : vec3(1.0,0.0,0.0), z));\n"
+  "  vec3 y = cross(z, x);\n"
+  "  vec3 p = position + scale*len*(corner.x*x + corner.y*y + corner.z*z);\n"
+  "  normal = gl_NormalMatrix*(cornerNormal.x*x + cornerNormal.y*y + cornerNormal.z*z);\n"
+  "  scalar = magnitudeMax > magnitudeMin ? (len - magnitudeMin)/(magnitudeMax - magnitudeMin) : 0.0;\n"
+  "  vec4 e = gl_ModelViewMatrix*vec4(p,1.0);\n"
+  "  gl_ClipVertex = e;\n"
+  "  gl_Position = gl_ProjectionMatrix*e;\n"
+  "}\n";
+
+// Shades with a light at the camera, lighting both sides of ribbons.
+// Arrows of quivers are shaded the same way.
+static const char* TUBE_FRAGMENT_SHADER =
+  "#version 120\n"
+  "uniform vec4  color;\n"
+  "uniform float alpha;\n"
+  "uniform bool  useColorMap;\n"
+  "uniform sampler1D colorMap;\n"
+  "varying vec3  normal;\n"
+  "varying float scalar;\n"
+  "void main() {\n"
+  "  vec4  c = useColorMap ? texture1D(colorMap, scalar) : vec4(1.0);\n"
+  "  float d = abs(normalize(normal).z);\n"
+  "  gl_FragColor = vec4(c.rgb*color.rgb*(0.35 + 0.65*d) + 0.3*pow(d, 32.0), c.a*color.a*alpha);\n"
+  "}\n";
+
+// Returns the address of the GL function name in the current context, or NULL.
+// The address is kept on the context, since the widget and the render thread
+// of QPlot3DItem draw from different contexts, each current on one thread.
+static QFunctionPointer ResolveGL(const char* name) {
+  QOpenGLContext* tContext = QOpenGLContext::currentContext();
+  if(tContext == NULL) return NULL;
+
+  const QByteArray tKey = QByteArray("QPlot3D_") + name;
+  const QVariant tAddress = tContext->property(tKey.constData());
+  if(tAddress.isValid()) return (QFunctionPointer)(quintptr)tAddress.toULongLong();
+
+  const QFunctionPointer tFunction = tContext->getProcAddress(name);
+  tContext->setProperty(tKey.constData(), QVariant((qulonglong)(quintptr)tFunction));
+  return tFunction;
+}
+
+// Sets glBlendFuncSeparate (OpenGL 1.4), or glBlendFunc with the color
+// factors when it is not available.
+static void BlendFuncSeparate(GLenum srcRGB, GLenum dstRGB, GLenum srcAlpha, GLenum dstAlpha) {
+  const BlendFuncSeparateFunc tBlendFuncSeparate = (BlendFuncSeparateFunc)ResolveGL("glBlendFuncSeparate");
+  if(tBlendFuncSeparate != NULL) {
+    tBlendFuncSeparate(srcRGB, dstRGB, srcAlpha, dstAlpha);
+  } else {
+    glBlendFunc(srcRGB, dstRGB);
+  }
+}
+
+// Draws the strips with one call to glMultiDrawArrays (OpenGL 1.4), or one
+// glDrawArrays per strip when it is not available.
+static void MultiDrawArrays(GLenum mode, const QVector<GLint>& firsts, const QVector<GLsizei>& counts) {
+  const MultiDrawArraysFunc tMultiDrawArrays = (MultiDrawArraysFunc)ResolveGL("glMultiDrawArrays");
+  if(tMultiDrawArrays != NULL) {
+    tMultiDrawArrays(mode, firsts.constData(), counts.constData(), firsts.size());
+    return;
+  }
+  for (int i = 0; i < firsts.size(); i++) {
+    glDrawArrays(mode, firsts[i], counts[i]);
+  }
+}
+
+// Instancing (OpenGL 3.3 or ARB_instanced_arrays) in the current context
+static VertexAttribDivisorFunc ResolveVertexAttribDivisor() {
+  const VertexAttribDivisorFunc tFunction = (VertexAttribDivisorFunc)ResolveGL("glVertexAttribDivisor");
+  return tFunction != NULL ? tFunction : (VertexAttribDivisorFunc)ResolveGL("glVertexAttribDivisorARB");
+}
+
+static DrawArraysInstancedFunc ResolveDrawArraysInstanced() {
+  const DrawArraysInstancedFunc tFunction = (DrawArraysInstancedFunc)ResolveGL("glDrawArraysInstanced");
+  return tFunction != NULL ? tFunction : (DrawArraysInstancedFunc)ResolveGL("glDrawArraysInstancedARB");
+}
+
+// Only called after QPlot3D::initTubes() has found both functions
+static void VertexAttribDivisor(GLuint index, GLuint divisor) {
+  ResolveVertexAttribDivisor()(index, divisor);
+}
+
+static void DrawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei instanceCount) {
+  ResolveDrawArraysInstanced()(mode, first, count, instanceCount);
+}
+
+// Writes the elements of data that are not yet in buffer to the end of it.
+// The buffer grows when needed, in which case all elements are written again.
+static void UploadTail(QGLBuffer& buffer, int* count, int* capacity, const void* data, int size, int stride) {
+  buffer.bind();
+  if(size > *capacity) {
+    *capacity = std::max(1024, size + size/2);
+    buffer.allocate(*capacity*stride);
+    *count = 0;
+  }
+  if(*count < size) {
+    buffer.write(*count*stride, (const char*)data + *count*stride, (size-*count)*stride);
+    *count = size;
+  }
+}
+
+// Writes count elements of elementSize bytes in chunks. Each chunk starts with
+// its number of elements, whether it is compressed and its size in bytes.
+// Elements that are stride bytes apart are gathered into each chunk.
+static void WriteChunks(QDataStream& stream, const char* data, qint64 count, int elementSize, bool compress, int stride = 0) {
+  QByteArray tGathered;
+  for (qint64 i = 0; i < count; i += SCENE_CHUNK_SIZE) {
+    const qint32 tCount = (qint32)std::min<qint64>(SCENE_CHUNK_SIZE, count-i);
+    const char*  tData  = data + i*elementSize;
+    const int    tBytes = tCount*elementSize;
+    if(stride > 0 && stride != elementSize) {
+      tGathered.resize(tBytes);
+      for (int j = 0; j < tCount; j++) {
+        memcpy(tGathered.data() + j*elementSize, data + (i+j)*stride, elementSize);
+      }
+      tData = tGathered.constData();
+    }
+    if(compress) {
+      const QByteArray tCompressed = qCompress((const uchar*)tData, tBytes);
+      stream << tCount << true << (qint64)tCompressed.size();
+      stream.writeRawData(tCompressed.constData(), tCompressed.size());
+    } else {
+      stream << tCount << false << (qint64)tBytes;
+      stream.writeRawData(tData, tBytes);
+    }
+  }
+}
+
+// Reads chunks written by WriteChunks() into data. Uncompressed chunks are
+// copied from map, the mapped file of the stream, when it is not NULL.
+static bool ReadChunks(QDataStream& stream, const uchar* map, char* data, qint64 count, int elementSize) {
+  QIODevice* tDevice = stream.device();
+  qint64 i = 0;
+  while(i < count) {
+    qint32 tCount;
+    bool   tCompressed;
+    qint64 tBytes;
+    stream >> tCount >> tCompressed >> tBytes;
+    if(stream.status() != QDataStream::Ok || tCount <= 0 || i+tCount > count || tBytes < 0) return false;
+
+    char* tDest = data + i*elementSize;
+    const qint64 tSize = (qint64)tCount*elementSize;
+    if(tCompressed) {
+      QByteArray tChunk((int)tBytes, Qt::Uninitialized);
+      if(stream.readRawData(tChunk.data(), tChunk.size()) != tBytes) return false;
+      const QByteArray tRaw = qUncompress(tChunk);
+      if(tRaw.size() != tSize) return false;
+      memcpy(tDest, tRaw.constData(), tSize);
+    } else if(map != NULL) {
+      const qint64 tPos = tDevice->pos();
+      if(tBytes != tSize || tPos+tBytes > tDevice->size()) return false;
+      memcpy(tDest, map + tPos, tSize);
+      tDevice->seek(tPos+tBytes);
+    } else {
+      if(tBytes != tSize || stream.readRawData(tDest, (int)tSize) != tSize) return false;
+    }
+    i += tCount;
+  }
+  return true;
+}
+
+static QVector<QColor> DefaultColorMap() {
+  QVector<QColor> tColors;
+  tColors << QColor(0,0,143) << QColor(0,0,255) << QColor(0,255,255) 
+          << QColor(255,255,0) << QColor(255,0,0) << QColor(128,0,0);
+  return tColors;
+}
+
+// Returns the color at t in [0,1] interpolated along the colormap, or white
+// for an empty colormap
+static QColor ColorMapColor(const QVector<QColor>& colors, double t) {
+  if(colors.isEmpty()) return Qt::white;
+  if(colors.size() == 1) return colors[0];
+  const double tPos   = qBound(0.0, t, 1.0)*(colors.size()-1);
+  const int    tIndex = std::min((int)tPos, colors.size()-2);
+  const double tFrac  = tPos - tIndex;
+  const QColor& c0 = colors[tIndex];
+  const QColor& c1 = colors[tIndex+1];
+  return QColor::fromRgbF(c0.redF()   + tFrac*(c1.redF()  -c0.redF()),
+                          c0.greenF() + tFrac*(c1.greenF()-c0.greenF()),
+                          c0.blueF()  + tFrac*(c1.blueF() -c0.blueF()),
+                          c0.alphaF() + tFrac*(c1.alphaF()-c0.alphaF()));
+}
+
+// Fills the bound 1D texture with colors interpolated along the colormap
+static void UploadColorMap(const QVector<QColor>& colors) {
+  QVector<GLubyte> tTexels(4*COLORMAP_SIZE);
+  for (int i = 0; i < COLORMAP_SIZE; i++) {
+    const QColor tColor = ColorMapColor(colors, (double)i/(COLORMAP_SIZE-1));
+    tTexels[4*i+0] = tColor.red();
+    tTexels[4*i+1] = tColor.green();
+    tTexels[4*i+2] = tColor.blue();
+    tTexels[4*i+3] = tColor.alpha();
+  }
+  glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA, COLORMAP_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, tTexels.constData());
+}
+
+// Writes the color of density t in [0,1] through the default colormap, with
+// alpha from minAlpha to maxAlpha. Empty cells are transparent.
+static void DensityColor(double t, double minAlpha, double maxAlpha, GLubyte* rgba) {
+  static const QVector<QColor> tColors = DefaultColorMap();
+  if(t <= 0.0) {
+    rgba[0] = rgba[1] = rgba[2] = rgba[3] = 0;
+    return;
+  }
+  const double tPos   = std::min(t, 1.0)*(tColors.size()-1);
+  const int    tIndex = std::min((int)tPos, tColors.size()-2);
+  const double tFrac  = tPos - tIndex;
+  const QColor& c0 = tColors[tIndex];
+  const QColor& c1 = tColors[tIndex+1];
+  rgba[0] = (GLubyte)(c0.red()   + tFrac*(c1.red()  -c0.red()));
+  rgba[1] = (GLubyte)(c0.green() + tFrac*(c1.green()-c0.green()));
+  rgba[2] = (GLubyte)(c0.blue()  + tFrac*(c1.blue() -c0.blue()));
+  rgba[3] = (GLubyte)(255*(minAlpha + std::min(t, 1.0)*(maxAlpha-minAlpha)));
+}
+
+// Projects vec into window coordinates using the modelview matrix m and the
+// projection matrix p. Returns false if vec is behind the camera.
+static bool ProjectToScreen(const GLdouble* m, const GLdouble* p, int width, int height, const QVector3D& vec, QVector3D* out) {
+  // M*v
+  const double f1 = m[0]*vec.x() + m[4]*vec.y() + m[8]*vec.z() + m[12];
+  const double f2 = m[1]*vec.x() + m[5]*vec.y() + m[9]*vec.z() + m[13];
+  const double f3 = m[2]*vec.x() + m[6]*vec.y() + m[10]*vec.z() + m[14];
+  const double f4 = m[3]*vec.x() + m[7]*vec.y() + m[11]*vec.z() + m[15];
+
+  // P*M*v
+  double g1 = p[0]*f1 + p[4]*f2 + p[8]*f3  + p[12]*f4;
+  double g2 = p[1]*f1 + p[5]*f2 + p[9]*f3  + p[13]*f4;
+  double g3 = p[2]*f1 + p[6]*f2 + p[10]*f3 + p[14]*f4;
+  double g4 = -f3;
+
+  if(g4 == 0.0) return false;
+  g1 /= g4;
+  g2 /= g4;
+  g3 /= g4;
+
+  *out = QVector3D( (g1*0.5+0.5)*width, 
+                    height - (g2*0.5+0.5)*height,
+                    (1.0+g3)*0.5);
+  return g4 > 0.0;
+}
+
+// Sets out to the column major product of a and b
+static void MultiplyMatrix(const GLdouble* a, const QMatrix4x4& b, GLdouble* out) {
+  const float* tB = b.constData();
+  for (int c = 0; c < 4; c++) {
+    for (int r = 0; r < 4; r++) {
+      out[c*4+r] = a[r]*tB[c*4] + a[4+r]*tB[c*4+1] + a[8+r]*tB[c*4+2] + a[12+r]*tB[c*4+3];
+    }
+  }
+}
+
+// Returns the sides of rect that point is outside of, as bits
+static int OutCode(const QPointF& point, const QRectF& rect) {
+  return (point.x() < rect.left()   ? 1 : 0) | (point.x() > rect.right()  ? 2 : 0) |
+         (point.y() < rect.top()    ? 4 : 0) | (point.y() > rect.bottom() ? 8 : 0);
+}
+
+// Removes the vertices of polyline that are within tolerance of the segment
+// between the vertices kept around them (Douglas-Peucker), in windows of
+// EXPORT_SIMPLIFY_WINDOW vertices whose ends are always kept.
+static void SimplifyPolyline(QPolygonF* polyline, double tolerance) {
+  const int n = polyline->size();
+  if(n < 3) return;
+  const QPointF* p = polyline->constData();
+  QVector<bool> tKeep(n, false);
+  tKeep[n-1] = true;
+  QVector<QPair<int,int> > tStack;
+  for (int i = 0; i < n-1; i += EXPORT_SIMPLIFY_WINDOW) {
+    tKeep[i] = true;
+    tStack.push_back(qMakePair(i, std::min(i + EXPORT_SIMPLIFY_WINDOW, n-1)));
+  }
+  while(!tStack.isEmpty()) {
+    const QPair<int,int> tSpan = tStack.last();
+    tStack.pop_back();
+    const QPointF tA = p[tSpan.first];
+    const QPointF tD = p[tSpan.second] - tA;
+    const double  tLength2 = QPointF::dotProduct(tD, tD);
+    double tMax   = 0.0;
+    int    tIndex = -1;
+    for (int i = tSpan.first+1; i < tSpan.second; i++) {
+      const QPointF tV = p[i] - tA;
+      const double  tT = tLength2 > 0.0 ? qBound(0.0, QPointF::dotProduct(tV, tD)/tLength2, 1.0) : 0.0;
+      const QPointF tE = tV - tT*tD;
+      const double  tDistance2 = QPointF::dotProduct(tE, tE);
+      if(tDistance2 > tMax) {
+        tMax   = tDistance2;
+        tIndex = i;
+      }
+    }
+    if(tMax > tolerance*tolerance) {
+      tKeep[tIndex] = true;
+      tStack.push_back(qMakePair(tSpan.first, tIndex));
+      tStack.push_back(qMakePair(tIndex, tSpan.second));
+    }
+  }
+  QPolygonF tKept;
+  for (int i = 0; i < n; i++) {
+    if(tKeep[i]) tKept.push_back(p[i]);
+  }
+  polyline->swap(tKept);
+}
+
+// Simplifies and draws polyline, and clears it for the next one
+static void FlushPolyline(QPainter* painter, QPolygonF* polyline, double tolerance) {
+  if(polyline->size() >= 2) {
+    SimplifyPolyline(polyline, tolerance);
+    painter->drawPolyline(*polyline);
+  }
+  polyline->clear();
+}
+
+// Returns a gradient from from to to through the colors of a colormap
+static QLinearGradient ColorMapGradient(const QVector<QColor>& colors, const QPointF& from, const QPointF& to) {
+  QLinearGradient tGradient(from, to);
+  if(colors.size() < 2) {
+    tGradient.setColorAt(0.0, ColorMapColor(colors, 0.0));
+    tGradient.setColorAt(1.0, ColorMapColor(colors, 0.0));
+  } else {
+    for (int i = 0; i < colors.size(); i++) {
+      tGradient.setColorAt((double)i/(colors.size()-1), colors[i]);
+    }
+  }
+  return tGradient;
+}
+
+static bool RangeContains(const QRange& outer, const QRange& inner) {
+  return inner.min.x() >= outer.min.x() && inner.min.y() >= outer.min.y() && inner.min.z() >= outer.min.z() &&
+         inner.max.x() <= outer.max.x() && inner.max.y() <= outer.max.y() && inner.max.z() <= outer.max.z();
+}
+
+// Returns true if range lies entirely outside one of the planes of the view
+// volume given by the modelview matrix m and the projection matrix p.
+static bool RangeOutsideView(const GLdouble* m, const GLdouble* p, const QRange& range) {
+  int tOutside[6] = {0, 0, 0, 0, 0, 0};
+
+  for (int i = 0; i < 8; i++) {
+    const QVector3D tCorner((i & 1) ? range.max.x() : range.min.x(),
+                            (i & 2) ? range.max.y() : range.min.y(),
+                            (i & 4) ? range.max.z() : range.min.z());
+    const double f1 = m[0]*tCorner.x() + m[4]*tCorner.y() + m[8]*tCorner.z()  + m[12];
+    const double f2 = m[1]*tCorner.x() + m[5]*tCorner.y() + m[9]*tCorner.z()  + m[13];
+    const double f3 = m[2]*tCorner.x() + m[6]*tCorner.y() + m[10]*tCorner.z() + m[14];
+    const double f4 = m[3]*tCorner.x() + m[7]*tCorner.y() + m[11]*tCorner.z() + m[15];
+
+    // Clip coordinates
+    const double g1 = p[0]*f1 + p[4]*f2 + p[8]*f3  + p[12]*f4;
+    const double g2 = p[1]*f1 + p[5]*f2 + p[9]*f3  + p[13]*f4;
+    const double g3 = p[2]*f1 + p[6]*f2 + p[10]*f3 + p[14]*f4;
+    const double g4 = p[3]*f1 + p[7]*f2 + p[11]*f3 + p[15]*f4;
+
+    if(g1 < -g4) tOutside[0]++;
+    if(g1 >  g4) tOutside[1]++;
+    if(g2 < -g4) tOutside[2]++;
+    if(g2 >  g4) tOutside[3]++;
+    if(g3 < -g4) tOutside[4]++;
+    if(g3 >  g4) tOutside[5]++;
+  }
+
+  for (int i = 0; i < 6; i++) {
+    if(tOutside[i] == 8) return true;
+  }
+  return false;
+}
+
+// Returns true if pos is within radius pixels of the screen projection of range.
+// Ranges that are partly behind the camera are always considered hit.
+static bool RangeNearScreenPoint(const GLdouble* m, const GLdouble* p, int width, int height, const QRange& range, const QPointF& pos, double radius) {
+  double minX =  std::numeric_limits<double>::max();
+  double minY =  std::numeric_limits<double>::max();
+  double maxX = -std::numeric_limits<double>::max();
+  double maxY = -std::numeric_limits<double>::max();
+
+  for (int i = 0; i < 8; i++) {
+    const QVector3D tCorner((i & 1) ? range.max.x() : range.min.x(),
+                            (i & 2) ? range.max.y() : range.min.y(),
+                            (i & 4) ? range.max.z() : range.min.z());
+    QVector3D tScreen;
+    if(!ProjectToScreen(m,p,width,height,tCorner,&tScreen)) return true;
+    minX = qMin(minX, (double)tScreen.x());
+    minY = qMin(minY, (double)tScreen.y());
+    maxX = qMax(maxX, (double)tScreen.x());
+    maxY = qMax(maxY, (double)tScreen.y());
+  }
+
+  return pos.x() >= minX-radius && pos.x() <= maxX+radius &&
+         pos.y() >= minY-radius && pos.y() <= maxY+radius;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // QRANGE
 ////////////////////////////////////////////////////////////////////////////////
@@ -64,6 +620,11 @@ QRange::QRange(double _min, double _max):
   max(_max,_max,_max) 
 {}
 
+QRange::QRange(const QVector3D& _min, const QVector3D& _max):
+  min(_min),
+  max(_max)
+{}
+
 QVector3D QRange::center() const { 
   return 0.5*(max+min);
 }
@@ -84,6 +645,283 @@ void QRange::setIfMax(QVector3D vec) {
   if(vec.z() > max.z()) max.setZ(vec.z());
 }
 
+static void AddToPickIndex(QVector<QRange>& leaves, QVector<QRange>& nodes, int index, const QVector3D& vertex) {
+  const QRange tEmpty(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max());
+
+  const int tLeaf = index/PICK_LEAF_SIZE;
+  if(tLeaf == leaves.size()) leaves.push_back(tEmpty);
+  leaves[tLeaf].setIfMin(vertex);
+  leaves[tLeaf].setIfMax(vertex);
+
+  const int tNode = tLeaf/PICK_NODE_SIZE;
+  if(tNode == nodes.size()) nodes.push_back(tEmpty);
+  nodes[tNode].setIfMin(vertex);
+  nodes[tNode].setIfMax(vertex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// QCURVEDERIVED
+////////////////////////////////////////////////////////////////////////////////
+
+// Data derived from the vertices of a curve with a given serial.
+class QCurveDerived {
+ public:
+  QCurveDerived(int _serial, int _count):
+    serial(_serial),
+    count(_count),
+    range(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max())
+  {}
+  int serial;
+  int count;
+  QRange range;
+  QVector<QRange> pickLeaves;
+  QVector<QRange> pickNodes;
+};
+
+// State shared between a curve and its jobs, so that jobs can outlive the curve.
+class QCurveDerivedState {
+ public:
+  QCurveDerivedState(): serial(0), result(NULL) {}
+  ~QCurveDerivedState() { delete result.fetchAndStoreOrdered(NULL); }
+
+  // Serial of the latest job, older jobs stop as soon as they notice.
+  QAtomicInt serial;
+  // Finished result that has not been picked up by the curve yet.
+  QAtomicPointer<QCurveDerived> result;
+};
+
+// Computes the pick index from the vertices starting at first, which is the
+// start of a leaf, and the leaves before it that are still valid.
+class QCurveDerivedJob: public QRunnable {
+ public:
+  QCurveDerivedJob(QSharedPointer<QCurveDerivedState> state, const QVector<QRange>& leaves,
+                   const QVector<QVector3D>& vertices, int first, int serial):
+    mState(state),
+    mLeaves(leaves),
+    mVertices(vertices),
+    mFirst(first),
+    mSerial(serial)
+  {}
+
+  void run() {
+    const QRange tEmpty(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max());
+    const int tSize = mVertices.size();
+    QCurveDerived* tResult = new QCurveDerived(mSerial, mFirst + tSize);
+    QVector<QRange>& tLeaves = tResult->pickLeaves;
+    tLeaves = mLeaves;
+    for (int i = 0; i < tSize; i++) {
+      if(i % JOB_CANCEL_INTERVAL == 0 && mState->serial.loadAcquire() != mSerial) {
+        delete tResult;
+        return;
+      }
+      const int tLeaf = (mFirst + i)/PICK_LEAF_SIZE;
+      if(tLeaf == tLeaves.size()) tLeaves.push_back(tEmpty);
+      tLeaves[tLeaf].setIfMin(mVertices[i]);
+      tLeaves[tLeaf].setIfMax(mVertices[i]);
+    }
+
+    // The nodes and the range follow from the leaves
+    const int nLeaves = tLeaves.size();
+    for (int i = 0; i < nLeaves; i++) {
+      const int tNode = i/PICK_NODE_SIZE;
+      if(tNode == tResult->pickNodes.size()) tResult->pickNodes.push_back(tEmpty);
+      tResult->pickNodes[tNode].setIfMin(tLeaves[i]);
+      tResult->pickNodes[tNode].setIfMax(tLeaves[i]);
+      tResult->range.setIfMin(tLeaves[i]);
+      tResult->range.setIfMax(tLeaves[i]);
+    }
+
+    // Publish, replacing a result that was never picked up
+    delete mState->result.fetchAndStoreOrdered(tResult);
+  }
+
+ private:
+  QSharedPointer<QCurveDerivedState> mState;
+  const QVector<QRange> mLeaves;
+  const QVector<QVector3D> mVertices;
+  const int mFirst;
+  const int mSerial;
+};
+
+// Writes a recorded frame to file on a writer thread.
+class QFrameWriter: public QRunnable {
+ public:
+  QFrameWriter(const QImage& image, const QString& fileName, QSemaphore* writerSlots):
+    mImage(image),
+    mFileName(fileName),
+    mWriterSlots(writerSlots)
+  {}
+
+  void run() {
+    mImage.convertToFormat(QImage::Format_RGB32).save(mFileName);
+    mWriterSlots->release();
+  }
+
+ private:
+  QImage  mImage;
+  QString mFileName;
+  QSemaphore* mWriterSlots;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// QDENSITY
+////////////////////////////////////////////////////////////////////////////////
+
+// Voxel counts of the visible curves of a plot over a box, and how far each
+// curve has been binned into them. Vertices are binned where they are drawn,
+// with the model transform of their curve and without the clipped ones.
+class QDensityGrid {
+ public:
+  QDensityGrid(): resolution(0), serial(0) {}
+  QRange box;
+  int    resolution;
+  int    serial;
+  QVector<quint32> counts;
+  QVector<QVector4D> clipPlanes;
+  QVector<const QCurve3D*> curves;
+  QVector<int> curveSerials, curveCounts;
+  QVector<QMatrix4x4> curveTransforms;
+};
+
+// State shared between a plot and its binning jobs.
+class QDensityState {
+ public:
+  QDensityState(): serial(0), result(NULL) {}
+  ~QDensityState() { delete result.fetchAndStoreOrdered(NULL); }
+
+  // Serial of the latest request, older jobs stop as soon as they notice.
+  QAtomicInt serial;
+  // Finished grid that has not been picked up by the plot yet.
+  QAtomicPointer<QDensityGrid> result;
+};
+
+// One binning request, split over several jobs. Each job bins its share of
+// the vertices into a histogram of its own and adds it to the grid, and the
+// job that finishes last publishes the grid.
+class QDensityBatch {
+ public:
+  QDensityBatch(): grid(NULL), remaining(0), canceled(false) {}
+  ~QDensityBatch() { delete grid; }
+  QSharedPointer<QDensityState> state;
+  // Copies of the vertices to bin, only those appended since the last grid
+  QList<QVector<QVector3D> > vertices;
+  QVector<QMatrix4x4> transforms;
+  QDensityGrid* grid;
+  QMutex mutex;
+  int  remaining;
+  bool canceled;
+};
+
+class QDensityJob: public QRunnable {
+ public:
+  QDensityJob(QSharedPointer<QDensityBatch> batch, qint64 first, qint64 end):
+    mBatch(batch),
+    mFirst(first),
+    mEnd(end)
+  {}
+
+  void run() {
+    QDensityBatch* b = mBatch.data();
+    const QDensityGrid* g = b->grid;
+    const int n = g->resolution;
+    const QVector3D tMin   = g->box.min;
+    const QVector3D tDelta = g->box.delta();
+    const QVector3D tScale(tDelta.x() > 0 ? n/tDelta.x() : 0.0,
+                           tDelta.y() > 0 ? n/tDelta.y() : 0.0,
+                           tDelta.z() > 0 ? n/tDelta.z() : 0.0);
+
+    // The vertices of the request are numbered across all curves
+    QVector<quint32> tCounts(n*n*n, 0);
+    bool   tCanceled = false;
+    qint64 tOffset   = 0;
+    int    tBinned   = 0;
+    const int nPlanes = g->clipPlanes.size();
+    for (int c = 0; c < b->vertices.size() && !tCanceled; c++) {
+      const qint64 tLength = b->vertices[c].size();
+      const qint64 i0 = std::max(mFirst, tOffset);
+      const qint64 i1 = std::min(mEnd, tOffset + tLength);
+      const QVector3D* tVertices = b->vertices[c].constData();
+      const QMatrix4x4& tTransform = b->transforms[c];
+      const bool tMap = !tTransform.isIdentity();
+      for (qint64 i = i0; i < i1; i++) {
+        if(++tBinned % JOB_CANCEL_INTERVAL == 0 && b->state->serial.loadAcquire() != g->serial) {
+          tCanceled = true;
+          break;
+        }
+        const QVector3D tVertex = tMap ? tTransform.map(tVertices[i - tOffset]) : tVertices[i - tOffset];
+        bool tClipped = false;
+        for (int p = 0; p < nPlanes && !tClipped; p++) {
+          tClipped = QVector3D::dotProduct(g->clipPlanes[p].toVector3D(), tVertex) + g->clipPlanes[p].w() < 0.0;
+        }
+        if(tClipped) continue;
+        const QVector3D tCell = (tVertex - tMin)*tScale;
+        if(tCell.x() < 0 || tCell.y() < 0 || tCell.z() < 0 || tCell.x() > n || tCell.y() > n || tCell.z() > n) continue;
+        const int x = std::min((int)tCell.x(), n-1);
+        const int y = std::min((int)tCell.y(), n-1);
+        const int z = std::min((int)tCell.z(), n-1);
+        tCounts[x + n*(y + n*z)]++;
+      }
+      tOffset += tLength;
+    }
+
+    QMutexLocker tLock(&b->mutex);
+    if(tCanceled) {
+      b->canceled = true;
+    } else if(!b->canceled) {
+      quint32* tGrid = b->grid->counts.data();
+      for (int i = 0; i < tCounts.size(); i++) {
+        tGrid[i] += tCounts[i];
+      }
+    }
+    if(--b->remaining > 0 || b->canceled || b->state->serial.loadAcquire() != g->serial) return;
+
+    // Publish, replacing a grid that was never picked up
+    delete b->state->result.fetchAndStoreOrdered(b->grid);
+    b->grid = NULL;
+  }
+
+ private:
+  QSharedPointer<QDensityBatch> mBatch;
+  const qint64 mFirst, mEnd;
+};
+
+// The density grid of a plot, and the textures and voxels drawn from it.
+class QDensity {
+ public:
+  QDensity():
+    state(new QDensityState),
+    serial(0),
+    pending(false),
+    dirty(false)
+  {
+    planeTextures[0] = planeTextures[1] = planeTextures[2] = 0;
+  }
+  ~QDensity() {
+    // Stop jobs that are still binning for this grid
+    state->serial.storeRelease(-1);
+    if(planeTextures[0] != 0) glDeleteTextures(3, planeTextures);
+  }
+
+  QSharedPointer<QDensityState> state;
+  QDensityGrid grid;
+  int  serial;
+  bool pending, dirty;
+  GLuint planeTextures[3];
+  QVector<QVector3D> voxelCenters;
+  QVector<GLubyte>   voxelColors;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// QPICKRESULT
+////////////////////////////////////////////////////////////////////////////////
+QPickResult::QPickResult():
+  curve(NULL),
+  cloud(NULL),
+  index(-1),
+  point(0.0,0.0,0.0),
+  distance(0.0)
+{}
+
 ////////////////////////////////////////////////////////////////////////////////
 // QCURVE3D
 ////////////////////////////////////////////////////////////////////////////////
@@ -92,7 +930,32 @@ QCurve3D::QCurve3D():
   mName(""),
   mColor(0,0,255),
   mLineWidth(1),
-  mRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max())
+  mVisible(true),
+  mStyle(LINE_STYLE),
+  mTubeRadius(0.05),
+  mTubeSides(8),
+  mRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max()),
+  mHasTransform(false),
+  mScale(1.0,1.0,1.0),
+  mShowShadows(false),
+  mShadowColor(0,0,0,64),
+  mColorMap(DefaultColorMap()),
+  mColorMapSerial(0),
+  mStyleSerial(0),
+  mAutoScalarRange(true),
+  mScalarMin(0.0),
+  mScalarMax(1.0),
+  mScalarDataMin(std::numeric_limits<double>::max()),
+  mScalarDataMax(-std::numeric_limits<double>::max()),
+  mSerial(0),
+  mDerivedState(new QCurveDerivedState),
+  mDerivedSerial(0),
+  mJobSerial(0),
+  mChangedFirst(std::numeric_limits<int>::max()),
+  mSimplifyTolerance(0.0),
+  mDroppedCount(0),
+  mFloating(false),
+  mLastFilter(KEEP_POINT)
 {
 }
 
@@ -100,10 +963,72 @@ QCurve3D::QCurve3D(QString name):
   mName(name),
   mColor(0,0,255),
   mLineWidth(1),
-  mRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max())
+  mVisible(true),
+  mStyle(LINE_STYLE),
+  mTubeRadius(0.05),
+  mTubeSides(8),
+  mRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max()),
+  mHasTransform(false),
+  mScale(1.0,1.0,1.0),
+  mShowShadows(false),
+  mShadowColor(0,0,0,64),
+  mColorMap(DefaultColorMap()),
+  mColorMapSerial(0),
+  mStyleSerial(0),
+  mAutoScalarRange(true),
+  mScalarMin(0.0),
+  mScalarMax(1.0),
+  mScalarDataMin(std::numeric_limits<double>::max()),
+  mScalarDataMax(-std::numeric_limits<double>::max()),
+  mSerial(0),
+  mDerivedState(new QCurveDerivedState),
+  mDerivedSerial(0),
+  mJobSerial(0),
+  mChangedFirst(std::numeric_limits<int>::max()),
+  mSimplifyTolerance(0.0),
+  mDroppedCount(0),
+  mFloating(false),
+  mLastFilter(KEEP_POINT)
 {
 }
 
+void QCurve3D::clearTransform() {
+  mHasTransform = false;
+  mTranslation  = QVector3D();
+  mRotation     = QQuaternion();
+  mScale        = QVector3D(1.0,1.0,1.0);
+}
+
+QMatrix4x4 QCurve3D::transform() const {
+  QMatrix4x4 tTransform;
+  if(!mHasTransform) return tTransform;
+  tTransform.translate(mTranslation);
+  tTransform.rotate(mRotation);
+  tTransform.scale(mScale);
+  return tTransform;
+}
+
+// The range of the transformed corners of the range of the vertices
+QRange QCurve3D::transformedRange() const {
+  if(!mHasTransform || mVertices.isEmpty()) return mRange;
+  const QMatrix4x4 tTransform = transform();
+  QRange tRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max());
+  for (int i = 0; i < 8; i++) {
+    const QVector3D tCorner((i & 1) ? mRange.max.x() : mRange.min.x(),
+                            (i & 2) ? mRange.max.y() : mRange.min.y(),
+                            (i & 4) ? mRange.max.z() : mRange.min.z());
+    const QVector3D tPoint = tTransform.map(tCorner);
+    tRange.setIfMin(tPoint);
+    tRange.setIfMax(tPoint);
+  }
+  return tRange;
+}
+
+QCurve3D::~QCurve3D() {
+  // Stop jobs that are still working on this curve
+  mDerivedState->serial.storeRelease(-1);
+}
+
 void QCurve3D::addData( const double& x, const double& y, const double& z) {
   addData(QVector3D(x,y,z));
 }
@@ -122,92 +1047,573 @@ void QCurve3D::addData( const QVector<QVector3D>& data) {
   }
 }
 
-void QCurve3D::addData(const QVector3D& data) {
-  mRange.setIfMin(data);
-  mRange.setIfMax(data);
+void QCurve3D::addData( const double& x, const double& y, const double& z, const double& time) {
+  addData(QVector3D(x,y,z),time);
+}
 
-  mVertices.push_back(data);
-  mFaces.push_back(mVertices.size()-1);
+// Returns true if data marks a gap in the curve
+static bool IsGapMarker(const QVector3D& data) {
+  return qIsNaN(data.x()) || qIsNaN(data.y()) || qIsNaN(data.z());
 }
 
-QVector3D&  QCurve3D::operator[](int i) {
-  return value(i);
+void QCurve3D::addData(const QVector3D& data, double time) {
+  if(IsGapMarker(data)) {
+    mLastFilter = DROP_POINT;
+    addBreak();
+    return;
+  }
+
+  // Keep the timestamps monotonic so that they can be binary searched
+  if(!mTimes.isEmpty() && time < mTimes.last()) time = mTimes.last();
+
+  const FilterResult tResult = filterPoint(data);
+  mLastFilter = tResult;
+  if(tResult == DROP_POINT) return;
+  if(tResult == REPLACE_POINT) {
+    if(mTimes.size() == mVertices.size()) mTimes.last() = time;
+    return;
+  }
+
+  mTimes.push_back(time);
+  appendVertex(data);
 }
 
-const QVector3D&  QCurve3D::operator[](int i) const {
-  return value(i);
+// Decides where an attribute goes when the curve already has count of them.
+// Returns false if it belongs to a point that was dropped. An attribute for
+// the last vertex that is added again replaces the old one only if the
+// simplification moved that vertex.
+bool QCurve3D::attributeIndex(int count, int* index) const {
+  if(count < mVertices.size() || mVertices.isEmpty()) {
+    *index = count;
+    return true;
+  }
+  *index = count-1;
+  return mLastFilter == REPLACE_POINT;
 }
 
-void QCurve3D::draw() const {
-  glVertexPointer(3,GL_FLOAT, 0, mVertices.constData());
+void QCurve3D::addScalar(double value) {
+  int tIndex;
+  if(!attributeIndex(mScalars.size(), &tIndex)) return;
+  extendScalarRange(value);
+  if(tIndex < mScalars.size())
+    mScalars[tIndex] = value;
+  else
+    mScalars.push_back(value);
+}
 
-  glLineWidth(mLineWidth);
-  glColor3f(mColor.red()/255.0,mColor.green()/255.0,mColor.blue()/255.0);  
-  glEnableClientState(GL_VERTEX_ARRAY);    
-  glDrawElements(GL_LINE_STRIP,mFaces.count(),GL_UNSIGNED_SHORT, (GLushort*) mFaces.constData());
-  glDisableClientState(GL_VERTEX_ARRAY);    
-  glLineWidth(1);
+void QCurve3D::addRadius(double value) {
+  int tIndex;
+  if(!attributeIndex(mRadii.size(), &tIndex)) return;
+  if(tIndex < mRadii.size())
+    mRadii[tIndex] = value;
+  else
+    mRadii.push_back(value);
+}
 
+void QCurve3D::setScalar(int index, double value) {
+  extendScalarRange(value);
+  if(scalarOffset() < 0)
+    mScalars[index] = value;
+  else
+    *(float*)((char*)attributeData() + index*attributeStride() + scalarOffset()) = value;
+  mSerial++;
 }
 
+void QCurve3D::extendScalarRange(double value) {
+  if(value < mScalarDataMin) mScalarDataMin = value;
+  if(value > mScalarDataMax) mScalarDataMax = value;
+}
 
-////////////////////////////////////////////////////////////////////////////////
-// QAXIS
-////////////////////////////////////////////////////////////////////////////////
-QAxis::QAxis():
-  mRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max()),
-  mAxis(X_AXIS),
-  mAdjustPlaneView(true),
-  mShowPlane(true),
-  mShowGrid(true),
-  mShowAxis(true),
-  mShowLabel(true),
-  mShowAxisBox(false),
-  mXLabel("X"),
-  mYLabel("Y"),
-  mPlaneColor(230,230,242),
-  //  mGridColor(204,204,217),
-  mGridColor(128,128,128),
-  mLabelColor(0,0,0),
-  mShowLowerTicks(false),
-  mShowUpperTicks(false),
-  mShowLeftTicks(false),
-  mShowRightTicks(false),
-  mTranslate(0.0),
-  mScale(5.0),
-  mLabelFont("Helvetica",12),
-  mTicksFont("Helvetica",10)
-  
-{
+// The scalars and timestamps, with the number of bytes from one to the next
+const float* QCurve3D::scalarData() const {
+  if(scalarOffset() < 0) return mScalars.constData();
+  return (const float*)((const char*)attributeData() + scalarOffset());
 }
 
-void QAxis::setRange(QRange range) {
+int QCurve3D::scalarStride() const {
+  return scalarOffset() < 0 ? (int)sizeof(float) : attributeStride();
+}
 
-  mRange = range;
+const double* QCurve3D::timeData() const {
+  if(timeOffset() < 0) return mTimes.constData();
+  return (const double*)((const char*)attributeData() + timeOffset());
+}
 
-  if(mAxis == X_AXIS) 
-    {
-      mXTicks = getTicks(mRange.min.x(), mRange.max.x());
-      mYTicks = getTicks(mRange.min.y(), mRange.max.y());
-      mZTicks = getTicks(mRange.min.z(), mRange.max.z());
-      mShowUpperTicks = true;
-      mShowRightTicks = true;
-    } 
-  else if (mAxis == Y_AXIS)  
-    {
-      mXTicks = getTicks(mRange.min.y(), mRange.max.y());
-      mYTicks = getTicks(mRange.min.z(), mRange.max.z());
-      mZTicks = getTicks(mRange.min.x(), mRange.max.x());
-    } 
-  else 
-    {
-      mXTicks = getTicks(mRange.min.z(), mRange.max.z());
-      mYTicks = getTicks(mRange.min.x(), mRange.max.x());
-      mZTicks = getTicks(mRange.min.y(), mRange.max.y());
-      mShowUpperTicks = true;
-    }
+int QCurve3D::timeStride() const {
+  return timeOffset() < 0 ? (int)sizeof(double) : attributeStride();
+}
 
-  mTranslate = mZTicks[0];
+void QCurve3D::addData(const QVector3D& data) {
+  if(IsGapMarker(data)) {
+    mLastFilter = DROP_POINT;
+    addBreak();
+    return;
+  }
+  mLastFilter = filterPoint(data);
+  if(mLastFilter != KEEP_POINT) return;
+  appendVertex(data);
+}
+
+// Ends the current line, the next vertex starts a new one
+void QCurve3D::addBreak() {
+  const int tSize = mVertices.size();
+  if(tSize == 0 || (!mBreaks.isEmpty() && mBreaks.last() == tSize)) return;
+  mBreaks.push_back(tSize);
+}
+
+void QCurve3D::appendVertex(const QVector3D& data) {
+  mRange.setIfMin(data);
+  mRange.setIfMax(data);
+
+  mVertices.push_back(data);
+
+  addToPickIndex(mVertices.size()-1);
+}
+
+// Decides in constant time whether data is added as a new vertex, dropped, or
+// moves the last vertex. The last vertex stays on the line it started on, so
+// every point it replaces is within the tolerance of the drawn segment.
+QCurve3D::FilterResult QCurve3D::filterPoint(const QVector3D& data) {
+  if(mSimplifyTolerance <= 0.0 || mVertices.isEmpty()) return KEEP_POINT;
+
+  // The first vertex after a gap is never merged with the line before it
+  if(!mBreaks.isEmpty() && mBreaks.last() == mVertices.size()) {
+    mFloating = false;
+    return KEEP_POINT;
+  }
+
+  const double tTolerance2 = mSimplifyTolerance*mSimplifyTolerance;
+  const int tLast = mVertices.size()-1;
+  const QVector3D tPrev = mVertices[tLast];
+
+  // Nearly identical to the last point
+  if((data - tPrev).lengthSquared() <= tTolerance2) {
+    mDroppedCount++;
+    return DROP_POINT;
+  }
+
+  if(mFloating && tLast > 0) {
+    const QVector3D& tAnchor = mVertices[tLast-1];
+    const QVector3D tDelta   = data - tAnchor;
+    const double tAlong = QVector3D::dotProduct(tDelta, mSimplifyDirection);
+    const double tPrevAlong = QVector3D::dotProduct(tPrev - tAnchor, mSimplifyDirection);
+    if(tAlong >= tPrevAlong && (tDelta - tAlong*mSimplifyDirection).lengthSquared() <= tTolerance2) {
+      mVertices[tLast] = data;
+      mRange.setIfMin(data);
+      mRange.setIfMax(data);
+      addToPickIndex(tLast);
+      mDroppedCount++;
+      return REPLACE_POINT;
+    }
+  }
+
+  // Start a new line from the last vertex
+  mSimplifyDirection = (data - tPrev).normalized();
+  mFloating = true;
+  return KEEP_POINT;
+}
+
+void QCurve3D::clear() {
+  mVertices.clear();
+  mTimes.clear();
+  mScalars.clear();
+  mRadii.clear();
+  mBreaks.clear();
+  clearAttributes();
+  mScalarDataMin =  std::numeric_limits<double>::max();
+  mScalarDataMax = -std::numeric_limits<double>::max();
+  mSerial++;
+  mPickLeaves.clear();
+  mPickNodes.clear();
+  mRange = QRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max());
+  mDroppedCount = 0;
+  mFloating = false;
+  mLastFilter = KEEP_POINT;
+
+  // Nothing to derive from an empty curve, cancel running jobs
+  mChangedFirst  = std::numeric_limits<int>::max();
+  mDerivedSerial = mSerial;
+  mDerivedState->serial.storeRelease(mSerial);
+}
+
+// Bytes allocated for vertices, timestamps, scalars and layout attributes
+qint64 QCurve3D::cpuBytes() const {
+  return (qint64)mVertices.capacity()*sizeof(QVector3D) +
+         (qint64)mTimes.capacity()*sizeof(double) +
+         (qint64)mScalars.capacity()*sizeof(float) +
+         (qint64)mRadii.capacity()*sizeof(float) +
+         (qint64)mBreaks.capacity()*sizeof(int) +
+         (qint64)size()*attributeStride();
+}
+
+// Bytes allocated for data derived from the vertices, like the pick index
+qint64 QCurve3D::derivedBytes() const {
+  return (qint64)(mPickLeaves.capacity() + mPickNodes.capacity())*sizeof(QRange);
+}
+
+void QCurve3D::addToPickIndex(int index) {
+  AddToPickIndex(mPickLeaves, mPickNodes, index, mVertices[index]);
+}
+
+// Computes the range, the scalar range and the pick index from scratch,
+// after the data has been written directly.
+void QCurve3D::rebuildDerived() {
+  mRange = QRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max());
+  mPickLeaves.clear();
+  mPickNodes.clear();
+  const int tSize = mVertices.size();
+  for (int i = 0; i < tSize; i++) {
+    mRange.setIfMin(mVertices[i]);
+    mRange.setIfMax(mVertices[i]);
+    addToPickIndex(i);
+  }
+
+  mScalarDataMin =  std::numeric_limits<double>::max();
+  mScalarDataMax = -std::numeric_limits<double>::max();
+  const int nScalars = mScalars.size();
+  for (int i = 0; i < nScalars; i++) {
+    if(mScalars[i] < mScalarDataMin) mScalarDataMin = mScalars[i];
+    if(mScalars[i] > mScalarDataMax) mScalarDataMax = mScalars[i];
+  }
+
+  mSerial++;
+  mChangedFirst  = std::numeric_limits<int>::max();
+  mDerivedSerial = mSerial;
+  mDerivedState->serial.storeRelease(mSerial);
+}
+
+// Picks up the range and pick index computed by a worker, and starts a new
+// job if vertices have changed since they were last computed. Returns true if
+// a result was picked up.
+bool QCurve3D::updateDerived(QThreadPool* pool) {
+  bool tUpdated = false;
+  QCurveDerived* tResult = mDerivedState->result.fetchAndStoreAcquire(NULL);
+  if(tResult != NULL) {
+    if(tResult->serial == mSerial) {
+      mRange      = tResult->range;
+      mPickLeaves = tResult->pickLeaves;
+      mPickNodes  = tResult->pickNodes;
+
+      // Add the vertices appended since the snapshot was taken, and the last
+      // vertex of the snapshot which may have been moved by the simplification
+      for (int i = std::max(0, tResult->count-1); i < mVertices.size(); i++) {
+        mRange.setIfMin(mVertices[i]);
+        mRange.setIfMax(mVertices[i]);
+        addToPickIndex(i);
+      }
+      mChangedFirst  = std::numeric_limits<int>::max();
+      mDerivedSerial = mSerial;
+      tUpdated = true;
+    }
+    delete tResult;
+  }
+
+  if(mDerivedSerial == mSerial || mJobSerial == mSerial) return tUpdated;
+
+  // Only the scalars have changed
+  if(mChangedFirst >= mVertices.size()) {
+    mChangedFirst  = std::numeric_limits<int>::max();
+    mDerivedSerial = mSerial;
+    mDerivedState->serial.storeRelease(mSerial);
+    return tUpdated;
+  }
+
+  // The job gets a copy of the vertices from the leaf of the first changed
+  // one, so that appending to the curve never has to copy all vertices.
+  const int tFirstLeaf = mChangedFirst/PICK_LEAF_SIZE;
+  const int tFirst     = tFirstLeaf*PICK_LEAF_SIZE;
+  QVector<QVector3D> tVertices(mVertices.size() - tFirst);
+  std::copy(mVertices.constBegin() + tFirst, mVertices.constEnd(), tVertices.begin());
+
+  mJobSerial = mSerial;
+  mDerivedState->serial.storeRelease(mSerial);
+  pool->start(new QCurveDerivedJob(mDerivedState, mPickLeaves.mid(0, tFirstLeaf), tVertices, tFirst, mSerial));
+  return tUpdated;
+}
+
+QVector3D&  QCurve3D::operator[](int i) {
+  return value(i);
+}
+
+const QVector3D&  QCurve3D::operator[](int i) const {
+  return value(i);
+}
+
+// Binary searches size timestamps that are stride bytes apart for the first
+// one not before t, or after t when upper is set.
+static int TimeBound(const char* times, int stride, int size, double t, bool upper) {
+  int tFirst = 0;
+  int tCount = size;
+  while (tCount > 0) {
+    const int    tStep = tCount/2;
+    const double tTime = *(const double*)(times + (tFirst + tStep)*stride);
+    if(upper ? !(t < tTime) : tTime < t) {
+      tFirst += tStep + 1;
+      tCount -= tStep + 1;
+    } else {
+      tCount = tStep;
+    }
+  }
+  return tFirst;
+}
+
+void QCurve3D::indexRange(double t0, double t1, int* first, int* end) const {
+  if(!hasTime()) {
+    *first = 0;
+    *end   = mVertices.size();
+    return;
+  }
+  const char* tTimes  = (const char*)timeData();
+  const int   tStride = timeStride();
+  *first = TimeBound(tTimes, tStride, mVertices.size(), t0, false);
+  *end   = TimeBound(tTimes, tStride, mVertices.size(), t1, true);
+  if(*end < *first) *end = *first;
+}
+
+// Finds the parts of the vertices [first,end) between gaps, as strips of every
+// stride:th vertex in strided indices. A strip that starts after a gap starts
+// at the first strided vertex after it, so it is never connected across the gap.
+void QCurve3D::strips(int first, int end, int stride, QVector<GLint>* firsts, QVector<GLsizei>* counts) const {
+  if(end - first < 2) return;
+  const int* tBreak = std::upper_bound(mBreaks.constBegin(), mBreaks.constEnd(), first);
+  int tStart = (tBreak == mBreaks.constBegin() || *(tBreak-1) <= (first/stride)*stride) ? first/stride : (first+stride-1)/stride;
+  for (;;) {
+    const int tStop = (tBreak != mBreaks.constEnd() && *tBreak < end) ? *tBreak : end;
+    const int tLast = (tStop-1)/stride;
+    if(tLast > tStart) {
+      firsts->push_back(tStart);
+      counts->push_back(tLast - tStart + 1);
+    }
+    if(tStop == end) break;
+    tStart = (tStop+stride-1)/stride;
+    ++tBreak;
+  }
+}
+
+// Draws every stride:th of the vertices [first,end), as one line strip per
+// part of the curve between gaps. The vertex pointer, and the scalar texture
+// coordinate pointer and colormap for curves with scalars, must be set by the
+// plot with the same stride.
+void QCurve3D::draw(int first, int end, int stride, double alpha, int maxLineWidth) const {
+  QVector<GLint>   tFirsts;
+  QVector<GLsizei> tCounts;
+  strips(first, end, stride, &tFirsts, &tCounts);
+  if(tFirsts.isEmpty()) return;
+
+  // The colormap texture is modulated with the color
+  const QColor tColor = hasScalar() ? QColor(Qt::white) : mColor;
+
+  glLineWidth(maxLineWidth > 0 ? std::min(mLineWidth, maxLineWidth) : mLineWidth);
+  glColor4f(tColor.redF(),tColor.greenF(),tColor.blueF(),alpha);  
+  glEnableClientState(GL_VERTEX_ARRAY);    
+  if(hasScalar()) glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  if(tFirsts.size() == 1)
+    glDrawArrays(GL_LINE_STRIP,tFirsts[0],tCounts[0]);
+  else
+    MultiDrawArrays(GL_LINE_STRIP,tFirsts,tCounts);
+  if(hasScalar()) glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);    
+  glLineWidth(1);
+
+}
+
+// Draws the vertices [first,end) in the shadow color, with the vertex
+// pointer set by the plot with the same stride. The plot sets the
+// flattening transform.
+void QCurve3D::drawShadow(int first, int end, int stride) const {
+  QVector<GLint>   tFirsts;
+  QVector<GLsizei> tCounts;
+  strips(first, end, stride, &tFirsts, &tCounts);
+  if(tFirsts.isEmpty()) return;
+
+  glLineWidth(mLineWidth);
+  glColor4f(mShadowColor.redF(),mShadowColor.greenF(),mShadowColor.blueF(),mShadowColor.alphaF());
+  glEnableClientState(GL_VERTEX_ARRAY);
+  if(tFirsts.size() == 1)
+    glDrawArrays(GL_LINE_STRIP,tFirsts[0],tCounts[0]);
+  else
+    MultiDrawArrays(GL_LINE_STRIP,tFirsts,tCounts);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glLineWidth(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// QQUIVER3D
+////////////////////////////////////////////////////////////////////////////////
+QQuiver3D::QQuiver3D():
+  mColor(Qt::black),
+  mScale(1.0),
+  mStride(1),
+  mVisible(true),
+  mRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max()),
+  mMagnitudeMin(std::numeric_limits<double>::max()),
+  mMagnitudeMax(0.0),
+  mSerial(0),
+  mColorMapSerial(0)
+{
+}
+
+QQuiver3D::QQuiver3D(QString name):
+  mName(name),
+  mColor(Qt::black),
+  mScale(1.0),
+  mStride(1),
+  mVisible(true),
+  mRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max()),
+  mMagnitudeMin(std::numeric_limits<double>::max()),
+  mMagnitudeMax(0.0),
+  mSerial(0),
+  mColorMapSerial(0)
+{
+}
+
+void QQuiver3D::addArrow(const QVector3D& position, const QVector3D& vector) {
+  mSamples.push_back(position);
+  mSamples.push_back(vector);
+  mRange.setIfMin(position);
+  mRange.setIfMax(position);
+  const double tMagnitude = vector.length();
+  mMagnitudeMin = std::min(mMagnitudeMin, tMagnitude);
+  mMagnitudeMax = std::max(mMagnitudeMax, tMagnitude);
+}
+
+void QQuiver3D::addArrows(const QVector<QVector3D>& positions, const QVector<QVector3D>& vectors) {
+  const int nArrows = std::min(positions.size(), vectors.size());
+  mSamples.reserve(mSamples.size() + 2*nArrows);
+  for (int i = 0; i < nArrows; i++) {
+    addArrow(positions[i], vectors[i]);
+  }
+}
+
+void QQuiver3D::clear() {
+  mSamples.clear();
+  mRange = QRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max());
+  mMagnitudeMin = std::numeric_limits<double>::max();
+  mMagnitudeMax = 0.0;
+  mSerial++;
+}
+
+// The range of the positions, grown by the length of the longest arrow
+QRange QQuiver3D::range() const {
+  if(mSamples.isEmpty()) return mRange;
+  const double tLength = mScale*mMagnitudeMax;
+  QRange tRange = mRange;
+  tRange.min -= QVector3D(tLength, tLength, tLength);
+  tRange.max += QVector3D(tLength, tLength, tLength);
+  return tRange;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// QCURVEBUFFER
+////////////////////////////////////////////////////////////////////////////////
+QCurveBuffer::QCurveBuffer():
+  vertices(QGLBuffer::VertexBuffer),
+  count(0),
+  capacity(0),
+  serial(-1),
+  scalars(QGLBuffer::VertexBuffer),
+  scalarCount(0),
+  scalarCapacity(0),
+  radii(QGLBuffer::VertexBuffer),
+  radiusCount(0),
+  radiusCapacity(0),
+  attributes(QGLBuffer::VertexBuffer),
+  attributeCount(0),
+  attributeCapacity(0),
+  attributeStride(0),
+  colorMap(0),
+  colorMapSerial(-1),
+  lastUsed(0)
+{
+  vertices.setUsagePattern(QGLBuffer::DynamicDraw);
+  scalars.setUsagePattern(QGLBuffer::DynamicDraw);
+  radii.setUsagePattern(QGLBuffer::DynamicDraw);
+  attributes.setUsagePattern(QGLBuffer::DynamicDraw);
+}
+
+qint64 QCurveBuffer::bytes() const {
+  return (qint64)capacity*sizeof(QVector3D) +
+         (qint64)scalarCapacity*sizeof(float) +
+         (qint64)radiusCapacity*sizeof(float) +
+         (qint64)attributeCapacity*attributeStride +
+         (colorMap != 0 ? 4*COLORMAP_SIZE : 0);
+}
+
+// Frees the vertex buffers, they are created and filled again when the
+// curve is drawn. The colormap is small and kept for the legend.
+void QCurveBuffer::evict() {
+  vertices.destroy();
+  scalars.destroy();
+  radii.destroy();
+  attributes.destroy();
+  count          = 0;
+  capacity       = 0;
+  scalarCount    = 0;
+  scalarCapacity = 0;
+  radiusCount    = 0;
+  radiusCapacity = 0;
+  attributeCount    = 0;
+  attributeCapacity = 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// QAXIS
+////////////////////////////////////////////////////////////////////////////////
+QAxis::QAxis():
+  mRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max()),
+  mAxis(X_AXIS),
+  mAdjustPlaneView(true),
+  mShowPlane(true),
+  mShowGrid(true),
+  mShowAxis(true),
+  mShowLabel(true),
+  mShowAxisBox(false),
+  mXLabel("X"),
+  mYLabel("Y"),
+  mPlaneColor(230,230,242),
+  //  mGridColor(204,204,217),
+  mGridColor(128,128,128),
+  mLabelColor(0,0,0),
+  mShowLowerTicks(false),
+  mShowUpperTicks(false),
+  mShowLeftTicks(false),
+  mShowRightTicks(false),
+  mTranslate(0.0),
+  mScale(5.0),
+  mLabelFont("Helvetica",12),
+  mTicksFont("Helvetica",10)
+  
+{
+}
+
+void QAxis::setRange(QRange range) {
+
+  mRange = range;
+
+  if(mAxis == X_AXIS) 
+    {
+      mXTicks = getTicks(mRange.min.x(), mRange.max.x());
+      mYTicks = getTicks(mRange.min.y(), mRange.max.y());
+      mZTicks = getTicks(mRange.min.z(), mRange.max.z());
+      mShowUpperTicks = true;
+      mShowRightTicks = true;
+    } 
+  else if (mAxis == Y_AXIS)  
+    {
+      mXTicks = getTicks(mRange.min.y(), mRange.max.y());
+      mYTicks = getTicks(mRange.min.z(), mRange.max.z());
+      mZTicks = getTicks(mRange.min.x(), mRange.max.x());
+    } 
+  else 
+    {
+      mXTicks = getTicks(mRange.min.z(), mRange.max.z());
+      mYTicks = getTicks(mRange.min.x(), mRange.max.x());
+      mZTicks = getTicks(mRange.min.y(), mRange.max.y());
+      mShowUpperTicks = true;
+    }
+
+  mTranslate = mZTicks[0];
 }
 
 QVector<double> QAxis::getTicks(double minValue, double maxValue)  const {
@@ -233,6 +1639,7 @@ QVector<double> QAxis::getTicks(double minValue, double maxValue)  const {
 }
 
 void QAxis::drawXTickLabel( QVector3D start, QVector3D stop, QString string ) const {
+  if(!mPlot->showTickLabels()) return;
   
   QRect textSize = mPlot->textSize(string);
 
@@ -269,7 +1676,7 @@ void QAxis::drawAxisPlane() const {
 
   // Plane
   if(mShowPlane) {
-    Draw3DPlane(QVector3D(minX,minY,0), QVector3D(maxX, maxY,0), mPlaneColor);
+    mPlot->draw3DPlane(QVector3D(minX,minY,0), QVector3D(maxX, maxY,0), mPlaneColor);
   }
 
   double deltaX = mXTicks[1] - mXTicks[0];
@@ -360,6 +1767,46 @@ void QAxis::draw() const {
 
   glPopMatrix();
 } 
+// Draws texture over the axis plane, where it shows the density projected
+// onto the plane.
+void QAxis::drawDensity(GLuint texture) const {
+  if(mXTicks.isEmpty()) return;
+  if(mYTicks.isEmpty()) return;
+  if(mZTicks.isEmpty()) return;
+
+  glPushMatrix();
+
+  if(mAxis == X_AXIS) 
+    {
+    }
+  else if (mAxis == Y_AXIS) 
+    {
+      glRotatef(90, 1,0,0);
+      glRotatef(90, 0,1,0);    
+    }
+  else {
+    glRotatef(90,  1,0,0);
+    glRotatef(180, 0,1,0);        
+    glRotatef(90,  0,0,1);
+  }
+
+  glTranslatef(0,0,mTranslate);
+
+  const double x0 = mXTicks.first();
+  const double x1 = mXTicks.last();
+  const double y0 = mYTicks.first();
+  const double y1 = mYTicks.last();
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glBegin(GL_QUADS);
+  glTexCoord2f(0.0, 0.0); glVertex3f(x0, y0, 0.0);
+  glTexCoord2f(1.0, 0.0); glVertex3f(x1, y0, 0.0);
+  glTexCoord2f(1.0, 1.0); glVertex3f(x1, y1, 0.0);
+  glTexCoord2f(0.0, 1.0); glVertex3f(x0, y1, 0.0);
+  glEnd();
+
+  glPopMatrix();
+}
+
 void QAxis::drawAxisBox() const {
   if(mXTicks.isEmpty()) return;
   if(mYTicks.isEmpty()) return;
@@ -397,6 +1844,60 @@ void QAxis::drawAxisBox() const {
   glPopMatrix();  
 }
 
+// Writes everything that changes how the axis is drawn, used to decide
+// when the cached layers of the plot must be rendered again.
+void QAxis::writeLayerKey(QDataStream& stream) const {
+  stream << mRange.min << mRange.max << (int)mAxis 
+         << mAdjustPlaneView << mShowPlane << mShowGrid << mShowAxis << mShowLabel << mShowAxisBox
+         << mXLabel << mYLabel << mPlaneColor << mGridColor << mLabelColor
+         << mXTicks << mYTicks << mZTicks
+         << mShowLowerTicks << mShowUpperTicks << mShowLeftTicks << mShowRightTicks
+         << mTranslate << mLabelFont << mTicksFont;
+}
+
+void QAxis::writeScene(QDataStream& stream) const {
+  stream << mRange.min << mRange.max
+         << mAdjustPlaneView << mShowPlane << mShowGrid << mShowAxis << mShowLabel << mShowAxisBox
+         << mXLabel << mYLabel << mPlaneColor << mGridColor << mLabelColor
+         << mLabelFont << mTicksFont;
+}
+
+void QAxis::readScene(QDataStream& stream) {
+  QRange tRange;
+  stream >> tRange.min >> tRange.max
+         >> mAdjustPlaneView >> mShowPlane >> mShowGrid >> mShowAxis >> mShowLabel >> mShowAxisBox
+         >> mXLabel >> mYLabel >> mPlaneColor >> mGridColor >> mLabelColor
+         >> mLabelFont >> mTicksFont;
+  if(stream.status() == QDataStream::Ok) setRange(tRange);
+}
+
+// Swaps everything but the plot and the axis with other
+void QAxis::swapState(QAxis& other) {
+  qSwap(mRange, other.mRange);
+  qSwap(mAdjustPlaneView, other.mAdjustPlaneView);
+  qSwap(mShowPlane, other.mShowPlane);
+  qSwap(mShowGrid, other.mShowGrid);
+  qSwap(mShowAxis, other.mShowAxis);
+  qSwap(mShowLabel, other.mShowLabel);
+  qSwap(mShowAxisBox, other.mShowAxisBox);
+  qSwap(mXLabel, other.mXLabel);
+  qSwap(mYLabel, other.mYLabel);
+  qSwap(mPlaneColor, other.mPlaneColor);
+  qSwap(mGridColor, other.mGridColor);
+  qSwap(mLabelColor, other.mLabelColor);
+  qSwap(mXTicks, other.mXTicks);
+  qSwap(mYTicks, other.mYTicks);
+  qSwap(mZTicks, other.mZTicks);
+  qSwap(mShowLowerTicks, other.mShowLowerTicks);
+  qSwap(mShowUpperTicks, other.mShowUpperTicks);
+  qSwap(mShowLeftTicks, other.mShowLeftTicks);
+  qSwap(mShowRightTicks, other.mShowRightTicks);
+  qSwap(mTranslate, other.mTranslate);
+  qSwap(mScale, other.mScale);
+  qSwap(mLabelFont, other.mLabelFont);
+  qSwap(mTicksFont, other.mTicksFont);
+}
+
 void QAxis::setVisibleTicks(bool lower, bool right, bool upper, bool left ) {
   mShowLeftTicks  = left;
   mShowRightTicks = right;
@@ -501,9 +2002,197 @@ void QAxis::adjustPlaneView() {
 
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// QCAMERAPATH
+////////////////////////////////////////////////////////////////////////////////
+void QCameraPath::addKey(double time, double azimuth, double elevation, double zoom) {
+  mTimes.push_back(time);
+  mAzimuths.push_back(azimuth);
+  mElevations.push_back(elevation);
+  mZooms.push_back(zoom);
+}
+
+void QCameraPath::cameraAt(double time, double* azimuth, double* elevation, double* zoom) const {
+  if(mTimes.isEmpty()) return;
+
+  // Index of the first key after time
+  const int tNext = std::upper_bound(mTimes.constBegin(), mTimes.constEnd(), time) - mTimes.constBegin();
+  if(tNext == 0 || tNext == mTimes.size()) {
+    const int tKey = (tNext == 0) ? 0 : mTimes.size()-1;
+    *azimuth   = mAzimuths[tKey];
+    *elevation = mElevations[tKey];
+    *zoom      = mZooms[tKey];
+    return;
+  }
+
+  const int tPrev = tNext-1;
+  const double tDelta = mTimes[tNext] - mTimes[tPrev];
+  const double f = (tDelta > 0.0) ? (time - mTimes[tPrev])/tDelta : 1.0;
+  *azimuth   = mAzimuths[tPrev]   + f*(mAzimuths[tNext]   - mAzimuths[tPrev]);
+  *elevation = mElevations[tPrev] + f*(mElevations[tNext] - mElevations[tPrev]);
+  *zoom      = mZooms[tPrev]      + f*(mZooms[tNext]      - mZooms[tPrev]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// QCAMERALINK
+////////////////////////////////////////////////////////////////////////////////
+QCameraLink::QCameraLink(int components, QObject* parent):
+  QObject(parent),
+  mComponents(components),
+  mRepaintPending(false),
+  mSource(-1)
+{
+}
+
+QCameraLink::~QCameraLink() {
+  for (int i = 0; i < mMembers.size(); i++) {
+    mMembers[i].plot->mCameraLinks.removeAll(this);
+  }
+}
+
+// Adds a plot, or one of its subplots, which takes the camera of the plots
+// already in the link.
+void QCameraLink::addPlot(QPlot3D* plot, int subplot) {
+  for (int i = 0; i < mMembers.size(); i++) {
+    if(mMembers[i].plot == plot && mMembers[i].subplot == subplot) return;
+  }
+
+  Member tMember;
+  tMember.plot    = plot;
+  tMember.subplot = subplot;
+  if(!mMembers.isEmpty()) {
+    plot->applyCamera(subplot, mTranslate, mRotation, mComponents);
+    plot->updateGL();
+  } else {
+    plot->subplotCamera(subplot, &mTranslate, &mRotation);
+  }
+  mMembers.push_back(tMember);
+  if(!plot->mCameraLinks.contains(this)) plot->mCameraLinks.push_back(this);
+}
+
+// Removes a subplot of plot, or all of them when subplot is negative
+void QCameraLink::removePlot(QPlot3D* plot, int subplot) {
+  for (int i = mMembers.size()-1; i >= 0; i--) {
+    if(mMembers[i].plot == plot && (subplot < 0 || mMembers[i].subplot == subplot)) mMembers.removeAt(i);
+  }
+  mSource = -1;
+
+  for (int i = 0; i < mMembers.size(); i++) {
+    if(mMembers[i].plot == plot) return;
+  }
+  plot->mCameraLinks.removeAll(this);
+}
+
+// Takes the camera of a member that was moved. All members, the moved one
+// included, are updated and repainted once in repaint(), however many times
+// the camera moves before it runs. Returns false if plot is not a member.
+bool QCameraLink::cameraChanged(QPlot3D* plot, int subplot) {
+  int tSource = -1;
+  for (int i = 0; i < mMembers.size(); i++) {
+    if(mMembers[i].plot == plot && mMembers[i].subplot == subplot) tSource = i;
+  }
+  if(tSource < 0) return false;
+
+  mSource = tSource;
+  if(mComponents & ROTATION) mRotation = plot->mRotation;
+  if(mComponents & ZOOM)     mTranslate.setZ(plot->mTranslate.z());
+  if(mComponents & PAN) {
+    mTranslate.setX(plot->mTranslate.x());
+    mTranslate.setY(plot->mTranslate.y());
+  }
+
+  if(!mRepaintPending) {
+    mRepaintPending = true;
+    QTimer::singleShot(0, this, SLOT(repaint()));
+  }
+  return true;
+}
+
+// Copies the shared camera to the members and repaints each plot once
+void QCameraLink::repaint() {
+  mRepaintPending = false;
+
+  // The source may have been removed since, the plots are repainted anyway
+  QList<QPlot3D*> tPlots;
+  for (int i = 0; i < mMembers.size(); i++) {
+    QPlot3D* tPlot = mMembers[i].plot;
+    if(mSource >= 0 && i != mSource) tPlot->applyCamera(mMembers[i].subplot, mTranslate, mRotation, mComponents);
+    if(!tPlots.contains(tPlot)) tPlots.push_back(tPlot);
+  }
+  mSource = -1;
+
+  for (int i = 0; i < tPlots.size(); i++) {
+    tPlots[i]->updateGL();
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // QPLOT3D
 ////////////////////////////////////////////////////////////////////////////////
+
+// State of a subplot while another subplot is current, swapped with the
+// members of the plot by QPlot3D::swapSubplot().
+class QPlot3D::Subplot {
+ public:
+  Subplot();
+  QList<QCurve3D*> curves;
+  QList<QOctreeCloud*> clouds;
+  QList<QQuiver3D*> quivers;
+  QColor    backgroundColor;
+  QVector3D translate, rotation, scale;
+  bool      showAzimuthElevation, showLegend, axisEqual;
+  QAxis     xAxis, yAxis, zAxis;
+  GLdouble  modelViewMatrix[16];
+  GLdouble  projectionMatrix[16];
+  bool      hasMatrices;
+  QPickResult hoverPick;
+  QGLFramebufferObject* backgroundLayer;
+  QGLFramebufferObject* overlayLayer;
+  QByteArray backgroundKey, overlayKey;
+  int       legendPage, legendPageCount;
+  QList<QCurve3D*> legendCurves;
+  QByteArray legendLayoutKey;
+  double    legendTextWidth, legendTextHeight;
+  QRect     legendRect;
+  GLuint    legendTexture;
+  QByteArray legendKey;
+  QString   legendFilter;
+  bool      hasTimeWindow;
+  double    timeWindowStart, timeWindowEnd, trailLength;
+  QVector4D clipPlanes[MAX_CLIP_PLANES];
+  int       clipPlaneMask;
+  bool      hasClipBox, axisFollowsClipBox;
+  QRange    clipBox;
+  QDensity* density;
+  ~Subplot() { delete density; }
+};
+
+QPlot3D::Subplot::Subplot():
+  backgroundColor(Qt::white),
+  translate(0,0,-20),
+  rotation(30,0,-130),
+  showAzimuthElevation(true),
+  showLegend(true),
+  axisEqual(false),
+  hasMatrices(false),
+  backgroundLayer(NULL),
+  overlayLayer(NULL),
+  legendPage(0),
+  legendPageCount(0),
+  legendTextWidth(0.0),
+  legendTextHeight(0.0),
+  legendTexture(0),
+  hasTimeWindow(false),
+  timeWindowStart(0.0),
+  timeWindowEnd(0.0),
+  trailLength(0.0),
+  clipPlaneMask(0),
+  hasClipBox(false),
+  axisFollowsClipBox(false),
+  density(NULL)
+{
+}
+
 QPlot3D::QPlot3D(QWidget* parent): 
   QGLWidget(QGLFormat(QGL::SampleBuffers),parent),
   mBackgroundColor(Qt::white),
@@ -512,7 +2201,55 @@ QPlot3D::QPlot3D(QWidget* parent):
   mShowAzimuthElevation(true),
   mShowLegend(true),
   mAxisEqual(false),
-  mLegendFont("Helvetica", 12)
+  mLegendFont("Helvetica", 12),
+  mLegendPage(0),
+  mLegendPageCount(0),
+  mLegendTextWidth(0.0),
+  mLegendTextHeight(0.0),
+  mLegendTexture(0),
+  mHasMatrices(false),
+  mShowPicking(true),
+  mPickRadius(5),
+  mHasTimeWindow(false),
+  mTimeWindowStart(0.0),
+  mTimeWindowEnd(0.0),
+  mTrailLength(0.0),
+  mClipPlaneMask(0),
+  mHasClipBox(false),
+  mAxisFollowsClipBox(false),
+  mCacheLayers(true),
+  mBackgroundLayer(NULL),
+  mOverlayLayer(NULL),
+  mActiveLayer(NULL),
+  mAdaptiveQuality(true),
+  mInteracting(false),
+  mQualityLevel(FULL_QUALITY),
+  mInteractionQualityLevel(FULL_QUALITY),
+  mTargetFrameTime(33.0),
+  mDegradeThreshold(1.2),
+  mRecoverThreshold(0.5),
+  mFrameTime(0.0),
+  mRenderTarget(NULL),
+  mExportPainter(NULL),
+  mExportTolerance(0.5),
+  mRecording(false),
+  mRecordFrame(0),
+  mWriterSlots(RECORD_WRITE_QUEUE),
+  mGpuMemoryBudget(0),
+  mShowMemoryUsage(false),
+  mFrameCounter(0),
+  mSubplotRows(1),
+  mSubplotColumns(1),
+  mCurrentSubplot(0),
+  mHoverSubplot(0),
+  mDensityMode(DENSITY_OFF),
+  mDensityResolution(64),
+  mDensity(NULL),
+  mTubeProgram(NULL),
+  mTubeSupport(-1),
+  mQuiverProgram(NULL),
+  mQuiverSupport(-1),
+  mArrowMesh(QGLBuffer::VertexBuffer)
 {
 
 
@@ -537,13 +2274,61 @@ QPlot3D::QPlot3D(QWidget* parent):
   setContextMenuPolicy(Qt::CustomContextMenu);
   connect(this, SIGNAL(customContextMenuRequested(const QPoint&)), this, SLOT(showContextMenu(const QPoint&)));
   
+  setMouseTracking(mShowPicking);
+
+  mInteractionTimer.setSingleShot(true);
+  mInteractionTimer.setInterval(250);
+  connect(&mInteractionTimer, SIGNAL(timeout()), this, SLOT(endInteraction()));
+
+  for (int i = 0; i < RECORD_RING_SIZE; i++) {
+    mRecordBuffers.push_back(QGLBuffer(QGLBuffer::PixelPackBuffer));
+    mRecordBuffers[i].setUsagePattern(QGLBuffer::StreamRead);
+    mRecordSizes.push_back(QSize());
+  }
 
 }
 
 QPlot3D::~QPlot3D() {
+  while(!mCameraLinks.isEmpty()) {
+    mCameraLinks.first()->removePlot(this);
+  }
+  const QList<QCurve3D*> tCurves = mCurveBuffers.keys();
+  for (int i = 0; i < tCurves.size(); i++) {
+    releaseCurveBuffer(tCurves[i]);
+  }
+  makeCurrent();
+  // The clouds keep their points, their buffers are deleted in this context
+  QList<QOctreeCloud*> tClouds = mClouds;
+  for (int i = 0; i < mSubplots.size(); i++) {
+    tClouds += mSubplots[i]->clouds;
+  }
+  for (int i = 0; i < tClouds.size(); i++) {
+    tClouds[i]->releaseBuffers();
+    tClouds[i]->mPlot = NULL;
+  }
+  if(mRecording) stopRecording();
+  delete mBackgroundLayer;
+  delete mOverlayLayer;
+  if(mLegendTexture != 0) glDeleteTextures(1, &mLegendTexture);
+  delete mDensity;
+  delete mTubeProgram;
+  mTubeTemplates.clear();
+  delete mQuiverProgram;
+  mArrowMesh.destroy();
+  for (QHash<QQuiver3D*, QCurveBuffer>::iterator it = mQuiverBuffers.begin(); it != mQuiverBuffers.end(); ++it) {
+    if(it.value().colorMap != 0) glDeleteTextures(1, &it.value().colorMap);
+  }
+  mQuiverBuffers.clear();
+  for (int i = 0; i < mSubplots.size(); i++) {
+    delete mSubplots[i]->backgroundLayer;
+    delete mSubplots[i]->overlayLayer;
+    if(mSubplots[i]->legendTexture != 0) glDeleteTextures(1, &mSubplots[i]->legendTexture);
+  }
+  qDeleteAll(mSubplots);
 }
 
 void QPlot3D::showContextMenu(const QPoint& pos) {
+  setCurrentSubplot(subplotAt(pos));
   QPoint globalPos = this->mapToGlobal(pos);
   
   QMenu tMenu;
@@ -588,6 +2373,14 @@ void QPlot3D::showContextMenu(const QPoint& pos) {
   connect(a7, SIGNAL(triggered()), this,SLOT(toggleAxisEqual()));
   tMenu.addAction(a7);
 
+  QAction*  a8 = new QAction("Toggle Memory Usage",this);
+  connect(a8, SIGNAL(triggered()), this,SLOT(toggleMemoryUsage()));
+  tMenu.addAction(a8);
+
+  QAction*  a9 = new QAction("Export Figure...",this);
+  connect(a9, SIGNAL(triggered()), this,SLOT(saveFigure()));
+  tMenu.addAction(a9);
+
   tMenu.exec(globalPos);
   update();
 }
@@ -605,396 +2398,3800 @@ void QPlot3D::initializeGL() {
 }
 
 void QPlot3D::paintGL() {
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  glLoadIdentity();
+  mFrameTimer.start();
+  mFrameCounter++;
 
-  glTranslatef(mTranslate.x(),mTranslate.y(),mTranslate.z());
-
-  glRotatef(mRotation.x()-90, 1.0, 0.0, 0.0);
-  glRotatef(mRotation.y(), 0.0, 1.0, 0.0);
-  glRotatef(mRotation.z(), 0.0, 0.0, 1.0);
+  if(mQualityLevel >= NO_MULTISAMPLING)
+    glDisable(GL_MULTISAMPLE);
+  else
+    glEnable(GL_MULTISAMPLE);
 
-  glScalef(mScale.x(),mScale.y(),mScale.z());
-  
-  QVector3D tCenter = mXAxis.range().center();
-  glTranslatef(-tCenter.x(),-tCenter.y(),-tCenter.z());
+  if(mSubplots.isEmpty()) {
+    paintView();
+  } else {
+    // All subplots are drawn in this context, each in its own viewport
+    const int tCurrent = mCurrentSubplot;
+    for (int i = 0; i < mSubplots.size(); i++) {
+      setCurrentSubplot(i);
+      resizeGL(viewWidth(),viewHeight());
+      paintView();
+    }
+    setCurrentSubplot(tCurrent);
+    glDisable(GL_SCISSOR_TEST);
+  }
 
-  // DRAW AXIS
-  mXAxis.draw();
-  mYAxis.draw();
-  mZAxis.draw();
+  enforceGpuBudget();
 
-  // DRAW CURVES
-  const int nCurves = mCurves.size();
-  for(int i = 0; i < nCurves; i++) {
-    mCurves[i]->draw();
+  if(mRecording) {
+    readbackFrame();
   }
 
-  // DRAW AXIS BOX
-  mXAxis.drawAxisBox();
-  mYAxis.drawAxisBox();
-  mZAxis.drawAxisBox();
-
-  // DRAW LEGEND
-  if(mShowLegend) {
-    drawLegend();
+  if(mInteracting && mAdaptiveQuality) {
+    // Wait for the frame to be rendered to know what it cost
+    glFinish();
+    updateQuality(mFrameTimer.nsecsElapsed()/1.0e6);
   }
+}
 
-  // DRAW ELEVATION AZIMUTH TEXT BOX
-  if(mShowAzimuthElevation) {  
-    drawTextBox(10,height()-15,QString("Az: %1 El: %2").arg(azimuth(),3,'f',1).arg(elevation(),3,'f',1));
+// Draws the current subplot, or the whole plot without subplots
+// Picks up the ranges and pick indexes computed by the workers for all curves
+// of the view, including hidden ones. The axes can not be rescaled while
+// painting, so that is done afterwards if a curve has grown outside of them.
+void QPlot3D::updateDerived() {
+  bool tOutside = false;
+  const QRange tAxisRange = mXAxis.range();
+  const int nCurves = mCurves.size();
+  for (int i = 0; i < nCurves; i++) {
+    if(!mCurves[i]->updateDerived(&mWorkerPool)) continue;
+    if(!RangeContains(tAxisRange, mCurves[i]->transformedRange())) tOutside = true;
   }
 
-  
+  if(tOutside && !mRescaleSubplots.contains(mCurrentSubplot)) {
+    if(mRescaleSubplots.isEmpty()) QTimer::singleShot(0, this, SLOT(rescaleDerived()));
+    mRescaleSubplots.push_back(mCurrentSubplot);
+  }
 }
 
-void QPlot3D::drawLegend(){
-  double textWidth  = 0;
-  double textHeight = 0;
-  int nrCurves = mCurves.size();
-  for (int i = 0; i < nrCurves; i++) {
-    QString string = mCurves[i]->name();
-    if(fontMetrics().width(string) > textWidth) textWidth = fontMetrics().width(string);
-    if(fontMetrics().height() > textHeight) textHeight = fontMetrics().height();
+void QPlot3D::rescaleDerived() {
+  const int tCurrent = mCurrentSubplot;
+  for (int i = 0; i < mRescaleSubplots.size(); i++) {
+    setCurrentSubplot(mRescaleSubplots[i]);
+    rescaleAxis();
   }
+  setCurrentSubplot(tCurrent);
+  mRescaleSubplots.clear();
+}
 
+void QPlot3D::paintView() {
+  updateDerived();
 
-  double tWidth  = 5 + 20 + 5 + textWidth + 5;
-  double tHeight = 5 + nrCurves*textHeight + 5;
-  double x0 = width()-tWidth-5; 
-  double y0 = 5;
-
-  enable2D();
-  glEnable(GL_BLEND);
-  // Draw box
-  Draw2DPlane(QVector2D(x0,y0),             QVector2D(x0+tWidth,y0+tHeight),QColor(204,204,217,128));
-  // Draw contour lines
-  Draw2DLine(QVector2D(x0,y0),                QVector2D(x0+tWidth,y0),         1, QColor(0,0,0,255));
-  Draw2DLine(QVector2D(x0+tWidth,y0),         QVector2D(x0+tWidth,y0+tHeight), 1, QColor(0,0,0,255));
-  Draw2DLine(QVector2D(x0+tWidth,y0+tHeight), QVector2D(x0,y0+tHeight),        1, QColor(0,0,0,255));
-  Draw2DLine(QVector2D(x0,y0+tHeight),        QVector2D(x0,y0),                1, QColor(0,0,0,255));  
-  glDisable(GL_BLEND);
-  disable2D();
+  qglClearColor(mBackgroundColor);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  loadCamera();
+
+  // Text can only be drawn into an offscreen target through the layers
+  if((mCacheLayers || mRenderTarget != NULL) && QGLFramebufferObject::hasOpenGLFramebufferObjects()) {
+    // Only render the cached layers again when their inputs have changed
+    if(beginLayer(&mBackgroundLayer, &mBackgroundKey, backgroundKey(), mBackgroundColor)) {
+      drawBackground();
+      endLayer();
+    }
+    drawLayer(mBackgroundLayer, false);
 
-  y0 = 10;
+    drawData();
 
-  for (int i = 0; i < nrCurves; i++) {
+    // The overlay uses the colormaps that are created when drawing the data
+    if(beginLayer(&mOverlayLayer, &mOverlayKey, overlayKey(), QColor(0,0,0,0))) {
+      drawOverlay();
+      endLayer();
+    }
+    drawLayer(mOverlayLayer, true);
+  } else {
+    drawBackground();
+    drawData();
+    drawOverlay();
+  }
 
-    x0 = width()-tWidth-5; 
+  // DRAW HOVERED CURVE POINT
+  if(mShowPicking && mRenderTarget == NULL) {
+    drawPickMarker();
+  }
+}
 
-    enable2D();
-    Draw2DLine(QVector2D(x0+5,   y0+0.5*textHeight), 
-	       QVector2D(x0+5+20,y0+0.5*textHeight), 
-	       mCurves[i]->lineWidth(), 
-	       mCurves[i]->color());
-    disable2D();
+void QPlot3D::setSubplotGrid(int rows, int columns) {
+  rows    = std::max(1, rows);
+  columns = std::max(1, columns);
+  const int tCount = rows*columns;
+  makeCurrent();
+
+  // Subplots that are not in the new grid are removed
+  setCurrentSubplot(0);
+  while(mSubplots.size() > tCount) {
+    Subplot* tSubplot = mSubplots.takeLast();
+    delete tSubplot->backgroundLayer;
+    delete tSubplot->overlayLayer;
+    if(tSubplot->legendTexture != 0) glDeleteTextures(1, &tSubplot->legendTexture);
+    for (int i = 0; i < tSubplot->curves.size(); i++) {
+      if(!showsCurve(tSubplot->curves[i])) releaseCurveBuffer(tSubplot->curves[i]);
+    }
+    for (int i = 0; i < tSubplot->quivers.size(); i++) {
+      if(!showsQuiver(tSubplot->quivers[i])) releaseQuiverBuffer(tSubplot->quivers[i]);
+    }
+    for (int i = 0; i < tSubplot->clouds.size(); i++) {
+      if(showsCloud(tSubplot->clouds[i])) continue;
+      releaseCloudBuffers(tSubplot->clouds[i]);
+      tSubplot->clouds[i]->mPlot = NULL;
+    }
+    delete tSubplot;
+  }
 
-    x0 += 30;
-    glColor4f(0,0,0,1);
-    y0 += textHeight;
-    renderTextAtScreenCoordinates((int)x0,(int)y0,mCurves[i]->name(),mLegendFont);
+  if(tCount == 1) {
+    // The first subplot is kept in the members
+    qDeleteAll(mSubplots);
+    mSubplots.clear();
+  } else {
+    // The slot of the current subplot holds the state swapped out of the members
+    if(mSubplots.isEmpty()) mSubplots.push_back(new Subplot);
+    while(mSubplots.size() < tCount) {
+      Subplot* tSubplot = new Subplot;
+      tSubplot->xAxis.setAxis(QAxis::X_AXIS);
+      tSubplot->yAxis.setAxis(QAxis::Y_AXIS);
+      tSubplot->zAxis.setAxis(QAxis::Z_AXIS);
+      tSubplot->xAxis.setPlot(this);
+      tSubplot->yAxis.setPlot(this);
+      tSubplot->zAxis.setPlot(this);
+      tSubplot->xAxis.setXLabel("X"); tSubplot->zAxis.setYLabel("X");
+      tSubplot->yAxis.setXLabel("Y"); tSubplot->xAxis.setYLabel("Y");
+      tSubplot->zAxis.setXLabel("Z"); tSubplot->yAxis.setYLabel("Z");
+      mSubplots.push_back(tSubplot);
+    }
   }
 
+  mSubplotRows    = rows;
+  mSubplotColumns = columns;
+  mHoverSubplot   = 0;
+  resizeGL(viewWidth(),viewHeight());
+  updateGL();
+}
 
+void QPlot3D::setCurrentSubplot(int index) {
+  if(index == mCurrentSubplot || index < 0 || index >= mSubplots.size()) return;
+  swapSubplot(mSubplots[mCurrentSubplot]);
+  swapSubplot(mSubplots[index]);
+  mCurrentSubplot = index;
 }
 
-void QPlot3D::drawTextBox(int x, int y, QString string, QFont font)  {
-  const double textWidth  = fontMetrics().width(string);
-  const double textHeight = fontMetrics().height();
+void QPlot3D::swapSubplot(Subplot* subplot) {
+  mCurves.swap(subplot->curves);
+  mClouds.swap(subplot->clouds);
+  mQuivers.swap(subplot->quivers);
+  qSwap(mBackgroundColor, subplot->backgroundColor);
+  qSwap(mTranslate, subplot->translate);
+  qSwap(mRotation, subplot->rotation);
+  qSwap(mScale, subplot->scale);
+  qSwap(mShowAzimuthElevation, subplot->showAzimuthElevation);
+  qSwap(mShowLegend, subplot->showLegend);
+  qSwap(mAxisEqual, subplot->axisEqual);
+  mXAxis.swapState(subplot->xAxis);
+  mYAxis.swapState(subplot->yAxis);
+  mZAxis.swapState(subplot->zAxis);
+  std::swap_ranges(mModelViewMatrix, mModelViewMatrix+16, subplot->modelViewMatrix);
+  std::swap_ranges(mProjectionMatrix, mProjectionMatrix+16, subplot->projectionMatrix);
+  qSwap(mHasMatrices, subplot->hasMatrices);
+  qSwap(mHoverPick, subplot->hoverPick);
+  qSwap(mBackgroundLayer, subplot->backgroundLayer);
+  qSwap(mOverlayLayer, subplot->overlayLayer);
+  mBackgroundKey.swap(subplot->backgroundKey);
+  mOverlayKey.swap(subplot->overlayKey);
+  qSwap(mLegendPage, subplot->legendPage);
+  qSwap(mLegendPageCount, subplot->legendPageCount);
+  mLegendCurves.swap(subplot->legendCurves);
+  mLegendLayoutKey.swap(subplot->legendLayoutKey);
+  qSwap(mLegendTextWidth, subplot->legendTextWidth);
+  qSwap(mLegendTextHeight, subplot->legendTextHeight);
+  qSwap(mLegendRect, subplot->legendRect);
+  qSwap(mLegendTexture, subplot->legendTexture);
+  mLegendKey.swap(subplot->legendKey);
+  qSwap(mLegendFilter, subplot->legendFilter);
+  qSwap(mHasTimeWindow, subplot->hasTimeWindow);
+  qSwap(mTimeWindowStart, subplot->timeWindowStart);
+  qSwap(mTimeWindowEnd, subplot->timeWindowEnd);
+  qSwap(mTrailLength, subplot->trailLength);
+  std::swap_ranges(mClipPlanes, mClipPlanes+MAX_CLIP_PLANES, subplot->clipPlanes);
+  qSwap(mClipPlaneMask, subplot->clipPlaneMask);
+  qSwap(mHasClipBox, subplot->hasClipBox);
+  qSwap(mAxisFollowsClipBox, subplot->axisFollowsClipBox);
+  qSwap(mClipBox, subplot->clipBox);
+  qSwap(mDensity, subplot->density);
+}
 
-  glEnable(GL_BLEND);
-  enable2D();
-  Draw2DPlane(QVector2D(x-5,y+5), QVector2D(x+10+textWidth, y-textHeight-5), QColor(204,204,217,128));
-  disable2D();
-  glDisable(GL_BLEND);
+// Tells the camera links that the camera of the current subplot has moved
+// Returns true if a link will repaint the plot together with the other plots
+// it links, in which case the plot should not be repainted right away.
+bool QPlot3D::cameraChanged() {
+  bool tLinked = false;
+  for (int i = 0; i < mCameraLinks.size(); i++) {
+    if(mCameraLinks[i]->cameraChanged(this, mCurrentSubplot)) tLinked = true;
+  }
+  return tLinked;
+}
 
-  glColor4f(0,0,0,1);
-  renderTextAtScreenCoordinates(x,y,string,font);
-}  
+// Returns the camera of a subplot, which is parked when it is not current
+void QPlot3D::subplotCamera(int subplot, QVector3D* translate, QVector3D* rotation) const {
+  if(subplot == mCurrentSubplot || subplot < 0 || subplot >= mSubplots.size()) {
+    *translate = mTranslate;
+    *rotation  = mRotation;
+    return;
+  }
+  *translate = mSubplots[subplot]->translate;
+  *rotation  = mSubplots[subplot]->rotation;
+}
 
+// Sets the linked components of the camera of a subplot, without telling the
+// camera links, and moves its axis planes to the back.
+void QPlot3D::applyCamera(int subplot, const QVector3D& translate, const QVector3D& rotation, int components) {
+  const int tCurrent = mCurrentSubplot;
+  setCurrentSubplot(subplot);
+  if(mCurrentSubplot != subplot) return;
+
+  if(components & QCameraLink::ROTATION) mRotation = rotation;
+  if(components & QCameraLink::ZOOM)     mTranslate.setZ(translate.z());
+  if(components & QCameraLink::PAN) {
+    mTranslate.setX(translate.x());
+    mTranslate.setY(translate.y());
+  }
+  mXAxis.adjustPlaneView();
+  mYAxis.adjustPlaneView();
+  mZAxis.adjustPlaneView();
 
-void QPlot3D::enable2D() {
-  glPushMatrix();
-  
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  glOrtho(0,width(),height(),0,0.01,-10000.0);
-  
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
-  
+  setCurrentSubplot(tCurrent);
 }
 
-void QPlot3D::disable2D() {
-  glPopMatrix();
-  resizeGL(width(),height());
+// Returns the rectangle of a subplot in widget coordinates
+QRect QPlot3D::subplotRect(int index) const {
+  const QSize tCanvas = canvasSize();
+  if(mSubplots.isEmpty()) return QRect(QPoint(0,0), tCanvas);
+
+  const int tRow    = index/mSubplotColumns;
+  const int tColumn = index%mSubplotColumns;
+  const int x0 = tColumn*tCanvas.width()/mSubplotColumns;
+  const int x1 = (tColumn+1)*tCanvas.width()/mSubplotColumns;
+  const int y0 = tRow*tCanvas.height()/mSubplotRows;
+  const int y1 = (tRow+1)*tCanvas.height()/mSubplotRows;
+  return QRect(x0, y0, x1-x0, y1-y0);
 }
 
-void QPlot3D::resizeGL(int width, int height) {
-  glViewport(0,0,width,height);
+int QPlot3D::subplotAt(const QPoint& pos) const {
+  for (int i = 0; i < mSubplots.size(); i++) {
+    if(subplotRect(i).contains(pos)) return i;
+  }
+  return mCurrentSubplot;
+}
 
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  double zNear = 0.01;
-  double zFar  = 10000.0;
-  double aspect = (double)width/(double)height;
-  double fW = tan( 25*3.141592/180.0)*zNear;
-  double fH = fW/aspect;
-  glFrustum(-fW,fW,-fH,fH,zNear,zFar);
+// Returns true if curve is in any subplot
+bool QPlot3D::showsCurve(QCurve3D* curve) const {
+  if(mCurves.contains(curve)) return true;
+  for (int i = 0; i < mSubplots.size(); i++) {
+    if(mSubplots[i]->curves.contains(curve)) return true;
+  }
+  return false;
+}
 
+QList<QCurve3D*> QPlot3D::allCurves() const {
+  if(mSubplots.isEmpty()) return mCurves;
+  QList<QCurve3D*> tCurves = mCurves;
+  QSet<QCurve3D*>  tSeen;
+  for (int i = 0; i < mCurves.size(); i++) tSeen.insert(mCurves[i]);
+  for (int s = 0; s < mSubplots.size(); s++) {
+    const QList<QCurve3D*>& tSubplotCurves = mSubplots[s]->curves;
+    for (int i = 0; i < tSubplotCurves.size(); i++) {
+      if(tSeen.contains(tSubplotCurves[i])) continue;
+      tSeen.insert(tSubplotCurves[i]);
+      tCurves.push_back(tSubplotCurves[i]);
+    }
+  }
+  return tCurves;
+}
 
-  glMatrixMode(GL_MODELVIEW);
+void QPlot3D::startRecording(const QString& fileName) {
+  if(mRecording) stopRecording();
+  mRecordFileName = fileName;
+  mRecordFrame    = 0;
+  mRecording      = true;
 }
 
-void QPlot3D::mousePressEvent(QMouseEvent *event)
-{
-    mLastMousePos = event->pos();
+void QPlot3D::stopRecording() {
+  if(!mRecording) return;
+  makeCurrent();
+  flushRecording();
+  mRecording = false;
+}
 
+// Starts an asynchronous read of the current frame into the pixel buffer ring.
+void QPlot3D::readbackFrame() {
+  // The slot still holds the frame from RECORD_RING_SIZE frames ago, which
+  // has been transferred by now, so write that one first.
+  if(mRecordFrame >= RECORD_RING_SIZE) writeRecordedFrame(mRecordFrame-RECORD_RING_SIZE);
+
+  const int tSlot = mRecordFrame % RECORD_RING_SIZE;
+  QGLBuffer& tBuffer = mRecordBuffers[tSlot];
+  if(!tBuffer.isCreated() && !tBuffer.create()) return;
+
+  const QSize tSize = canvasSize();
+  tBuffer.bind();
+  if(mRecordSizes[tSlot] != tSize) {
+    tBuffer.allocate(tSize.width()*tSize.height()*4);
+    mRecordSizes[tSlot] = tSize;
+  }
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glReadPixels(0, 0, tSize.width(), tSize.height(), GL_BGRA, GL_UNSIGNED_BYTE, 0);
+  tBuffer.release();
 
+  mRecordFrame++;
 }
 
-void QPlot3D::mouseMoveEvent(QMouseEvent *event)
-{
-  int dx = event->x() - mLastMousePos.x();
-  int dy = event->y() - mLastMousePos.y();
-  
-  if (event->buttons() & Qt::LeftButton) {
-    
-    if(event->modifiers() == Qt::ControlModifier) {
-      setPitch(pitch() + dx);     
-    }else {
-      if( (roll() + dy < 90) && (roll()+dy > -90)) 
-	setRoll(roll() + dy);
-      setYaw(yaw() + dx);
+void QPlot3D::writeRecordedFrame(int frame) {
+  const int tSlot = frame % RECORD_RING_SIZE;
+  QGLBuffer& tBuffer = mRecordBuffers[tSlot];
+  const QSize tSize  = mRecordSizes[tSlot];
+  if(!tBuffer.isCreated() || !tSize.isValid()) return;
+
+  tBuffer.bind();
+  const uchar* tPixels = (const uchar*)tBuffer.map(QGLBuffer::ReadOnly);
+  if(tPixels != NULL) {
+    // OpenGL rows start at the bottom
+    QImage tImage(tSize, QImage::Format_ARGB32);
+    const int tRowBytes = 4*tSize.width();
+    for (int y = 0; y < tSize.height(); y++) {
+      memcpy(tImage.scanLine(tSize.height()-1-y), tPixels + y*tRowBytes, tRowBytes);
     }
-  } else {
-    setPan(pan() + QVector3D(dx/32.0,-dy/32.0,0.0));
-  }
- 
-  mLastMousePos = event->pos();
-
-  mXAxis.adjustPlaneView();
-  mYAxis.adjustPlaneView();
-  mZAxis.adjustPlaneView();
+    tBuffer.unmap();
 
+    // Hold back rendering if the writers can not keep up
+    mWriterSlots.acquire();
+    mWriterPool.start(new QFrameWriter(tImage, mRecordFileName.arg(frame, 6, 10, QChar('0')), &mWriterSlots));
+  }
+  tBuffer.release();
 }
 
-void QPlot3D::mouseDoubleClickEvent(QMouseEvent* event) {
-  event->accept();
-  mAxisEqual = !mAxisEqual;
-  rescaleAxis();
+// Writes the frames still in the pixel buffer ring and waits for the writers.
+void QPlot3D::flushRecording() {
+  for (int i = std::max(0, mRecordFrame-RECORD_RING_SIZE); i < mRecordFrame; i++) {
+    writeRecordedFrame(i);
+  }
+  mWriterPool.waitForDone();
+  for (int i = 0; i < RECORD_RING_SIZE; i++) {
+    mRecordSizes[i] = QSize();
+  }
 }
 
-void QPlot3D::wheelEvent(QWheelEvent* event) 
-{
-  event->accept();  
-  setZoom( zoom() + (double)event->delta()/32);
+// Renders the camera path offscreen at a fixed timestep, independent of how
+// long each frame takes, and writes the frames to fileName. The frames do not
+// depend on the size of the widget or on whether it is covered. The widget
+// must have a valid GL context, whose state is set up here if the widget has
+// not been shown yet. Returns the number of frames written.
+int QPlot3D::renderCameraPath(const QCameraPath& path, double framesPerSecond, const QSize& size, const QString& fileName) {
+  if(path.isEmpty() || framesPerSecond <= 0.0 || mRecording) return 0;
+  if(!isValid()) return 0;
+
+  // Sets up the GL state with initializeGL(), as showing the widget would
+  glInit();
+  makeCurrent();
+  if(!QGLFramebufferObject::hasOpenGLFramebufferObjects()) return 0;
+
+  const QVector3D tTranslate = mTranslate;
+  const QVector3D tRotation  = mRotation;
+
+  mRenderSize   = size;
+  mRenderTarget = new QGLFramebufferObject(size);
+  resizeGL(viewWidth(), viewHeight());
+  startRecording(fileName);
+
+  const int nFrames = (int)floor(path.duration()*framesPerSecond) + 1;
+  for (int i = 0; i < nFrames; i++) {
+    double tAzimuth, tElevation, tZoom;
+    path.cameraAt(path.startTime() + i/framesPerSecond, &tAzimuth, &tElevation, &tZoom);
+    // Set directly, so that linked plots do not follow and nothing repaints
+    mRotation.setZ(-tAzimuth);
+    mRotation.setX(tElevation);
+    if(tZoom < 0.0) mTranslate.setZ(tZoom);
+    mXAxis.adjustPlaneView();
+    mYAxis.adjustPlaneView();
+    mZAxis.adjustPlaneView();
+
+    mRenderTarget->bind();
+    paintGL();
+    mRenderTarget->release();
+  }
+  stopRecording();
 
+  delete mRenderTarget;
+  mRenderTarget = NULL;
+  mRenderSize   = QSize();
+
+  // Back to the camera of the widget
+  mTranslate = tTranslate;
+  mRotation  = tRotation;
   mXAxis.adjustPlaneView();
   mYAxis.adjustPlaneView();
   mZAxis.adjustPlaneView();
+  resizeGL(width(), height());
+  updateGL();
 
+  return nFrames;
 }
 
-void QPlot3D::addCurve(QCurve3D* curve) { 
-  mCurves.push_back(curve);  
-  rescaleAxis();
+// Writes the plot to fileName as a PDF, or as an SVG when built with Qt SVG,
+// depending on its suffix. The page has the given size in pixels of the
+// widget, or the size of the widget, and every subplot is written in its
+// place. Polylines are simplified to tolerance pixels. Returns false if the
+// file could not be written.
+bool QPlot3D::exportFigure(const QString& fileName, const QSize& size, double tolerance) {
+  const QSize tSize = size.isValid() ? size : this->size();
+  const int   tDpi  = logicalDpiX();
+  const QString tSuffix = QFileInfo(fileName).suffix().toLower();
+
+  // Page units are pixels of the widget, so text is measured as on screen
+  QScopedPointer<QPaintDevice> tDevice;
+  if(tSuffix == "pdf") {
+    QPdfWriter* tWriter = new QPdfWriter(fileName);
+    tDevice.reset(tWriter);
+    tWriter->setResolution(tDpi);
+    tWriter->setPageSize(QPageSize(QSizeF(tSize)*25.4/tDpi, QPageSize::Millimeter, QString(), QPageSize::ExactMatch));
+    tWriter->setPageMargins(QMarginsF(0,0,0,0));
+    tWriter->setCreator("QPlot3D");
+  } else if(tSuffix == "svg") {
+#ifdef QPLOT3D_SVG
+    QSvgGenerator* tGenerator = new QSvgGenerator;
+    tDevice.reset(tGenerator);
+    tGenerator->setFileName(fileName);
+    tGenerator->setSize(tSize);
+    tGenerator->setViewBox(QRect(QPoint(0,0), tSize));
+    tGenerator->setResolution(tDpi);
+#else
+    qWarning() << "QPlot3D: built without Qt SVG, can not write" << fileName;
+    return false;
+#endif
+  } else {
+    qWarning() << "QPlot3D: can only export .pdf and .svg figures, not" << fileName;
+    return false;
+  }
+
+  QPainter tPainter;
+  if(!tPainter.begin(tDevice.data())) return false;
+  tPainter.setRenderHint(QPainter::Antialiasing);
+
+  makeCurrent();
+  const int tQualityLevel = mQualityLevel;
+  mQualityLevel    = FULL_QUALITY;
+  mExportPainter   = &tPainter;
+  mExportTolerance = tolerance;
+  mRenderSize      = tSize;
+
+  // The camera of each subplot is loaded as for drawing it, so that the
+  // axes are placed by the same matrices as on screen
+  const int tCurrent = mCurrentSubplot;
+  const int nViews   = std::max(1, mSubplots.size());
+  for (int i = 0; i < nViews; i++) {
+    setCurrentSubplot(i);
+    resizeGL(viewWidth(), viewHeight());
+    loadCamera();
+    tPainter.save();
+    tPainter.translate(viewRect().topLeft());
+    tPainter.setClipRect(QRect(QPoint(0,0), viewSize()));
+    exportView(&tPainter);
+    tPainter.restore();
+  }
+  setCurrentSubplot(tCurrent);
+  const bool tWritten = tPainter.end();
+
+  mExportPainter = NULL;
+  mRenderSize    = QSize();
+  mQualityLevel  = tQualityLevel;
+  glDisable(GL_SCISSOR_TEST);
+  resizeGL(width(), height());
   updateGL();
-} 
 
-void QPlot3D::setBackgroundColor(QColor color) { 
-  mBackgroundColor = color;   
-  makeCurrent(); 
-  qglClearColor(mBackgroundColor); 
+  return tWritten;
 }
 
-void QPlot3D::rescaleAxis() {
-  QRange tRange = mXAxis.range();
-  int tSize = mCurves.size();
-  for(int i = 0; i < tSize; i++) {
-    tRange.setIfMin(mCurves[i]->range());
-    tRange.setIfMax(mCurves[i]->range());
+void QPlot3D::saveFigure() {
+  const QString tFileName = QFileDialog::getSaveFileName(this, "Export Figure", "figure.pdf", "Figures (*.pdf *.svg)");
+  if(tFileName.isEmpty()) return;
+  if(!exportFigure(tFileName)) {
+    QMessageBox::warning(this, "Export Figure", QString("Could not write %1").arg(tFileName));
   }
-  mXAxis.setRange(tRange);
-  mYAxis.setRange(tRange);
-  mZAxis.setRange(tRange);
-  
-  if (mAxisEqual) 
-    axisEqual();
-  else 
-    axisTight();
-
-  mXAxis.adjustPlaneView();
-  mYAxis.adjustPlaneView();
-  mZAxis.adjustPlaneView();
 }
 
-void QPlot3D::axisEqual() {
-  QVector3D delta = mXAxis.range().delta();
-  double k = std::max(delta.x(),std::max(delta.y(),delta.z()));
-  mScale.setX( 10.0/k);
-  mScale.setY( 10.0/k);
-  mScale.setZ( 10.0/k);
-  updateGL();
-}
+// Writes the current subplot through painter, in the order it is drawn
+void QPlot3D::exportView(QPainter* painter) {
+  painter->fillRect(QRect(QPoint(0,0), viewSize()), mBackgroundColor);
 
-void QPlot3D::axisTight() {
-  QVector3D delta = mXAxis.range().delta();
-  mScale.setX( 10.0/delta.x());
-  mScale.setY( 10.0/delta.y());
-  mScale.setZ( 10.0/delta.z());
-  updateGL();
-}
+  drawBackground();
 
-QVector3D QPlot3D::cameraPositionInWorldCoordinates() const {
+  // The density grid is a texture, the curves are written instead
+  for(int i = 0; i < mCurves.size(); i++) {
+    exportCurve(painter, mCurves[i]);
+  }
+  for(int i = 0; i < mQuivers.size(); i++) {
+    exportQuiver(painter, mQuivers[i]);
+  }
 
-  QVector3D tObjectCenter = mXAxis.range().center();
-  
-  QQuaternion q1 = QQuaternion::fromAxisAndAngle(1.0, 0.0, 0.0, (mRotation.x()-90));
-  QQuaternion q2 = QQuaternion::fromAxisAndAngle(0.0, 1.0, 0.0, mRotation.y());
-  QQuaternion q3 = QQuaternion::fromAxisAndAngle(0.0, 0.0, 1.0, mRotation.z());
-  QQuaternion q  = (q1*q2*q3).conjugate();
-  
-  return tObjectCenter + q.rotatedVector(-QVector3D(mTranslate.x()/mScale.x(),mTranslate.y()/mScale.y(),mTranslate.z()/mScale.z()));
-}
+  mXAxis.drawAxisBox();
+  mYAxis.drawAxisBox();
+  mZAxis.drawAxisBox();
 
-void QPlot3D::renderTextAtWorldCoordinates(const QVector3D& vec, QString str, QFont font) {
-  QVector3D sVec = toScreenCoordinates(vec);
-  renderTextAtScreenCoordinates(sVec.x(),sVec.y(),str,font);  
+  if(mShowLegend) {
+    exportLegend(painter);
+  }
 }
 
-void QPlot3D::renderTextAtScreenCoordinates(int x, int y, QString str, QFont font) {
-  setFont(font);
-  renderText(x,y,str);  
-}
-QVector3D QPlot3D::toScreenCoordinates(double worldX, double worldY, double worldZ) const {
-  return toScreenCoordinates(QVector3D(worldX,worldY,worldZ));
-}
+// Writes the visible vertices of curve as polylines in page coordinates.
+// Vertices closer than the export tolerance to the last vertex kept are
+// dropped as they are projected, a segment that is off the page ends the
+// polyline, and each polyline is simplified before it is written. Curves
+// colored by scalars are split where their color changes.
+void QPlot3D::exportCurve(QPainter* painter, QCurve3D* curve) {
+  if(curve->size() == 0 || !curve->isVisible()) return;
+  if(RangeOutsideView(mModelViewMatrix, mProjectionMatrix, curve->transformedRange())) return;
 
-QVector3D QPlot3D::toScreenCoordinates(const QVector3D& vec) const {
-  // v' = P*M*v
   GLdouble m[16];
-  GLdouble p[16];
+  const QMatrix4x4 tTransform = curve->transform();
+  if(curve->hasTransform()) {
+    MultiplyMatrix(mModelViewMatrix, tTransform, m);
+  } else {
+    std::copy(mModelViewMatrix, mModelViewMatrix+16, m);
+  }
+  const bool   tClipped   = mClipPlaneMask != 0;
+  const bool   tScalar    = curve->hasScalar();
+  const double tTolerance = mExportTolerance;
+  const double tMargin    = curve->lineWidth();
+  const QRectF tPage      = QRectF(QPointF(0,0), viewSize()).adjusted(-tMargin,-tMargin,tMargin,tMargin);
+  double tDelta = curve->scalarMax() - curve->scalarMin();
+  if(tDelta == 0.0) tDelta = 1.0;
+  const char* tScalars      = (const char*)curve->scalarData();
+  const int   tScalarStride = curve->scalarStride();
+
+  QPen tPen(curve->color(), curve->lineWidth(), Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
+  painter->setPen(tPen);
+  painter->setBrush(Qt::NoBrush);
+
+  int tFirst, tEnd;
+  visibleRange(curve, &tFirst, &tEnd);
+  QVector<GLint>   tFirsts;
+  QVector<GLsizei> tCounts;
+  curve->strips(tFirst, tEnd, 1, &tFirsts, &tCounts);
+
+  QPolygonF tLine;
+  int tColorStep = -1;
+  for (int s = 0; s < tFirsts.size(); s++) {
+    bool    tHasLast  = false;
+    QPointF tLast;
+    int     tLastCode = 0;
+    for (int i = tFirsts[s]; i < tFirsts[s]+tCounts[s]; i++) {
+      const QVector3D& tVertex = curve->mVertices[i];
+      QVector3D tScreen;
+      if((tClipped && isClipped(curve->hasTransform() ? tTransform.map(tVertex) : tVertex)) ||
+         !ProjectToScreen(m, mProjectionMatrix, viewWidth(), viewHeight(), tVertex, &tScreen)) {
+        FlushPolyline(painter, &tLine, tTolerance);
+        tHasLast = false;
+        continue;
+      }
+      const QPointF tPoint(tScreen.x(), tScreen.y());
+      const int  tCode    = OutCode(tPoint, tPage);
+      const bool tSegment = tHasLast && (tLastCode & tCode) == 0;
+      const int  tStep    = tScalar ? qBound(0, (int)((*(const float*)(tScalars + i*tScalarStride) - curve->scalarMin())/tDelta*EXPORT_COLOR_STEPS), EXPORT_COLOR_STEPS-1) : 0;
+
+      if(tScalar && tStep != tColorStep) {
+        // The segment to this vertex has the color of the last vertex
+        if(tSegment) {
+          if(tLine.isEmpty()) tLine.push_back(tLast);
+          tLine.push_back(tPoint);
+        }
+        FlushPolyline(painter, &tLine, tTolerance);
+        tColorStep = tStep;
+        tPen.setColor(ColorMapColor(curve->mColorMap, (tStep+0.5)/EXPORT_COLOR_STEPS));
+        painter->setPen(tPen);
+        tLine.push_back(tPoint);
+      } else if(tSegment) {
+        if(tLine.isEmpty()) tLine.push_back(tLast);
+        const QPointF tMove = tPoint - tLine.last();
+        if(QPointF::dotProduct(tMove, tMove) >= tTolerance*tTolerance) tLine.push_back(tPoint);
+      } else {
+        FlushPolyline(painter, &tLine, tTolerance);
+      }
+      tLast     = tPoint;
+      tLastCode = tCode;
+      tHasLast  = true;
+    }
+    FlushPolyline(painter, &tLine, tTolerance);
+  }
+}
 
-  glGetDoublev(GL_MODELVIEW_MATRIX,&m[0]);
-  glGetDoublev(GL_PROJECTION_MATRIX,&p[0]);
+// Writes every stride:th arrow of quiver as a line with an open head
+void QPlot3D::exportQuiver(QPainter* painter, QQuiver3D* quiver) {
+  const int nSamples = quiver->size();
+  if(nSamples == 0 || !quiver->isVisible()) return;
+  if(RangeOutsideView(mModelViewMatrix, mProjectionMatrix, quiver->range())) return;
+
+  const QRectF tPage(QPointF(0,0), viewSize());
+  const bool   tColorMap = !quiver->colorMap().isEmpty();
+  double tDelta = quiver->magnitudeMax() - quiver->magnitudeMin();
+  if(tDelta <= 0.0) tDelta = 1.0;
+
+  QPen tPen(quiver->color(), 1.0, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
+  painter->setPen(tPen);
+  for (int i = 0; i < nSamples; i += quiver->stride()) {
+    const QVector3D tFrom = quiver->position(i);
+    const QVector3D tTo   = tFrom + quiver->scale()*quiver->vector(i);
+    if(mClipPlaneMask != 0 && isClipped(tFrom)) continue;
+    QVector3D s0, s1;
+    if(!ProjectToScreen(mModelViewMatrix, mProjectionMatrix, viewWidth(), viewHeight(), tFrom, &s0) ||
+       !ProjectToScreen(mModelViewMatrix, mProjectionMatrix, viewWidth(), viewHeight(), tTo, &s1)) continue;
+    const QLineF tShaft(s0.x(), s0.y(), s1.x(), s1.y());
+    if(tShaft.length() < mExportTolerance) continue;
+    if((OutCode(tShaft.p1(), tPage) & OutCode(tShaft.p2(), tPage)) != 0) continue;
+
+    if(tColorMap) {
+      tPen.setColor(ColorMapColor(quiver->mColorMap, (quiver->vector(i).length() - quiver->magnitudeMin())/tDelta));
+      painter->setPen(tPen);
+    }
+    QLineF tHead(tShaft.p2(), tShaft.p1());
+    tHead.setLength(0.25*tShaft.length());
+    QLineF tLeft  = tHead;
+    QLineF tRight = tHead;
+    tLeft.setAngle(tHead.angle() + 20.0);
+    tRight.setAngle(tHead.angle() - 20.0);
+    const QLineF tLines[3] = { tShaft, tLeft, tRight };
+    painter->drawLines(tLines, 3);
+  }
+}
 
-  GLint viewPort[4];
-  viewPort[0]  = 0;
-  viewPort[1]  = 0;
-  viewPort[2]  = width();
-  viewPort[3]  = height();
+// Writes the legend and the color bar with the layout of drawLegend() and
+// drawColorBar()
+void QPlot3D::exportLegend(QPainter* painter) {
+  const QFontMetrics tMetrics(mLegendFont);
+  int tFirst = 0, tLast = 0;
+  const QRect tRect = legendRect(&tFirst, &tLast);
+  if(!tRect.isEmpty()) paintLegend(painter, tRect, tFirst, tLast);
+  painter->setFont(mLegendFont);
+
+  // Color bar of the first curve colored by scalars
+  for (int i = 0; i < mCurves.size(); i++) {
+    const QCurve3D* tCurve = mCurves[i];
+    if(!tCurve->hasScalar()) continue;
+    const double x0 = viewWidth()-25;
+    const double x1 = viewWidth()-10;
+    const double y0 = viewHeight()-10;
+    const double y1 = viewHeight()-160;
+    painter->setPen(QPen(Qt::black, 1.0));
+    painter->setBrush(ColorMapGradient(tCurve->mColorMap, QPointF(0, y0), QPointF(0, y1)));
+    painter->drawRect(QRectF(QPointF(x0, y1), QPointF(x1, y0)));
+
+    const QString tMax = QString("%1").arg(tCurve->scalarMax(),0,'g',4);
+    const QString tMin = QString("%1").arg(tCurve->scalarMin(),0,'g',4);
+    painter->drawText(QPointF(x0-5-tMetrics.width(tMax), y1+tMetrics.height()), tMax);
+    painter->drawText(QPointF(x0-5-tMetrics.width(tMin), y0), tMin);
+    break;
+  }
+  painter->setBrush(Qt::NoBrush);
+}
 
-  // M*v
-  const double f1 = m[0]*vec.x() + m[4]*vec.y() + m[8]*vec.z() + m[12];
-  const double f2 = m[1]*vec.x() + m[5]*vec.y() + m[9]*vec.z() + m[13];
-  const double f3 = m[2]*vec.x() + m[6]*vec.y() + m[10]*vec.z() + m[14];
-  const double f4 = m[3]*vec.x() + m[7]*vec.y() + m[11]*vec.z() + m[15];
+void QPlot3D::updateQuality(double frameTime) {
+  // Smooth the frame time over the last few frames
+  mFrameTime = (mFrameTime == 0.0) ? frameTime : 0.7*mFrameTime + 0.3*frameTime;
 
-  // P*M*v
-  double g1 = p[0]*f1 + p[4]*f2 + p[8]*f3  + p[12]*f4;
-  double g2 = p[1]*f1 + p[5]*f2 + p[9]*f3  + p[13]*f4;
-  double g3 = p[2]*f1 + p[6]*f2 + p[10]*f3 + p[14]*f4;
-  double g4 = -f3;
+  if(mFrameTime > mDegradeThreshold*mTargetFrameTime && mQualityLevel < LOWEST_QUALITY) {
+    mQualityLevel++;
+    mFrameTime = 0.0;
+  } else if(mFrameTime < mRecoverThreshold*mTargetFrameTime && mQualityLevel > FULL_QUALITY) {
+    mQualityLevel--;
+    mFrameTime = 0.0;
+  }
+  mInteractionQualityLevel = mQualityLevel;
+}
 
-  if(g4 == 0.0) return QVector3D(0.0,0.0,0.0);
-  g1 /= g4;
-  g2 /= g4;
-  g3 /= g4;
-       
-  return QVector3D( (g1*0.5+0.5)*viewPort[2] + viewPort[0], 
-  		    height()- ((g2*0.5+0.5)*viewPort[3] + viewPort[1]),
-  		    (1.0+g3)*0.5);
-  
+void QPlot3D::beginInteraction() {
+  if(!mAdaptiveQuality) return;
+  if(!mInteracting) {
+    // Continue at the level the last interaction ended with
+    mInteracting  = true;
+    mQualityLevel = mInteractionQualityLevel;
+    mFrameTime    = 0.0;
+  }
+  mInteractionTimer.start();
 }
 
-void QPlot3D::setShowAxis(bool value) {
-  mXAxis.setShowAxis(value);
-  mXAxis.setShowLabel(value);
+void QPlot3D::endInteraction() {
+  mInteracting  = false;
+  mQualityLevel = FULL_QUALITY;
+  updateGL();
+}
 
-  mYAxis.setShowAxis(value);
-  mYAxis.setShowLabel(value);
+void QPlot3D::loadCamera() {
+  glLoadIdentity();
 
-  mZAxis.setShowAxis(value);
-  mZAxis.setShowLabel(value);
+  glTranslatef(mTranslate.x(),mTranslate.y(),mTranslate.z());
+
+  glRotatef(mRotation.x()-90, 1.0, 0.0, 0.0);
+  glRotatef(mRotation.y(), 0.0, 1.0, 0.0);
+  glRotatef(mRotation.z(), 0.0, 0.0, 1.0);
+
+  glScalef(mScale.x(),mScale.y(),mScale.z());
+  
+  QVector3D tCenter = mXAxis.range().center();
+  glTranslatef(-tCenter.x(),-tCenter.y(),-tCenter.z());
+
+  // Keep the matrices so that picking can be done between frames
+  glGetDoublev(GL_MODELVIEW_MATRIX,mModelViewMatrix);
+  glGetDoublev(GL_PROJECTION_MATRIX,mProjectionMatrix);
+  mHasMatrices = true;
 }
 
-void QPlot3D::setShowAxisBox(bool value) {
-  mXAxis.setShowAxisBox(value);
-  mYAxis.setShowAxisBox(value);
-  mZAxis.setShowAxisBox(value);
+void QPlot3D::drawBackground() {
+  // DRAW AXIS
+  mXAxis.draw();
+  mYAxis.draw();
+  mZAxis.draw();
 }
 
-void QPlot3D::setShowGrid(bool value) {
-  mXAxis.setShowPlane(value);
-  mXAxis.setShowGrid(value);
+void QPlot3D::drawData() {
+  const int nCurves = mCurves.size();
 
-  mYAxis.setShowPlane(value);
-  mYAxis.setShowGrid(value);
+  // DRAW DENSITY INSTEAD OF CURVES
+  const bool tDensity = mDensityMode != DENSITY_OFF;
+  if(tDensity) {
+    updateDensity();
+    drawDensity();
+  }
 
-  mZAxis.setShowPlane(value);
-  mZAxis.setShowGrid(value);
+  // DRAW CURVES, CLOUDS AND QUIVERS
+  enableClipPlanes();
+  for(int i = 0; i < nCurves && !tDensity; i++) {
+    drawCurve(mCurves[i]);
+  }
+  for(int i = 0; i < mClouds.size(); i++) {
+    drawCloud(mClouds[i]);
+  }
+  for(int i = 0; i < mQuivers.size(); i++) {
+    drawQuiver(mQuivers[i]);
+  }
+  disableClipPlanes();
 }
 
+// Returns the length in pixels of the diagonal of the screen projection of
+// range, or infinity when it is partly behind the camera.
+double QPlot3D::screenSize(const QRange& range) const {
+  double minX =  std::numeric_limits<double>::max();
+  double minY =  std::numeric_limits<double>::max();
+  double maxX = -std::numeric_limits<double>::max();
+  double maxY = -std::numeric_limits<double>::max();
+  for (int i = 0; i < 8; i++) {
+    const QVector3D tCorner((i & 1) ? range.max.x() : range.min.x(),
+                            (i & 2) ? range.max.y() : range.min.y(),
+                            (i & 4) ? range.max.z() : range.min.z());
+    QVector3D tScreen;
+    if(!ProjectToScreen(mModelViewMatrix,mProjectionMatrix,viewWidth(),viewHeight(),tCorner,&tScreen))
+      return std::numeric_limits<double>::max();
+    minX = qMin(minX, (double)tScreen.x());
+    minY = qMin(minY, (double)tScreen.y());
+    maxX = qMax(maxX, (double)tScreen.x());
+    maxY = qMax(maxY, (double)tScreen.y());
+  }
+  return QVector2D(maxX-minX, maxY-minY).length();
+}
 
-void QPlot3D::draw3DLine(QVector3D from, QVector3D to, double lineWidth, QColor color) {
+// Draws the loaded nodes of the cloud that are in view and large enough on
+// screen, from the root down, and requests the missing ones, largest first.
+// The children of a node are only drawn once the node itself is loaded.
+void QPlot3D::drawCloud(QOctreeCloud* cloud) {
+  if(!cloud->isOpen() || !cloud->isVisible()) return;
+  cloud->collect();
+
+  glPointSize(cloud->pointSize());
+  const QColor tColor = cloud->color();
+  glColor4f(tColor.redF(),tColor.greenF(),tColor.blueF(),tColor.alphaF());
+  glEnableClientState(GL_VERTEX_ARRAY);
+
+  QVector<int> tStack;
+  tStack.push_back(0);
+  QList<QPair<double,int> > tMissing;
+  while(!tStack.isEmpty()) {
+    const int i = tStack.last();
+    tStack.pop_back();
+    const QOctreeFormat::Node& tNode = cloud->mNodes[i];
+    const QRange tRange(QVector3D(tNode.min[0],tNode.min[1],tNode.min[2]), QVector3D(tNode.max[0],tNode.max[1],tNode.max[2]));
+    if(RangeOutsideView(mModelViewMatrix, mProjectionMatrix, tRange)) continue;
+    const double tSize = screenSize(tRange);
+    if(i != 0 && tSize < cloud->mMinNodeSize) continue;
+
+    QOctreeNodeData* d = cloud->mLoaded.value(i, NULL);
+    if(d == NULL) {
+      if(!cloud->mRequested.contains(i) && !cloud->mFailed.contains(i)) tMissing.push_back(qMakePair(-tSize, i));
+      continue;
+    }
+    d->lastUsed = mFrameCounter;
+    if(!d->points.isEmpty()) {
+      if(!d->buffer.isCreated() && d->buffer.create()) {
+        d->buffer.bind();
+        d->buffer.allocate(d->points.constData(), d->points.size()*sizeof(QVector3D));
+      }
+      if(d->buffer.isCreated()) {
+        d->buffer.bind();
+        glVertexPointer(3,GL_FLOAT,0,0);
+      } else {
+        glVertexPointer(3,GL_FLOAT,0,d->points.constData());
+      }
+      glDrawArrays(GL_POINTS,0,d->points.size());
+      if(d->buffer.isCreated()) d->buffer.release();
+    }
+    for (int c = 0; c < 8; c++) {
+      if(tNode.children[c] >= 0) tStack.push_back(tNode.children[c]);
+    }
+  }
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glPointSize(1);
 
-  const QVector3D tFrom = toScreenCoordinates(from);
-  const QVector3D tTo   = toScreenCoordinates(to);
+  std::sort(tMissing.begin(), tMissing.end());
+  for (int i = 0; i < tMissing.size(); i++) {
+    cloud->request(tMissing[i].second, mFrameCounter);
+  }
+  if(!cloud->mRequested.isEmpty()) QTimer::singleShot(OCTREE_POLL_INTERVAL, this, SLOT(update()));
+}
 
-  const QVector3D v = tTo-tFrom;
-  const QVector3D n1 = QVector3D::crossProduct(tTo,tFrom);
-  const QVector3D n = QVector3D::crossProduct(v,n1).normalized();
+void QPlot3D::setClipPlane(int index, const QVector4D& plane) {
+  if(index < 0 || index >= MAX_CLIP_PLANES) return;
+  if(mHasClipBox) clearClipBox();
+  mClipPlanes[index] = plane;
+  mClipPlaneMask |= 1 << index;
+  updateGL();
+}
+
+void QPlot3D::clearClipPlane(int index) {
+  if(index < 0 || index >= MAX_CLIP_PLANES) return;
+  if(mHasClipBox) clearClipBox();
+  mClipPlaneMask &= ~(1 << index);
+  updateGL();
+}
+
+// The box uses all clip planes, one for each face
+void QPlot3D::setClipBox(const QRange& box) {
+  mClipBox    = box;
+  mHasClipBox = true;
+  mClipPlanes[0] = QVector4D( 1, 0, 0, -box.min.x());
+  mClipPlanes[1] = QVector4D(-1, 0, 0,  box.max.x());
+  mClipPlanes[2] = QVector4D( 0, 1, 0, -box.min.y());
+  mClipPlanes[3] = QVector4D( 0,-1, 0,  box.max.y());
+  mClipPlanes[4] = QVector4D( 0, 0, 1, -box.min.z());
+  mClipPlanes[5] = QVector4D( 0, 0,-1,  box.max.z());
+  mClipPlaneMask = (1 << MAX_CLIP_PLANES) - 1;
+  if(mAxisFollowsClipBox) rescaleAxis();
+  updateGL();
+}
+
+void QPlot3D::clearClipBox() {
+  if(!mHasClipBox) return;
+  mHasClipBox    = false;
+  mClipPlaneMask = 0;
+  if(mAxisFollowsClipBox) {
+    // Grow the axes from the curves again
+    mXAxis.mRange = QRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max());
+    rescaleAxis();
+  }
+  updateGL();
+}
+
+void QPlot3D::clearClipping() {
+  clearClipBox();
+  mClipPlaneMask = 0;
+  updateGL();
+}
+
+void QPlot3D::setAxisFollowsClipBox(bool value) {
+  if(value == mAxisFollowsClipBox) return;
+  mAxisFollowsClipBox = value;
+  if(mHasClipBox) {
+    mXAxis.mRange = QRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max());
+    rescaleAxis();
+  }
+}
+
+// The planes are given in data coordinates, so they are set with the
+// modelview matrix of the data, which the GL applies to the equations.
+void QPlot3D::enableClipPlanes() {
+  for (int i = 0; i < MAX_CLIP_PLANES; i++) {
+    if(!hasClipPlane(i)) continue;
+    const GLdouble tEquation[4] = {mClipPlanes[i].x(), mClipPlanes[i].y(), mClipPlanes[i].z(), mClipPlanes[i].w()};
+    glClipPlane(GL_CLIP_PLANE0 + i, tEquation);
+    glEnable(GL_CLIP_PLANE0 + i);
+  }
+}
+
+void QPlot3D::disableClipPlanes() {
+  for (int i = 0; i < MAX_CLIP_PLANES; i++) {
+    if(hasClipPlane(i)) glDisable(GL_CLIP_PLANE0 + i);
+  }
+}
+
+bool QPlot3D::isClipped(const QVector3D& point) const {
+  for (int i = 0; i < MAX_CLIP_PLANES; i++) {
+    if(hasClipPlane(i) && QVector3D::dotProduct(mClipPlanes[i].toVector3D(), point) + mClipPlanes[i].w() < 0.0) return true;
+  }
+  return false;
+}
+
+void QPlot3D::setDensityResolution(int value) {
+  mDensityResolution = qBound(2, value, DENSITY_MAX_RESOLUTION);
+  updateGL();
+}
+
+// Picks up a finished density grid, and starts binning on the workers when
+// the grid is behind the curves. While the axis ranges, the clip planes and
+// the visible curves and their transforms stay the same only the appended
+// vertices are binned, otherwise the grid is binned from scratch and the old
+// grid is drawn until the new one is done.
+void QPlot3D::updateDensity() {
+  if(mDensity == NULL) mDensity = new QDensity;
+  QDensity* d = mDensity;
+
+  QDensityGrid* tResult = d->state->result.fetchAndStoreAcquire(NULL);
+  if(tResult != NULL) {
+    if(tResult->serial == d->serial) {
+      d->grid    = *tResult;
+      d->pending = false;
+      d->dirty   = true;
+    }
+    delete tResult;
+  }
+  if(d->pending) {
+    QTimer::singleShot(DENSITY_POLL_INTERVAL, this, SLOT(update()));
+    return;
+  }
+
+  // The grid spans the axis planes
+  if(mXAxis.mXTicks.isEmpty() || mXAxis.mYTicks.isEmpty() || mXAxis.mZTicks.isEmpty()) return;
+  QRange tBox;
+  tBox.min = QVector3D(mXAxis.mXTicks.first(), mXAxis.mYTicks.first(), mXAxis.mZTicks.first());
+  tBox.max = QVector3D(mXAxis.mXTicks.last(),  mXAxis.mYTicks.last(),  mXAxis.mZTicks.last());
+  const int n = mDensityResolution;
+
+  QVector<QCurve3D*> tCurves;
+  for (int i = 0; i < mCurves.size(); i++) {
+    if(mCurves[i]->isVisible()) tCurves.push_back(mCurves[i]);
+  }
+  QVector<QVector4D> tClipPlanes;
+  for (int i = 0; i < MAX_CLIP_PLANES; i++) {
+    if(hasClipPlane(i)) tClipPlanes.push_back(mClipPlanes[i]);
+  }
+
+  const QDensityGrid& tGrid = d->grid;
+  bool tFull = n != tGrid.resolution || tBox.min != tGrid.box.min || tBox.max != tGrid.box.max ||
+               tClipPlanes != tGrid.clipPlanes || tCurves.size() != tGrid.curves.size();
+  for (int i = 0; i < tCurves.size() && !tFull; i++) {
+    const int tIndex = tGrid.curves.indexOf(tCurves[i]);
+    tFull = tIndex < 0 || tGrid.curveSerials[tIndex] != tCurves[i]->mSerial || tGrid.curveCounts[tIndex] > tCurves[i]->size() ||
+            tGrid.curveTransforms[tIndex] != tCurves[i]->transform();
+  }
+
+  QSharedPointer<QDensityBatch> tBatch(new QDensityBatch);
+  tBatch->state = d->state;
+  tBatch->grid  = new QDensityGrid;
+  QDensityGrid* g = tBatch->grid;
+  g->box        = tBox;
+  g->resolution = n;
+  g->counts     = tFull ? QVector<quint32>(n*n*n, 0) : tGrid.counts;
+  g->clipPlanes = tClipPlanes;
+
+  qint64 tTotal = 0;
+  for (int i = 0; i < tCurves.size(); i++) {
+    const int tIndex = tFull ? -1 : tGrid.curves.indexOf(tCurves[i]);
+    const int tFirst = tIndex < 0 ? 0 : tGrid.curveCounts[tIndex];
+    // The simplifier may still move the last vertex without a new serial, it
+    // is binned once the next vertex is added
+    const int tEnd = tCurves[i]->mSimplifyTolerance > 0.0 ? std::max(0, tCurves[i]->size()-1) : tCurves[i]->size();
+    g->curves.push_back(tCurves[i]);
+    g->curveSerials.push_back(tCurves[i]->mSerial);
+    g->curveCounts.push_back(tEnd);
+    g->curveTransforms.push_back(tCurves[i]->transform());
+    if(tEnd <= tFirst) continue;
+
+    // Copy only the vertices to bin, a snapshot sharing all of them would be
+    // copied by the curve on the next append
+    const QVector<QVector3D>& tVertices = tCurves[i]->mVertices;
+    QVector<QVector3D> tCopy(tEnd - tFirst);
+    std::copy(tVertices.constBegin() + tFirst, tVertices.constBegin() + tEnd, tCopy.begin());
+    tBatch->vertices.push_back(tCopy);
+    tBatch->transforms.push_back(g->curveTransforms.last());
+    tTotal += tCopy.size();
+  }
+
+  d->serial++;
+  d->state->serial.storeRelease(d->serial);
+  g->serial = d->serial;
+  if(tTotal == 0) {
+    // Nothing to bin, the grid only changed its box or curves
+    if(tFull) {
+      d->grid  = *g;
+      d->dirty = true;
+    }
+    return;
+  }
+
+  const int nJobs = (int)std::max<qint64>(1, std::min<qint64>(mWorkerPool.maxThreadCount(), tTotal/DENSITY_JOB_SIZE));
+  tBatch->remaining = nJobs;
+  for (int j = 0; j < nJobs; j++) {
+    mWorkerPool.start(new QDensityJob(tBatch, tTotal*j/nJobs, tTotal*(j+1)/nJobs));
+  }
+  d->pending = true;
+  QTimer::singleShot(DENSITY_POLL_INTERVAL, this, SLOT(update()));
+}
+
+void QPlot3D::drawDensity() {
+  QDensity* d = mDensity;
+  const QDensityGrid& tGrid = d->grid;
+  const int n = tGrid.resolution;
+  if(n == 0) return;
+
+  // Make the plane textures and the voxels of a new grid
+  if(d->dirty) {
+    d->dirty = false;
+    const quint32* tCounts = tGrid.counts.constData();
+
+    // Sums along the axis normal to each plane: XY, YZ and ZX
+    QVector<quint32> tPlanes[3];
+    for (int p = 0; p < 3; p++) tPlanes[p].fill(0, n*n);
+    quint32 tVoxelMax = 0;
+    for (int z = 0; z < n; z++) {
+      for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+          const quint32 c = tCounts[x + n*(y + n*z)];
+          tPlanes[0][x + n*y] += c;
+          tPlanes[1][y + n*z] += c;
+          tPlanes[2][z + n*x] += c;
+          tVoxelMax = std::max(tVoxelMax, c);
+        }
+      }
+    }
+
+    // Densities are shown on a log scale
+    if(d->planeTextures[0] == 0) glGenTextures(3, d->planeTextures);
+    QVector<GLubyte> tTexels(4*n*n);
+    for (int p = 0; p < 3; p++) {
+      const quint32 tMax = *std::max_element(tPlanes[p].constBegin(), tPlanes[p].constEnd());
+      const double  tLogMax = log(1.0 + tMax);
+      for (int i = 0; i < n*n; i++) {
+        DensityColor(tMax > 0 ? log(1.0 + tPlanes[p][i])/tLogMax : 0.0, 0.4, 1.0, &tTexels[4*i]);
+      }
+      glBindTexture(GL_TEXTURE_2D, d->planeTextures[p]);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, n, n, 0, GL_RGBA, GL_UNSIGNED_BYTE, tTexels.constData());
+    }
+
+    d->voxelCenters.clear();
+    d->voxelColors.clear();
+    const QVector3D tCell = tGrid.box.delta()/n;
+    const double tLogMax = log(1.0 + tVoxelMax);
+    for (int i = 0; i < n*n*n; i++) {
+      if(tCounts[i] == 0) continue;
+      const int x = i % n;
+      const int y = (i/n) % n;
+      const int z = i/(n*n);
+      d->voxelCenters.push_back(tGrid.box.min + QVector3D(x+0.5, y+0.5, z+0.5)*tCell);
+      d->voxelColors.resize(d->voxelColors.size()+4);
+      DensityColor(log(1.0 + tCounts[i])/tLogMax, 0.05, 0.6, d->voxelColors.end()-4);
+    }
+  }
 
-  enable2D();  // Actually, set glOrtho...
-  // glEnable(GL_DEPTH_TEST);
   glEnable(GL_BLEND);
+  if(mDensityMode == DENSITY_PLANES) {
+    glColor4f(1,1,1,1);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    glEnable(GL_TEXTURE_2D);
+    mXAxis.drawDensity(d->planeTextures[0]);
+    mYAxis.drawDensity(d->planeTextures[1]);
+    mZAxis.drawDensity(d->planeTextures[2]);
+    glDisable(GL_TEXTURE_2D);
+  } else if(!d->voxelCenters.isEmpty()) {
+    // Voxels are drawn as points the size of the cell at the center of the
+    // grid on screen, so with perspective nearer cells are a bit too small
+    QRange tCell;
+    tCell.min = tGrid.box.center() - 0.5*tGrid.box.delta()/n;
+    tCell.max = tGrid.box.center() + 0.5*tGrid.box.delta()/n;
+    glPointSize(qBound(1.0, screenSize(tCell)/sqrt(3.0), (double)MAX_VOXEL_POINT_SIZE));
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, d->voxelCenters.constData());
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, d->voxelColors.constData());
+    glDrawArrays(GL_POINTS, 0, d->voxelCenters.size());
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glPointSize(1);
+  }
+  glDisable(GL_BLEND);
+}
+
+void QPlot3D::drawOverlay() {
+  // DRAW AXIS BOX
+  mXAxis.drawAxisBox();
+  mYAxis.drawAxisBox();
+  mZAxis.drawAxisBox();
+
+  // DRAW LEGEND
+  if(mShowLegend) {
+    drawLegend();
+    drawColorBar();
+  }
+
+  // DRAW ELEVATION AZIMUTH TEXT BOX
+  if(mShowAzimuthElevation) {  
+    drawTextBox(10,viewHeight()-15,QString("Az: %1 El: %2").arg(azimuth(),3,'f',1).arg(elevation(),3,'f',1));
+  }
+
+  // DRAW MEMORY USAGE TEXT BOX
+  if(mShowMemoryUsage) {
+    drawTextBox(10,viewHeight()-(mShowAzimuthElevation ? 45 : 15),memoryUsageText());
+  }
+}
+
+// Binds layer and clears it if key differs from the key the layer was
+// rendered with. Returns false if the cached layer can be used as it is.
+bool QPlot3D::beginLayer(QGLFramebufferObject** layer, QByteArray* cachedKey, const QByteArray& key, const QColor& clearColor) {
+  if(*layer != NULL && (*layer)->size() == viewSize() && *cachedKey == key) return false;
+
+  if(*layer == NULL || (*layer)->size() != viewSize()) {
+    delete *layer;
+    *layer = new QGLFramebufferObject(viewSize());
+  }
+  *cachedKey = key;
+
+  mActiveLayer = *layer;
+  mActiveLayer->bind();
+  resizeGL(viewWidth(),viewHeight());
+  // Layers hold colors premultiplied with alpha, so that drawLayer() can
+  // composite them with GL_ONE. Blending alpha with GL_ONE keeps it from
+  // being applied twice.
+  const double tAlpha = clearColor.alphaF();
+  glClearColor(clearColor.redF()*tAlpha, clearColor.greenF()*tAlpha, clearColor.blueF()*tAlpha, tAlpha);
+  glClear(GL_COLOR_BUFFER_BIT);
+  BlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+  return true;
+}
+
+void QPlot3D::endLayer() {
+  // Text can not be rendered with renderText() into a framebuffer object
+  if(!mLayerTexts.isEmpty()) {
+    QPainter tPainter(mActiveLayer);
+    for (int i = 0; i < mLayerTexts.size(); i++) {
+      tPainter.setFont(mLayerTexts[i].font);
+      tPainter.setPen(mLayerTexts[i].color);
+      tPainter.drawText(mLayerTexts[i].pos, mLayerTexts[i].string);
+    }
+    tPainter.end();
+    mLayerTexts.clear();
+  }
+
+  mActiveLayer->release();
+  mActiveLayer = NULL;
+  if(mRenderTarget != NULL) mRenderTarget->bind();
+
+  qglClearColor(mBackgroundColor);
   glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+  resizeGL(viewWidth(),viewHeight());
+  loadCamera();
+}
 
-  const QVector3D d = 0.5*lineWidth*n;
-  const QVector3D v1 = tFrom - d;
-  const QVector3D v2 = tTo   - d;
-  const QVector3D v3 = tFrom;
-  const QVector3D v4 = tTo;  
-  const QVector3D v5 = tFrom + d;
-  const QVector3D v6 = tTo   + d;
+void QPlot3D::drawLayer(QGLFramebufferObject* layer, bool blend) {
+  enable2D();
+  if(blend) {
+    // Layers hold colors premultiplied with alpha, see beginLayer()
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE,GL_ONE_MINUS_SRC_ALPHA);
+  } else {
+    glDisable(GL_BLEND);
+  }
+  glBindTexture(GL_TEXTURE_2D, layer->texture());
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+  glEnable(GL_TEXTURE_2D);
+  glBegin(GL_QUADS);
+  glTexCoord2f(0.0,1.0); glVertex2f(0,      0);
+  glTexCoord2f(1.0,1.0); glVertex2f(viewWidth(),0);
+  glTexCoord2f(1.0,0.0); glVertex2f(viewWidth(),viewHeight());
+  glTexCoord2f(0.0,0.0); glVertex2f(0,      viewHeight());
+  glEnd();
+  glDisable(GL_TEXTURE_2D);
+  glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+  glDisable(GL_BLEND);
+  disable2D();
+}
 
-  float vertexVec[] = { 
-    v1.x(),v1.y(),v1.z(),
-    v2.x(),v2.y(),v2.z(),
-    v3.x(),v3.y(),v3.z(),
-    v4.x(),v4.y(),v4.z(),
-    v5.x(),v5.y(),v5.z(),
-    v6.x(),v6.y(),v6.z()
-  };
+QByteArray QPlot3D::backgroundKey() const {
+  QByteArray tKey;
+  QDataStream tStream(&tKey, QIODevice::WriteOnly);
+  tStream << viewSize() << mTranslate << mRotation << mScale << mBackgroundColor << showTickLabels();
+  mXAxis.writeLayerKey(tStream);
+  mYAxis.writeLayerKey(tStream);
+  mZAxis.writeLayerKey(tStream);
+  return tKey;
+}
 
-  float colorVec[] = { 
-    color.redF(), color.greenF(), color.blueF(), 0.0,
-    color.redF(), color.greenF(), color.blueF(), 0.0,
-    color.redF(), color.greenF(), color.blueF(), 1.0,
-    color.redF(), color.greenF(), color.blueF(), 1.0,
-    color.redF(), color.greenF(), color.blueF(), 0.0,
-    color.redF(), color.greenF(), color.blueF(), 0.0,
-  };
+QByteArray QPlot3D::overlayKey() const {
+  QByteArray tKey;
+  QDataStream tStream(&tKey, QIODevice::WriteOnly);
+  tStream << viewSize() << mTranslate << mRotation << mScale
+          << mShowLegend << mShowAzimuthElevation << mLegendFont << mShowMemoryUsage
+          << mLegendFilter << mLegendPage;
+  if(mShowMemoryUsage) tStream << memoryUsageText();
+  mXAxis.writeLayerKey(tStream);
+  mYAxis.writeLayerKey(tStream);
+  mZAxis.writeLayerKey(tStream);
 
-  glVertexPointer(3,GL_FLOAT, 0, vertexVec);
-  glColorPointer(4,GL_FLOAT, 0, colorVec);
-  glEnableClientState(GL_VERTEX_ARRAY);    
-  glEnableClientState(GL_COLOR_ARRAY);    
-  glDrawArrays(GL_TRIANGLE_STRIP,0,6);
-  glDisableClientState(GL_COLOR_ARRAY);    
-  glDisableClientState(GL_VERTEX_ARRAY);    
-  
+  const int nCurves = mCurves.size();
+  for (int i = 0; i < nCurves; i++) {
+    const QCurve3D* tCurve = mCurves[i];
+    tStream << (quintptr)tCurve << tCurve->mStyleSerial << tCurve->mColorMapSerial
+            << tCurve->hasScalar() << tCurve->scalarMin() << tCurve->scalarMax();
+  }
+  return tKey;
+}
+
+void QPlot3D::updateLegendLayout() {
+  // The style serial of a curve changes with its name
+  QByteArray tKey;
+  QDataStream tStream(&tKey, QIODevice::WriteOnly);
+  tStream << mLegendFont << mLegendFilter;
+  const int nCurves = mCurves.size();
+  for (int i = 0; i < nCurves; i++) {
+    tStream << (quintptr)mCurves[i] << mCurves[i]->mStyleSerial;
+  }
+  if(tKey == mLegendLayoutKey) return;
+  mLegendLayoutKey = tKey;
+
+  QFontMetrics tMetrics(mLegendFont);
+  mLegendCurves.clear();
+  mLegendTextWidth  = 0;
+  mLegendTextHeight = tMetrics.height();
+  for (int i = 0; i < nCurves; i++) {
+    const QString tName = mCurves[i]->name();
+    if(!mLegendFilter.isEmpty() && !tName.contains(mLegendFilter, Qt::CaseInsensitive)) continue;
+    mLegendCurves.push_back(mCurves[i]);
+    mLegendTextWidth = std::max(mLegendTextWidth, (double)tMetrics.width(tName));
+  }
+}
+
+// Lays out the page of the legend that is shown. Returns the box of the
+// legend in the view, or an empty rect when no curve is listed.
+QRect QPlot3D::legendRect(int* first, int* last) {
+  updateLegendLayout();
+
+  const int nrCurves = mLegendCurves.size();
+  if(nrCurves == 0) {
+    mLegendPageCount = 0;
+    return QRect();
+  }
+
+  // Show the rows that fit in the widget, with one row left for the page number
+  const double textHeight = mLegendTextHeight;
+  const int tRows = std::max(1, (int)((viewHeight()-20)/textHeight) - 1);
+  mLegendPageCount = (nrCurves + tRows - 1)/tRows;
+  const int tPage  = qBound(0, mLegendPage, mLegendPageCount-1);
+  *first = tPage*tRows;
+  *last  = std::min(*first + tRows, nrCurves);
+
+  const double tWidth  = 5 + 20 + 5 + mLegendTextWidth + 5;
+  const double tHeight = 5 + (*last - *first + (mLegendPageCount > 1 ? 1 : 0))*textHeight + 5;
+  return QRect((int)(viewWidth()-tWidth-5), 5, (int)tWidth, (int)tHeight);
+}
+
+// Paints the rows first to last of the legend in the box rect, in view
+// coordinates
+void QPlot3D::paintLegend(QPainter* painter, const QRect& rect, int first, int last) {
+  const double textHeight = mLegendTextHeight;
+  const double x0 = rect.x();
+  const double y0 = rect.y();
+  painter->setFont(mLegendFont);
+  painter->setPen(QPen(Qt::black, 1.0));
+  painter->setBrush(QColor(204,204,217,128));
+  painter->drawRect(rect);
+
+  painter->setPen(Qt::NoPen);
+  for (int i = first; i < last; i++) {
+    const QCurve3D* tCurve = mLegendCurves[i];
+    const double tCenter = y0 + 5 + (i-first+0.5)*textHeight;
+    if(tCurve->hasScalar()) {
+      const double tHalfWidth = 0.5*std::max(2.0, tCurve->lineWidth());
+      painter->setBrush(ColorMapGradient(tCurve->mColorMap, QPointF(x0+5, 0), QPointF(x0+25, 0)));
+      painter->drawRect(QRectF(x0+5, tCenter-tHalfWidth, 20, 2*tHalfWidth));
+    } else {
+      const double tHalfWidth = 0.5*std::max(1.0, tCurve->lineWidth());
+      painter->setBrush(tCurve->color());
+      painter->drawRect(QRectF(x0+5, tCenter-tHalfWidth, 20, 2*tHalfWidth));
+    }
+  }
+  painter->setBrush(Qt::NoBrush);
+
+  double y = y0 + 5;
+  for (int i = first; i < last; i++) {
+    painter->setPen(mLegendCurves[i]->isVisible() ? QColor(Qt::black) : QColor::fromRgbF(0.5,0.5,0.5));
+    y += textHeight;
+    painter->drawText(QPointF(x0+30, y), mLegendCurves[i]->name());
+  }
+  if(mLegendPageCount > 1) {
+    painter->setPen(Qt::black);
+    y += textHeight;
+    painter->drawText(QPointF(x0+30, y), QString("%1/%2").arg(qBound(0, mLegendPage, mLegendPageCount-1)+1).arg(mLegendPageCount));
+  }
+}
+
+void QPlot3D::drawLegend(){
+  int tFirst = 0, tLast = 0;
+  mLegendRect = legendRect(&tFirst, &tLast);
+  if(mLegendRect.isEmpty()) return;
+
+  // The legend is painted into a texture when it has changed, and drawn as
+  // one quad, so the draw calls do not grow with the rows on the page
+  QByteArray tKey;
+  QDataStream tStream(&tKey, QIODevice::WriteOnly);
+  tStream << mLegendLayoutKey << mLegendRect << tFirst << tLast << mLegendPageCount;
+  for (int i = tFirst; i < tLast; i++) {
+    tStream << mLegendCurves[i]->hasScalar() << mLegendCurves[i]->mColorMapSerial;
+  }
+  // One more pixel for the right and bottom edges of the box
+  const QSize tSize = mLegendRect.size() + QSize(1,1);
+  if(mLegendTexture == 0 || tKey != mLegendKey) {
+    mLegendKey = tKey;
+    QImage tImage(tSize, QImage::Format_ARGB32_Premultiplied);
+    tImage.fill(Qt::transparent);
+    QPainter tPainter(&tImage);
+    tPainter.translate(-mLegendRect.topLeft());
+    paintLegend(&tPainter, mLegendRect, tFirst, tLast);
+    tPainter.end();
+
+    const QImage tTexture = QGLWidget::convertToGLFormat(tImage);
+    if(mLegendTexture == 0) glGenTextures(1, &mLegendTexture);
+    glBindTexture(GL_TEXTURE_2D, mLegendTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, tTexture.width(), tTexture.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, tTexture.constBits());
+  }
 
+  const double x0 = mLegendRect.x();
+  const double y0 = mLegendRect.y();
+  enable2D();
+  // Keeps the blend function, which is separate for alpha inside layers
+  glEnable(GL_BLEND);
+  glBindTexture(GL_TEXTURE_2D, mLegendTexture);
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+  glEnable(GL_TEXTURE_2D);
+  glBegin(GL_QUADS);
+  glTexCoord2f(0.0,1.0); glVertex2f(x0,                y0);
+  glTexCoord2f(1.0,1.0); glVertex2f(x0+tSize.width(), y0);
+  glTexCoord2f(1.0,0.0); glVertex2f(x0+tSize.width(), y0+tSize.height());
+  glTexCoord2f(0.0,0.0); glVertex2f(x0,                y0+tSize.height());
+  glEnd();
+  glDisable(GL_TEXTURE_2D);
   glDisable(GL_BLEND);
   disable2D();
+}
 
+void QPlot3D::visibleRange(const QCurve3D* curve, int* first, int* end) const {
+  if(mHasTimeWindow) {
+    curve->indexRange(mTimeWindowStart, mTimeWindowEnd, first, end);
+  } else {
+    *first = 0;
+    *end   = curve->size();
+  }
 }
 
-QRect QPlot3D::textSize(QString string) const {
-  return QRect(0.0, 0.0, fontMetrics().width(string), fontMetrics().height());
+void QPlot3D::drawCurve(QCurve3D* curve) {
+  const int tSize = curve->size();
+  if(tSize == 0 || !curve->isVisible()) return;
+  if(RangeOutsideView(mModelViewMatrix, mProjectionMatrix, curve->transformedRange())) return;
+
+  // Upload vertices and scalars that are not yet in the vertex buffers
+  QCurveBuffer& tBuffer = mCurveBuffers[curve];
+  tBuffer.lastUsed = mFrameCounter;
+  if(!tBuffer.vertices.isCreated()) tBuffer.vertices.create();
+  // Scalars packed by a vertex layout are uploaded with its attributes
+  const bool tPackedScalars = curve->hasScalar() && curve->scalarOffset() >= 0;
+  if(curve->hasScalar() && !tPackedScalars && !tBuffer.scalars.isCreated()) tBuffer.scalars.create();
+
+  if(tBuffer.serial != curve->mSerial) {
+    tBuffer.serial      = curve->mSerial;
+    tBuffer.count       = 0;
+    tBuffer.scalarCount = 0;
+    tBuffer.radiusCount = 0;
+    tBuffer.attributeCount = 0;
+  }
+
+  // The simplification may have moved the last vertex that was uploaded
+  if(curve->mSimplifyTolerance > 0.0) {
+    tBuffer.count       = std::max(0, tBuffer.count-1);
+    tBuffer.scalarCount = std::max(0, tBuffer.scalarCount-1);
+    tBuffer.radiusCount = std::max(0, tBuffer.radiusCount-1);
+    tBuffer.attributeCount = std::max(0, tBuffer.attributeCount-1);
+  }
+
+  // Radii are only needed by tubes and ribbons
+  if(curve->mStyle != QCurve3D::LINE_STYLE && curve->hasRadius() && tBuffer.vertices.isCreated()) {
+    if(!tBuffer.radii.isCreated()) tBuffer.radii.create();
+    UploadTail(tBuffer.radii, &tBuffer.radiusCount, &tBuffer.radiusCapacity, curve->mRadii.constData(), tSize, sizeof(float));
+  }
+
+  // Skip vertices at reduced detail by striding the vertex pointers
+  const int tStride = detailStride();
+
+  if(tBuffer.vertices.isCreated()) {
+    UploadTail(tBuffer.vertices, &tBuffer.count, &tBuffer.capacity, curve->mVertices.constData(), tSize, sizeof(QVector3D));
+    glVertexPointer(3,GL_FLOAT, tStride*sizeof(QVector3D), 0);
+  } else {
+    // No buffer object support, draw from client memory
+    glVertexPointer(3,GL_FLOAT, tStride*sizeof(QVector3D), curve->mVertices.constData());
+  }
+
+  if(curve->hasScalar()) {
+    if(tPackedScalars) {
+      // The texture coordinate pointer is set with the attributes below
+    } else if(tBuffer.scalars.isCreated()) {
+      UploadTail(tBuffer.scalars, &tBuffer.scalarCount, &tBuffer.scalarCapacity, curve->mScalars.constData(), tSize, sizeof(float));
+      glTexCoordPointer(1,GL_FLOAT, tStride*sizeof(float), 0);
+    } else {
+      glTexCoordPointer(1,GL_FLOAT, tStride*sizeof(float), curve->mScalars.constData());
+    }
+    bindColorMap(curve, tBuffer);
+  }
+
+  // Attributes of the vertex layout of the curve. They are only read by the
+  // line style, unless they hold the scalars, which tubes read too.
+  const bool tBindAttributes  = curve->bindsAttributes() && (curve->mStyle == QCurve3D::LINE_STYLE || tPackedScalars);
+  const int  tAttributeStride = tBindAttributes ? curve->attributeStride() : 0;
+  if(tAttributeStride > 0) {
+    if(tBuffer.vertices.isCreated() && !tBuffer.attributes.isCreated()) tBuffer.attributes.create();
+    if(tBuffer.attributes.isCreated()) {
+      if(tBuffer.attributeStride != tAttributeStride) {
+        tBuffer.attributeStride   = tAttributeStride;
+        tBuffer.attributeCapacity = 0;
+      }
+      UploadTail(tBuffer.attributes, &tBuffer.attributeCount, &tBuffer.attributeCapacity, curve->attributeData(), tSize, tAttributeStride);
+      curve->enableAttributes(0, tStride*tAttributeStride);
+    } else {
+      curve->enableAttributes(curve->attributeData(), tStride*tAttributeStride);
+    }
+  }
+
+  // The model transform of the curve
+  if(curve->hasTransform()) {
+    glPushMatrix();
+    glMultMatrixf(curve->transform().constData());
+  }
+
+  int tFirst, tEnd;
+  visibleRange(curve, &tFirst, &tEnd);
+  drawCurveRange(curve, tFirst, tEnd, 1.0);
+
+  // Fading trail behind the time window
+  if(mHasTimeWindow && mTrailLength > 0.0 && curve->hasTime() && mQualityLevel < NO_TICK_LABELS) {
+    const double tBand = mTrailLength/TRAIL_BANDS;
+    glEnable(GL_BLEND);
+    for (int b = 0; b < TRAIL_BANDS; b++) {
+      const double tBandEnd = mTimeWindowStart - b*tBand;
+      int tBandFirst, tBandLast;
+      curve->indexRange(tBandEnd - tBand, tBandEnd, &tBandFirst, &tBandLast);
+      // Connect to the next band
+      tBandLast = std::min(tBandLast+1, tSize);
+      drawCurveRange(curve, tBandFirst, tBandLast, 1.0 - (b+1.0)/(TRAIL_BANDS+1.0));
+    }
+    glDisable(GL_BLEND);
+  }
+
+  if(curve->hasScalar()) {
+    glDisable(GL_TEXTURE_1D);
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+  }
+
+  if(curve->hasTransform()) glPopMatrix();
+  if(tAttributeStride > 0) curve->disableAttributes();
+
+  if(curve->showShadows()) drawShadows(curve, tBuffer, tFirst, tEnd);
+
+  if(tBuffer.vertices.isCreated()) tBuffer.vertices.release();
 }
 
-bool QPlot3D::removeCurve(QCurve3D* curve) {
-  return mCurves.removeOne(curve);
+// Draws the curve flattened onto the axis planes that are shown, from the
+// same vertex buffer. The flattening is made from the offsets of the planes
+// in every frame, so the shadows follow the planes when adjustPlaneView()
+// moves them to the back.
+void QPlot3D::drawShadows(QCurve3D* curve, QCurveBuffer& buffer, int first, int end) {
+  const int tStride = detailStride();
+  if(buffer.vertices.isCreated()) {
+    buffer.vertices.bind();
+    glVertexPointer(3,GL_FLOAT, tStride*sizeof(QVector3D), 0);
+  } else {
+    glVertexPointer(3,GL_FLOAT, tStride*sizeof(QVector3D), curve->mVertices.constData());
+  }
+
+  // The planes with their normal along x, y and z
+  const QAxis* tAxes[3] = {&mYAxis, &mZAxis, &mXAxis};
+  const QVector3D tCenter = mXAxis.range().center();
+  glEnable(GL_BLEND);
+  for (int a = 0; a < 3; a++) {
+    const QAxis* tAxis = tAxes[a];
+    if(!tAxis->mShowPlane || tAxis->mZTicks.isEmpty()) continue;
+
+    // Lifted off the plane towards the data so that the plane does not hide it
+    const double tLift   = 1e-3*(tAxis->mZTicks.last() - tAxis->mZTicks.first());
+    const double tOffset = tAxis->mTranslate + (tAxis->mTranslate < tCenter[a] ? tLift : -tLift);
+    GLdouble tFlatten[16] = {1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1};
+    tFlatten[a*4+a] = 0.0;
+    tFlatten[12+a]  = tOffset;
+
+    // Clip planes parallel to the flattening clip the shadow as they clip the
+    // curve. The others would cut the shadow at the plane, which is at or
+    // outside the clip box, so they are left out.
+    for (int i = 0; i < MAX_CLIP_PLANES; i++) {
+      if(hasClipPlane(i) && mClipPlanes[i][a] != 0.0) glDisable(GL_CLIP_PLANE0 + i);
+    }
+
+    glPushMatrix();
+    glMultMatrixd(tFlatten);
+    if(curve->hasTransform()) glMultMatrixf(curve->transform().constData());
+    curve->drawShadow(first, end, tStride);
+    glPopMatrix();
+
+    for (int i = 0; i < MAX_CLIP_PLANES; i++) {
+      if(hasClipPlane(i) && mClipPlanes[i][a] != 0.0) glEnable(GL_CLIP_PLANE0 + i);
+    }
+  }
+  glDisable(GL_BLEND);
+}
+
+// Draws the vertices [first,end) of curve with the vertex pointers set by drawCurve()
+void QPlot3D::drawCurveRange(QCurve3D* curve, int first, int end, double alpha) {
+  if(end <= first) return;
+  if(curve->mStyle != QCurve3D::LINE_STYLE && mQualityLevel < THIN_LINES && initTubes()) {
+    drawTubeRange(curve, first, end, alpha);
+    return;
+  }
+  curve->draw(first, end, detailStride(), alpha, mQualityLevel >= THIN_LINES ? 1 : 0);
+}
+
+// Builds the tube program and checks for instancing the first time it is
+// needed. Returns false if tubes can not be drawn in this context.
+bool QPlot3D::initTubes() {
+  if(mTubeSupport >= 0) return mTubeSupport == 1;
+  mTubeSupport = 0;
+
+  // Instancing is resolved in the context of this plot, see ResolveGL()
+  const QGLContext* tContext = context();
+  if(ResolveVertexAttribDivisor() == NULL || ResolveDrawArraysInstanced() == NULL) return false;
+  if(!QGLShaderProgram::hasOpenGLShaderPrograms(tContext)) return false;
+
+  mTubeProgram = new QGLShaderProgram(this);
+  if(!mTubeProgram->addShaderFromSourceCode(QGLShader::Vertex, TUBE_VERTEX_SHADER) ||
+     !mTubeProgram->addShaderFromSourceCode(QGLShader::Fragment, TUBE_FRAGMENT_SHADER) ||
+     !mTubeProgram->link()) {
+    qWarning() << "QPlot3D: tubes are drawn as lines," << mTubeProgram->log();
+    delete mTubeProgram;
+    mTubeProgram = NULL;
+    return false;
+  }
+  mTubeSupport = 1;
+  return true;
+}
+
+// Draws the segments of the vertices [first,end) of curve as tubes or
+// ribbons, one instance of the segment template per segment. The segment
+// ends are read from the vertex buffer of the curve, shifted by one vertex.
+void QPlot3D::drawTubeRange(QCurve3D* curve, int first, int end, double alpha) {
+  const int tStride = detailStride();
+  QVector<GLint>   tFirsts;
+  QVector<GLsizei> tCounts;
+  curve->strips(first, end, tStride, &tFirsts, &tCounts);
+  if(tFirsts.isEmpty()) return;
+
+  // Template of corners around a segment, as a triangle strip
+  const bool tRibbon = curve->mStyle == QCurve3D::RIBBON_STYLE;
+  const int  tSides  = tRibbon ? 0 : curve->mTubeSides;
+  QGLBuffer& tTemplate = mTubeTemplates[tSides];
+  if(!tTemplate.isCreated()) {
+    QVector<GLfloat> tCorners;
+    const int nAngles = tRibbon ? 2 : tSides+1;
+    for (int k = 0; k < nAngles; k++) {
+      const GLfloat tAngle = tRibbon ? k*3.141592 : 2.0*3.141592*k/tSides;
+      tCorners << tAngle << 0.0f << tAngle << 1.0f;
+    }
+    tTemplate.create();
+    tTemplate.bind();
+    tTemplate.allocate(tCorners.constData(), tCorners.size()*sizeof(GLfloat));
+    tTemplate.release();
+  }
+  const int nCorners = tTemplate.size()/(2*sizeof(GLfloat));
+
+  QCurveBuffer& tBuffer = mCurveBuffers[curve];
+  const bool tScalar = curve->hasScalar();
+  // Scalars are in their own buffer, or packed with the attributes of the layout
+  const bool tPacked = curve->scalarOffset() >= 0;
+  QGLBuffer& tScalarBuffer = tPacked ? tBuffer.attributes : tBuffer.scalars;
+  const int  tScalarOffset = tPacked ? curve->scalarOffset() : 0;
+  const bool tRadius = curve->hasRadius() && tBuffer.radii.isCreated();
+  const QColor tColor = curve->mColor;
+
+  QGLShaderProgram* p = mTubeProgram;
+  p->bind();
+  p->setUniformValue("radius", (GLfloat)curve->mTubeRadius);
+  p->setUniformValue("ribbon", (GLint)tRibbon);
+  p->setUniformValue("color", tScalar ? QColor(Qt::white) : tColor);
+  p->setUniformValue("useColorMap", (GLint)tScalar);
+  p->setUniformValue("colorMap", 0);
+  p->setUniformValue("alpha", (GLfloat)alpha);
+
+  const int tCorner = p->attributeLocation("corner");
+  const int tP0 = p->attributeLocation("p0");
+  const int tP1 = p->attributeLocation("p1");
+  const int tS0 = p->attributeLocation("s0");
+  const int tS1 = p->attributeLocation("s1");
+  const int tR0 = p->attributeLocation("r0");
+  const int tR1 = p->attributeLocation("r1");
+
+  tTemplate.bind();
+  p->setAttributeBuffer(tCorner, GL_FLOAT, 0, 2);
+  p->enableAttributeArray(tCorner);
+  tTemplate.release();
+
+  // Constant values for the attributes the curve has no data for
+  if(!tScalar) { p->setAttributeValue(tS0, 0.0f); p->setAttributeValue(tS1, 0.0f); }
+  if(!tRadius) { p->setAttributeValue(tR0, 1.0f); p->setAttributeValue(tR1, 1.0f); }
+
+  glEnable(GL_DEPTH_TEST);
+  if(alpha < 1.0) glEnable(GL_BLEND);
+  const int tVertexStride = tStride*sizeof(QVector3D);
+  const int tFloatStride  = tStride*sizeof(float);
+  const int tScalarStride = tScalar ? tStride*curve->scalarStride() : 0;
+  for (int s = 0; s < tFirsts.size(); s++) {
+    const int tFirst = tFirsts[s];
+
+    // Each segment reads its ends at the same stride, one strided vertex apart
+    if(tBuffer.vertices.isCreated()) {
+      tBuffer.vertices.bind();
+      p->setAttributeBuffer(tP0, GL_FLOAT, tFirst*tVertexStride, 3, tVertexStride);
+      p->setAttributeBuffer(tP1, GL_FLOAT, (tFirst+1)*tVertexStride, 3, tVertexStride);
+    } else {
+      const GLfloat* tVertices = (const GLfloat*)curve->mVertices.constData();
+      p->setAttributeArray(tP0, tVertices + 3*tFirst*tStride, 3, tVertexStride);
+      p->setAttributeArray(tP1, tVertices + 3*(tFirst+1)*tStride, 3, tVertexStride);
+    }
+    if(tScalar) {
+      if(tScalarBuffer.isCreated()) {
+        tScalarBuffer.bind();
+        p->setAttributeBuffer(tS0, GL_FLOAT, tScalarOffset + tFirst*tScalarStride, 1, tScalarStride);
+        p->setAttributeBuffer(tS1, GL_FLOAT, tScalarOffset + (tFirst+1)*tScalarStride, 1, tScalarStride);
+      } else {
+        const char* tScalars = (const char*)curve->scalarData();
+        p->setAttributeArray(tS0, (const GLfloat*)(tScalars + tFirst*tScalarStride), 1, tScalarStride);
+        p->setAttributeArray(tS1, (const GLfloat*)(tScalars + (tFirst+1)*tScalarStride), 1, tScalarStride);
+      }
+    }
+    if(tRadius) {
+      tBuffer.radii.bind();
+      p->setAttributeBuffer(tR0, GL_FLOAT, tFirst*tFloatStride, 1, tFloatStride);
+      p->setAttributeBuffer(tR1, GL_FLOAT, (tFirst+1)*tFloatStride, 1, tFloatStride);
+    }
+    tBuffer.vertices.release();
+
+    const int tAttributes[] = { tP0, tP1, tS0, tS1, tR0, tR1 };
+    const bool tEnabled[]   = { true, true, tScalar, tScalar, tRadius, tRadius };
+    for (int a = 0; a < 6; a++) {
+      if(!tEnabled[a]) continue;
+      p->enableAttributeArray(tAttributes[a]);
+      VertexAttribDivisor(tAttributes[a], 1);
+    }
+
+    DrawArraysInstanced(GL_TRIANGLE_STRIP, 0, nCorners, tCounts[s]-1);
+
+    for (int a = 0; a < 6; a++) {
+      if(!tEnabled[a]) continue;
+      VertexAttribDivisor(tAttributes[a], 0);
+      p->disableAttributeArray(tAttributes[a]);
+    }
+  }
+  if(alpha < 1.0) glDisable(GL_BLEND);
+  glDisable(GL_DEPTH_TEST);
+
+  p->disableAttributeArray(tCorner);
+  p->release();
+}
+
+// Builds the quiver program and the arrow mesh the first time a quiver is
+// drawn. Returns false if arrows can not be instanced in this context.
+bool QPlot3D::initQuivers() {
+  if(mQuiverSupport >= 0) return mQuiverSupport == 1;
+  mQuiverSupport = 0;
+
+  // Checks for instancing
+  if(!initTubes()) return false;
+
+  mQuiverProgram = new QGLShaderProgram(this);
+  if(!mQuiverProgram->addShaderFromSourceCode(QGLShader::Vertex, QUIVER_VERTEX_SHADER) ||
+     !mQuiverProgram->addShaderFromSourceCode(QGLShader::Fragment, TUBE_FRAGMENT_SHADER) ||
+     !mQuiverProgram->link()) {
+    qWarning() << "QPlot3D: quivers are drawn as lines," << mQuiverProgram->log();
+    delete mQuiverProgram;
+    mQuiverProgram = NULL;
+    return false;
+  }
+
+  // Triangles of a shaft and a head along z, with a corner and a normal each
+  QVector<GLfloat> tMesh;
+  for (int k = 0; k < ARROW_SIDES; k++) {
+    const double a0 = 2.0*3.141592*k/ARROW_SIDES;
+    const double a1 = 2.0*3.141592*(k+1)/ARROW_SIDES;
+    const QVector3D n0(cos(a0), sin(a0), 0.0), n1(cos(a1), sin(a1), 0.0);
+    const QVector3D tShaft[6][2] = {
+      { ARROW_SHAFT_RADIUS*n0, n0 }, { ARROW_SHAFT_RADIUS*n1, n1 }, { ARROW_SHAFT_RADIUS*n1 + QVector3D(0,0,ARROW_HEAD_START), n1 },
+      { ARROW_SHAFT_RADIUS*n0, n0 }, { ARROW_SHAFT_RADIUS*n1 + QVector3D(0,0,ARROW_HEAD_START), n1 }, { ARROW_SHAFT_RADIUS*n0 + QVector3D(0,0,ARROW_HEAD_START), n0 }
+    };
+    const QVector3D tSlope(0, 0, ARROW_HEAD_RADIUS/(1.0-ARROW_HEAD_START));
+    const QVector3D tHead[6][2] = {
+      { ARROW_HEAD_RADIUS*n0 + QVector3D(0,0,ARROW_HEAD_START), (n0+tSlope).normalized() },
+      { ARROW_HEAD_RADIUS*n1 + QVector3D(0,0,ARROW_HEAD_START), (n1+tSlope).normalized() },
+      { QVector3D(0,0,1), (0.5*(n0+n1)+tSlope).normalized() },
+      // Base of the head
+      { ARROW_HEAD_RADIUS*n1 + QVector3D(0,0,ARROW_HEAD_START), QVector3D(0,0,-1) },
+      { ARROW_HEAD_RADIUS*n0 + QVector3D(0,0,ARROW_HEAD_START), QVector3D(0,0,-1) },
+      { QVector3D(0,0,ARROW_HEAD_START), QVector3D(0,0,-1) }
+    };
+    for (int v = 0; v < 6; v++) {
+      tMesh << tShaft[v][0].x() << tShaft[v][0].y() << tShaft[v][0].z() << tShaft[v][1].x() << tShaft[v][1].y() << tShaft[v][1].z();
+    }
+    for (int v = 0; v < 6; v++) {
+      tMesh << tHead[v][0].x() << tHead[v][0].y() << tHead[v][0].z() << tHead[v][1].x() << tHead[v][1].y() << tHead[v][1].z();
+    }
+  }
+  mArrowMesh.create();
+  mArrowMesh.bind();
+  mArrowMesh.allocate(tMesh.constData(), tMesh.size()*sizeof(GLfloat));
+  mArrowMesh.release();
+
+  mQuiverSupport = 1;
+  return true;
+}
+
+// Draws every stride:th arrow of the quiver with one instanced draw of the
+// arrow mesh, reading positions and vectors from the samples buffer. Without
+// instancing the arrows are drawn as lines.
+void QPlot3D::drawQuiver(QQuiver3D* quiver) {
+  const int nSamples = quiver->size();
+  if(nSamples == 0 || !quiver->isVisible()) return;
+  if(RangeOutsideView(mModelViewMatrix, mProjectionMatrix, quiver->range())) return;
+  const int tStride = quiver->stride()*detailStride();
+  const int nArrows = (nSamples + tStride - 1)/tStride;
+
+  if(mQualityLevel >= THIN_LINES || !initQuivers()) {
+    const QColor tColor = quiver->color();
+    glColor4f(tColor.redF(),tColor.greenF(),tColor.blueF(),tColor.alphaF());
+    glBegin(GL_LINES);
+    for (int i = 0; i < nSamples; i += tStride) {
+      const QVector3D tFrom = quiver->position(i);
+      const QVector3D tTo   = tFrom + quiver->scale()*quiver->vector(i);
+      glVertex3f(tFrom.x(), tFrom.y(), tFrom.z());
+      glVertex3f(tTo.x(), tTo.y(), tTo.z());
+    }
+    glEnd();
+    return;
+  }
+
+  // Upload the samples appended since the last frame
+  QCurveBuffer& tBuffer = mQuiverBuffers[quiver];
+  tBuffer.lastUsed = mFrameCounter;
+  if(!tBuffer.vertices.isCreated() && !tBuffer.vertices.create()) return;
+  if(tBuffer.serial != quiver->mSerial) {
+    tBuffer.serial = quiver->mSerial;
+    tBuffer.count  = 0;
+  }
+  UploadTail(tBuffer.vertices, &tBuffer.count, &tBuffer.capacity, quiver->mSamples.constData(), 2*nSamples, sizeof(QVector3D));
+
+  const bool tColorMap = !quiver->colorMap().isEmpty();
+  if(tColorMap) {
+    if(tBuffer.colorMap == 0) glGenTextures(1, &tBuffer.colorMap);
+    glBindTexture(GL_TEXTURE_1D, tBuffer.colorMap);
+    if(tBuffer.colorMapSerial != quiver->mColorMapSerial) {
+      tBuffer.colorMapSerial = quiver->mColorMapSerial;
+      UploadColorMap(quiver->mColorMap);
+    }
+  }
+
+  QGLShaderProgram* p = mQuiverProgram;
+  p->bind();
+  p->setUniformValue("scale", (GLfloat)quiver->scale());
+  p->setUniformValue("magnitudeMin", (GLfloat)quiver->magnitudeMin());
+  p->setUniformValue("magnitudeMax", (GLfloat)quiver->magnitudeMax());
+  p->setUniformValue("color", tColorMap ? QColor(Qt::white) : quiver->color());
+  p->setUniformValue("useColorMap", (GLint)tColorMap);
+  p->setUniformValue("colorMap", 0);
+  p->setUniformValue("alpha", (GLfloat)1.0);
+
+  const int tCorner   = p->attributeLocation("corner");
+  const int tNormal   = p->attributeLocation("cornerNormal");
+  const int tPosition = p->attributeLocation("position");
+  const int tVector   = p->attributeLocation("vector");
+
+  mArrowMesh.bind();
+  p->setAttributeBuffer(tCorner, GL_FLOAT, 0, 3, 6*sizeof(GLfloat));
+  p->setAttributeBuffer(tNormal, GL_FLOAT, 3*sizeof(GLfloat), 3, 6*sizeof(GLfloat));
+  p->enableAttributeArray(tCorner);
+  p->enableAttributeArray(tNormal);
+  const int nCorners = mArrowMesh.size()/(6*sizeof(GLfloat));
+
+  // One arrow per stride:th sample
+  const int tSampleStride = 2*tStride*sizeof(QVector3D);
+  tBuffer.vertices.bind();
+  p->setAttributeBuffer(tPosition, GL_FLOAT, 0, 3, tSampleStride);
+  p->setAttributeBuffer(tVector, GL_FLOAT, sizeof(QVector3D), 3, tSampleStride);
+  p->enableAttributeArray(tPosition);
+  p->enableAttributeArray(tVector);
+  VertexAttribDivisor(tPosition, 1);
+  VertexAttribDivisor(tVector, 1);
+  tBuffer.vertices.release();
+
+  glEnable(GL_DEPTH_TEST);
+  DrawArraysInstanced(GL_TRIANGLES, 0, nCorners, nArrows);
+  glDisable(GL_DEPTH_TEST);
+
+  VertexAttribDivisor(tPosition, 0);
+  VertexAttribDivisor(tVector, 0);
+  p->disableAttributeArray(tPosition);
+  p->disableAttributeArray(tVector);
+  p->disableAttributeArray(tCorner);
+  p->disableAttributeArray(tNormal);
+  p->release();
+}
+
+void QPlot3D::bindColorMap(QCurve3D* curve, QCurveBuffer& buffer) {
+  if(buffer.colorMap == 0) glGenTextures(1, &buffer.colorMap);
+  glBindTexture(GL_TEXTURE_1D, buffer.colorMap);
+
+  // Only rebuild the texture when the colormap has changed
+  if(buffer.colorMapSerial != curve->mColorMapSerial) {
+    buffer.colorMapSerial = curve->mColorMapSerial;
+    UploadColorMap(curve->mColorMap);
+  }
+
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+  glEnable(GL_TEXTURE_1D);
+
+  // Map the scalar range to [0,1] with the texture matrix
+  double tDelta = curve->scalarMax() - curve->scalarMin();
+  if(tDelta == 0.0) tDelta = 1.0;
+  glMatrixMode(GL_TEXTURE);
+  glLoadIdentity();
+  glScaled(1.0/tDelta, 1.0, 1.0);
+  glTranslated(-curve->scalarMin(), 0.0, 0.0);
+  glMatrixMode(GL_MODELVIEW);
+}
+
+void QPlot3D::releaseCurveBuffer(QCurve3D* curve) {
+  if(!mCurveBuffers.contains(curve)) return;
+  makeCurrent();
+  GLuint tColorMap = mCurveBuffers[curve].colorMap;
+  if(tColorMap != 0) glDeleteTextures(1, &tColorMap);
+  mCurveBuffers.remove(curve);
+}
+
+void QPlot3D::releaseQuiverBuffer(QQuiver3D* quiver) {
+  if(!mQuiverBuffers.contains(quiver)) return;
+  makeCurrent();
+  GLuint tColorMap = mQuiverBuffers[quiver].colorMap;
+  if(tColorMap != 0) glDeleteTextures(1, &tColorMap);
+  mQuiverBuffers.remove(quiver);
+}
+
+// Evicts the vertex buffers of curves and quivers that were not drawn in this frame, least
+// recently drawn first, until the plot is within its GPU memory budget.
+void QPlot3D::enforceGpuBudget() {
+  if(mGpuMemoryBudget <= 0) return;
+
+  qint64 tBytes = gpuBytes();
+  while(tBytes > mGpuMemoryBudget) {
+    QCurveBuffer* tOldest = NULL;
+    for (QHash<QCurve3D*, QCurveBuffer>::iterator it = mCurveBuffers.begin(); it != mCurveBuffers.end(); ++it) {
+      QCurveBuffer& tBuffer = it.value();
+      if(tBuffer.lastUsed == mFrameCounter || !tBuffer.vertices.isCreated()) continue;
+      if(tOldest == NULL || tBuffer.lastUsed < tOldest->lastUsed) tOldest = &tBuffer;
+    }
+    for (QHash<QQuiver3D*, QCurveBuffer>::iterator it = mQuiverBuffers.begin(); it != mQuiverBuffers.end(); ++it) {
+      QCurveBuffer& tBuffer = it.value();
+      if(tBuffer.lastUsed == mFrameCounter || !tBuffer.vertices.isCreated()) continue;
+      if(tOldest == NULL || tBuffer.lastUsed < tOldest->lastUsed) tOldest = &tBuffer;
+    }
+    // Everything left is in view
+    if(tOldest == NULL) break;
+
+    const qint64 tBefore = tOldest->bytes();
+    tOldest->evict();
+    tBytes -= tBefore - tOldest->bytes();
+  }
+}
+
+// The curves are counted by each plot they are added to
+qint64 QPlot3D::cpuBytes() const {
+  qint64 tBytes = 0;
+  const QList<QCurve3D*> tCurves = allCurves();
+  for (int i = 0; i < tCurves.size(); i++) {
+    tBytes += tCurves[i]->cpuBytes();
+  }
+  return tBytes;
+}
+
+int QPlot3D::droppedCount() const {
+  int tCount = 0;
+  const QList<QCurve3D*> tCurves = allCurves();
+  for (int i = 0; i < tCurves.size(); i++) {
+    tCount += tCurves[i]->droppedCount();
+  }
+  return tCount;
+}
+
+qint64 QPlot3D::derivedBytes() const {
+  qint64 tBytes = 0;
+  const QList<QCurve3D*> tCurves = allCurves();
+  for (int i = 0; i < tCurves.size(); i++) {
+    tBytes += tCurves[i]->derivedBytes();
+  }
+  return tBytes;
+}
+
+// Bytes of the curve buffers and the cached layers in the GL context of the plot
+qint64 QPlot3D::gpuBytes() const {
+  qint64 tBytes = 0;
+  for (QHash<QCurve3D*, QCurveBuffer>::const_iterator it = mCurveBuffers.constBegin(); it != mCurveBuffers.constEnd(); ++it) {
+    tBytes += it.value().bytes();
+  }
+  for (QHash<QQuiver3D*, QCurveBuffer>::const_iterator it = mQuiverBuffers.constBegin(); it != mQuiverBuffers.constEnd(); ++it) {
+    tBytes += it.value().bytes();
+  }
+  if(mBackgroundLayer != NULL) tBytes += 4*mBackgroundLayer->width()*mBackgroundLayer->height();
+  if(mOverlayLayer != NULL)    tBytes += 4*mOverlayLayer->width()*mOverlayLayer->height();
+  for (int i = 0; i < mSubplots.size(); i++) {
+    const Subplot* tSubplot = mSubplots[i];
+    if(tSubplot->backgroundLayer != NULL) tBytes += 4*tSubplot->backgroundLayer->width()*tSubplot->backgroundLayer->height();
+    if(tSubplot->overlayLayer != NULL)    tBytes += 4*tSubplot->overlayLayer->width()*tSubplot->overlayLayer->height();
+  }
+  return tBytes;
+}
+
+qint64 QPlot3D::gpuBytes(const QCurve3D* curve) const {
+  QHash<QCurve3D*, QCurveBuffer>::const_iterator it = mCurveBuffers.constFind(const_cast<QCurve3D*>(curve));
+  return it == mCurveBuffers.constEnd() ? 0 : it.value().bytes();
+}
+
+QString QPlot3D::memoryUsageText() const {
+  const double MB = 1024.0*1024.0;
+  QString tGpu = QString("%1").arg(gpuBytes()/MB,0,'f',1);
+  if(mGpuMemoryBudget > 0) tGpu += QString("/%1").arg(mGpuMemoryBudget/MB,0,'f',1);
+  return QString("CPU: %1 MB GPU: %2 MB Derived: %3 MB Dropped: %4")
+    .arg(cpuBytes()/MB,0,'f',1).arg(tGpu).arg(derivedBytes()/MB,0,'f',1).arg(droppedCount());
+}
+
+void QPlot3D::drawColorBar() {
+  // Show the colormap of the first curve colored by scalars
+  QCurve3D* tCurve = NULL;
+  const int nCurves = mCurves.size();
+  for (int i = 0; i < nCurves && tCurve == NULL; i++) {
+    if(mCurves[i]->hasScalar() && mCurveBuffers.contains(mCurves[i])) tCurve = mCurves[i];
+  }
+  if(tCurve == NULL) return;
+
+  const double textHeight = fontMetrics().height();
+  const double x0 = viewWidth()-25;
+  const double x1 = viewWidth()-10;
+  const double y0 = viewHeight()-10;
+  const double y1 = viewHeight()-160;
+
+  enable2D();
+  glBindTexture(GL_TEXTURE_1D, mCurveBuffers[tCurve].colorMap);
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+  glEnable(GL_TEXTURE_1D);
+  glBegin(GL_QUADS);
+  glTexCoord1f(0.0); glVertex2f(x0,y0);
+  glTexCoord1f(0.0); glVertex2f(x1,y0);
+  glTexCoord1f(1.0); glVertex2f(x1,y1);
+  glTexCoord1f(1.0); glVertex2f(x0,y1);
+  glEnd();
+  glDisable(GL_TEXTURE_1D);
+  Draw2DLine(QVector2D(x0,y0), QVector2D(x1,y0), 1, QColor(0,0,0,255));
+  Draw2DLine(QVector2D(x1,y0), QVector2D(x1,y1), 1, QColor(0,0,0,255));
+  Draw2DLine(QVector2D(x1,y1), QVector2D(x0,y1), 1, QColor(0,0,0,255));
+  Draw2DLine(QVector2D(x0,y1), QVector2D(x0,y0), 1, QColor(0,0,0,255));
+  disable2D();
+
+  const QString tMax = QString("%1").arg(tCurve->scalarMax(),0,'g',4);
+  const QString tMin = QString("%1").arg(tCurve->scalarMin(),0,'g',4);
+  glColor4f(0,0,0,1);
+  renderTextAtScreenCoordinates(x0-5-fontMetrics().width(tMax), y1+textHeight, tMax, mLegendFont);
+  renderTextAtScreenCoordinates(x0-5-fontMetrics().width(tMin), y0, tMin, mLegendFont);
+}
+
+void QPlot3D::setTimeWindow(double t0, double t1) {
+  mHasTimeWindow   = true;
+  mTimeWindowStart = t0;
+  mTimeWindowEnd   = t1;
+  updateGL();
+}
+
+void QPlot3D::clearTimeWindow() {
+  mHasTimeWindow = false;
+  updateGL();
+}
+
+void QPlot3D::drawPickMarker() {
+  if(!mHoverPick.isValid()) return;
+  if(mHoverPick.cloud != NULL ? !mClouds.contains(mHoverPick.cloud) : !mCurves.contains(mHoverPick.curve)) return;
+  if(mHoverPick.curve != NULL && mHoverPick.index >= mHoverPick.curve->size()) return;
+
+  const QVector3D tPoint  = mHoverPick.curve != NULL ? mHoverPick.curve->transform().map(mHoverPick.curve->mVertices[mHoverPick.index]) : mHoverPick.point;
+  const QColor    tColor  = mHoverPick.curve != NULL ? mHoverPick.curve->color() : mHoverPick.cloud->color();
+  const QString   tName   = mHoverPick.curve != NULL ? mHoverPick.curve->name() : mHoverPick.cloud->name();
+  const QVector3D tScreen = toScreenCoordinates(tPoint);
+  const double x = tScreen.x();
+  const double y = tScreen.y();
+
+  enable2D();
+  Draw2DPlane(QVector2D(x-3,y-3), QVector2D(x+3,y+3), tColor);
+  Draw2DLine(QVector2D(x-4,y-4), QVector2D(x+4,y-4), 1, QColor(0,0,0,255));
+  Draw2DLine(QVector2D(x+4,y-4), QVector2D(x+4,y+4), 1, QColor(0,0,0,255));
+  Draw2DLine(QVector2D(x+4,y+4), QVector2D(x-4,y+4), 1, QColor(0,0,0,255));
+  Draw2DLine(QVector2D(x-4,y+4), QVector2D(x-4,y-4), 1, QColor(0,0,0,255));
+  disable2D();
+
+  drawTextBox(x+10, y-10, QString("%1 [%2]: (%3, %4, %5)")
+              .arg(tName)
+              .arg(mHoverPick.index)
+              .arg(tPoint.x(),0,'g',6)
+              .arg(tPoint.y(),0,'g',6)
+              .arg(tPoint.z(),0,'g',6));
+}
+
+void QPlot3D::drawTextBox(int x, int y, QString string, QFont font)  {
+  const double textWidth  = fontMetrics().width(string);
+  const double textHeight = fontMetrics().height();
+
+  glEnable(GL_BLEND);
+  enable2D();
+  Draw2DPlane(QVector2D(x-5,y+5), QVector2D(x+10+textWidth, y-textHeight-5), QColor(204,204,217,128));
+  disable2D();
+  glDisable(GL_BLEND);
+
+  glColor4f(0,0,0,1);
+  renderTextAtScreenCoordinates(x,y,string,font);
+}  
+
+
+void QPlot3D::enable2D() {
+  glPushMatrix();
+  
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  glOrtho(0,viewWidth(),viewHeight(),0,0.01,-10000.0);
+  
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  
+}
+
+void QPlot3D::disable2D() {
+  glPopMatrix();
+  resizeGL(viewWidth(),viewHeight());
+}
+
+void QPlot3D::resizeGL(int width, int height) {
+  // Subplots are drawn in their part of the window, layers from their origin
+  if(mSubplots.isEmpty() || mActiveLayer != NULL) {
+    glViewport(0,0,width,height);
+    glDisable(GL_SCISSOR_TEST);
+  } else {
+    const QRect tRect = viewRect();
+    const int   tY    = canvasSize().height() - tRect.y() - tRect.height();
+    glViewport(tRect.x(),tY,width,height);
+    glScissor(tRect.x(),tY,width,height);
+    glEnable(GL_SCISSOR_TEST);
+  }
+
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  double zNear = 0.01;
+  double zFar  = 10000.0;
+  double aspect = (double)width/(double)height;
+  double fW = tan( 25*3.141592/180.0)*zNear;
+  double fH = fW/aspect;
+  glFrustum(-fW,fW,-fH,fH,zNear,zFar);
+
+
+  glMatrixMode(GL_MODELVIEW);
+}
+
+void QPlot3D::mousePressEvent(QMouseEvent *event)
+{
+    mLastMousePos = event->pos();
+    setCurrentSubplot(subplotAt(event->pos()));
+    beginInteraction();
+
+
+}
+
+void QPlot3D::mouseMoveEvent(QMouseEvent *event)
+{
+  // Only hovering, mouse tracking is on when picking is shown
+  if (event->buttons() == Qt::NoButton) {
+    updateHoverPick(event->pos());
+    return;
+  }
+
+  beginInteraction();
+
+  int dx = event->x() - mLastMousePos.x();
+  int dy = event->y() - mLastMousePos.y();
+  
+  if (event->buttons() & Qt::LeftButton) {
+    
+    if(event->modifiers() == Qt::ControlModifier) {
+      setPitch(pitch() + dx);     
+    }else {
+      if( (roll() + dy < 90) && (roll()+dy > -90)) 
+	setRoll(roll() + dy);
+      setYaw(yaw() + dx);
+    }
+  } else {
+    setPan(pan() + QVector3D(dx/32.0,-dy/32.0,0.0));
+  }
+ 
+  mLastMousePos = event->pos();
+
+  mXAxis.adjustPlaneView();
+  mYAxis.adjustPlaneView();
+  mZAxis.adjustPlaneView();
+
+}
+
+void QPlot3D::mouseDoubleClickEvent(QMouseEvent* event) {
+  event->accept();
+  mAxisEqual = !mAxisEqual;
+  rescaleAxis();
+}
+
+void QPlot3D::wheelEvent(QWheelEvent* event)
+{
+  event->accept();
+  setCurrentSubplot(subplotAt(event->pos()));
+
+  // Scroll the pages of the legend
+  if(mShowLegend && mLegendPageCount > 1 && mLegendRect.contains(event->pos() - viewRect().topLeft())) {
+    setLegendPage(qBound(0, mLegendPage + (event->delta() < 0 ? 1 : -1), mLegendPageCount-1));
+    return;
+  }
+
+  beginInteraction();
+  setZoom( zoom() + (double)event->delta()/32);
+
+  mXAxis.adjustPlaneView();
+  mYAxis.adjustPlaneView();
+  mZAxis.adjustPlaneView();
+
+}
+
+void QPlot3D::addCurve(QCurve3D* curve) { 
+  mCurves.push_back(curve);  
+  rescaleAxis();
+  updateGL();
+} 
+
+void QPlot3D::setBackgroundColor(QColor color) { 
+  mBackgroundColor = color;   
+  makeCurrent(); 
+  qglClearColor(mBackgroundColor); 
+}
+
+void QPlot3D::rescaleAxis() {
+  QRange tRange = mXAxis.range();
+  int tSize = mCurves.size();
+  for(int i = 0; i < tSize; i++) {
+    const QRange tCurveRange = mCurves[i]->transformedRange();
+    tRange.setIfMin(tCurveRange);
+    tRange.setIfMax(tCurveRange);
+  }
+  for(int i = 0; i < mClouds.size(); i++) {
+    if(!mClouds[i]->isOpen()) continue;
+    tRange.setIfMin(mClouds[i]->range());
+    tRange.setIfMax(mClouds[i]->range());
+  }
+  for(int i = 0; i < mQuivers.size(); i++) {
+    if(mQuivers[i]->size() == 0) continue;
+    tRange.setIfMin(mQuivers[i]->range());
+    tRange.setIfMax(mQuivers[i]->range());
+  }
+  if(mHasClipBox && mAxisFollowsClipBox) tRange = mClipBox;
+  mXAxis.setRange(tRange);
+  mYAxis.setRange(tRange);
+  mZAxis.setRange(tRange);
+  
+  if (mAxisEqual) 
+    axisEqual();
+  else 
+    axisTight();
+
+  mXAxis.adjustPlaneView();
+  mYAxis.adjustPlaneView();
+  mZAxis.adjustPlaneView();
+}
+
+void QPlot3D::axisEqual() {
+  QVector3D delta = mXAxis.range().delta();
+  double k = std::max(delta.x(),std::max(delta.y(),delta.z()));
+  mScale.setX( 10.0/k);
+  mScale.setY( 10.0/k);
+  mScale.setZ( 10.0/k);
+  updateGL();
+}
+
+void QPlot3D::axisTight() {
+  QVector3D delta = mXAxis.range().delta();
+  mScale.setX( 10.0/delta.x());
+  mScale.setY( 10.0/delta.y());
+  mScale.setZ( 10.0/delta.z());
+  updateGL();
+}
+
+QVector3D QPlot3D::cameraPositionInWorldCoordinates() const {
+
+  QVector3D tObjectCenter = mXAxis.range().center();
+  
+  QQuaternion q1 = QQuaternion::fromAxisAndAngle(1.0, 0.0, 0.0, (mRotation.x()-90));
+  QQuaternion q2 = QQuaternion::fromAxisAndAngle(0.0, 1.0, 0.0, mRotation.y());
+  QQuaternion q3 = QQuaternion::fromAxisAndAngle(0.0, 0.0, 1.0, mRotation.z());
+  QQuaternion q  = (q1*q2*q3).conjugate();
+  
+  return tObjectCenter + q.rotatedVector(-QVector3D(mTranslate.x()/mScale.x(),mTranslate.y()/mScale.y(),mTranslate.z()/mScale.z()));
+}
+
+void QPlot3D::renderTextAtWorldCoordinates(const QVector3D& vec, QString str, QFont font) {
+  QVector3D sVec = toScreenCoordinates(vec);
+  renderTextAtScreenCoordinates(sVec.x(),sVec.y(),str,font);  
+}
+
+void QPlot3D::renderTextAtScreenCoordinates(int x, int y, QString str, QFont font) {
+  setFont(font);
+  if(mExportPainter != NULL) {
+    // Written in the current color, like renderText()
+    GLfloat tColor[4];
+    glGetFloatv(GL_CURRENT_COLOR, tColor);
+    mExportPainter->setPen(QColor::fromRgbF(tColor[0],tColor[1],tColor[2],tColor[3]));
+    mExportPainter->setFont(font);
+    mExportPainter->drawText(x, y, str);
+    return;
+  }
+  if(mActiveLayer != NULL) {
+    // Keep the text and the current color until the layer is done
+    GLfloat tColor[4];
+    glGetFloatv(GL_CURRENT_COLOR, tColor);
+    LayerText tText;
+    tText.pos    = QPoint(x,y);
+    tText.string = str;
+    tText.font   = font;
+    tText.color  = QColor::fromRgbF(tColor[0],tColor[1],tColor[2],tColor[3]);
+    mLayerTexts.push_back(tText);
+    return;
+  }
+  const QPoint tOrigin = viewRect().topLeft();
+  renderText(x+tOrigin.x(),y+tOrigin.y(),str);
+}
+QVector3D QPlot3D::toScreenCoordinates(double worldX, double worldY, double worldZ) const {
+  return toScreenCoordinates(QVector3D(worldX,worldY,worldZ));
+}
+
+QVector3D QPlot3D::toScreenCoordinates(const QVector3D& vec) const {
+  // v' = P*M*v
+  GLdouble m[16];
+  GLdouble p[16];
+
+  glGetDoublev(GL_MODELVIEW_MATRIX,&m[0]);
+  glGetDoublev(GL_PROJECTION_MATRIX,&p[0]);
+
+  QVector3D tScreen(0.0,0.0,0.0);
+  ProjectToScreen(m,p,viewWidth(),viewHeight(),vec,&tScreen);
+  return tScreen;
+}
+
+QPickResult QPlot3D::pick(const QPoint& pos, int radius) const {
+  QPickResult tResult;
+  if(!mHasMatrices) return tResult;
+
+  const GLdouble* p = mProjectionMatrix;
+  const QPointF tPos(pos - viewRect().topLeft());
+  double tBest = radius;
+
+  const int nCurves = mCurves.size();
+  for (int c = 0; c < nCurves; c++) {
+    QCurve3D* tCurve = mCurves[c];
+    if(!tCurve->isVisible()) continue;
+
+    // Vertices of transformed curves are projected with the transform
+    // applied to the modelview matrix
+    const QMatrix4x4 tTransform = tCurve->transform();
+    GLdouble tCurveMatrix[16];
+    if(tCurve->hasTransform()) MultiplyMatrix(mModelViewMatrix, tTransform, tCurveMatrix);
+    const GLdouble* m = tCurve->hasTransform() ? tCurveMatrix : mModelViewMatrix;
+
+    // Only the vertices within the time window are drawn
+    int tFirst, tEnd;
+    visibleRange(tCurve, &tFirst, &tEnd);
+    if(tFirst >= tEnd) continue;
+    const int tFirstLeaf = tFirst/PICK_LEAF_SIZE;
+    const int tEndLeaf   = (tEnd-1)/PICK_LEAF_SIZE + 1;
+
+    const int tFirstNode = tFirstLeaf/PICK_NODE_SIZE;
+    const int tEndNode   = (tEndLeaf-1)/PICK_NODE_SIZE + 1;
+    for (int n = tFirstNode; n < tEndNode; n++) {
+      if(!RangeNearScreenPoint(m,p,viewWidth(),viewHeight(),tCurve->mPickNodes[n],tPos,tBest)) continue;
+
+      const int tLastLeaf = qMin((n+1)*PICK_NODE_SIZE, tEndLeaf);
+      for (int l = qMax(n*PICK_NODE_SIZE, tFirstLeaf); l < tLastLeaf; l++) {
+        if(!RangeNearScreenPoint(m,p,viewWidth(),viewHeight(),tCurve->mPickLeaves[l],tPos,tBest)) continue;
+
+        const int tLast = qMin((l+1)*PICK_LEAF_SIZE, tEnd);
+        for (int i = qMax(l*PICK_LEAF_SIZE, tFirst); i < tLast; i++) {
+          const QVector3D& tVertex = tCurve->mVertices[i];
+          if(mClipPlaneMask != 0 && isClipped(tCurve->hasTransform() ? tTransform.map(tVertex) : tVertex)) continue;
+          QVector3D tScreen;
+          if(!ProjectToScreen(m,p,viewWidth(),viewHeight(),tVertex,&tScreen)) continue;
+          const double tDistance = QVector2D(tScreen.x()-tPos.x(), tScreen.y()-tPos.y()).length();
+          if(tDistance <= tBest) {
+            tBest = tDistance;
+            tResult.curve    = tCurve;
+            tResult.index    = i;
+            tResult.point    = tCurve->hasTransform() ? tTransform.map(tVertex) : tVertex;
+            tResult.distance = tDistance;
+          }
+        }
+      }
+    }
+  }
+
+  // Points of the cloud nodes that were drawn in the last frame
+  const GLdouble* m = mModelViewMatrix;
+  for (int c = 0; c < mClouds.size(); c++) {
+    QOctreeCloud* tCloud = mClouds[c];
+    if(!tCloud->isVisible()) continue;
+    for (QHash<int, QOctreeNodeData*>::const_iterator it = tCloud->mLoaded.constBegin(); it != tCloud->mLoaded.constEnd(); ++it) {
+      const QOctreeNodeData* d = it.value();
+      if(d->lastUsed != mFrameCounter) continue;
+      const QOctreeFormat::Node& tNode = tCloud->mNodes[it.key()];
+      const QRange tRange(QVector3D(tNode.min[0],tNode.min[1],tNode.min[2]), QVector3D(tNode.max[0],tNode.max[1],tNode.max[2]));
+      if(!RangeNearScreenPoint(m,p,viewWidth(),viewHeight(),tRange,tPos,tBest)) continue;
+      for (int i = 0; i < d->points.size(); i++) {
+        const QVector3D& tVertex = d->points[i];
+        if(mClipPlaneMask != 0 && isClipped(tVertex)) continue;
+        QVector3D tScreen;
+        if(!ProjectToScreen(m,p,viewWidth(),viewHeight(),tVertex,&tScreen)) continue;
+        const double tDistance = QVector2D(tScreen.x()-tPos.x(), tScreen.y()-tPos.y()).length();
+        if(tDistance <= tBest) {
+          tBest = tDistance;
+          tResult.curve    = NULL;
+          tResult.cloud    = tCloud;
+          tResult.index    = (tNode.offset - (qint64)sizeof(QOctreeFormat::Header))/(qint64)sizeof(QVector3D) + i;
+          tResult.point    = tVertex;
+          tResult.distance = tDistance;
+        }
+      }
+    }
+  }
+  return tResult;
+}
+
+void QPlot3D::updateHoverPick(const QPoint& pos) {
+  if(!mShowPicking) return;
+
+  // Pick in the subplot under the cursor, and clear the marker in the
+  // subplot the cursor left
+  const int tCurrent = mCurrentSubplot;
+  const int tSubplot = subplotAt(pos);
+  bool tChanged = false;
+  if(tSubplot != mHoverSubplot) {
+    setCurrentSubplot(mHoverSubplot);
+    tChanged   = mHoverPick.isValid();
+    mHoverPick = QPickResult();
+    mHoverSubplot = tSubplot;
+  }
+
+  setCurrentSubplot(tSubplot);
+  const QPickResult tPick = pick(pos);
+  if(tPick.curve != mHoverPick.curve || tPick.cloud != mHoverPick.cloud || tPick.index != mHoverPick.index) {
+    mHoverPick = tPick;
+    tChanged   = true;
+  }
+  setCurrentSubplot(tCurrent);
+  if(!tChanged) return;
+
+  emit curvePointHovered(tPick.curve, (int)tPick.index);
+  updateGL();
+}
+
+void QPlot3D::setShowPicking(bool value) {
+  mShowPicking = value;
+  setMouseTracking(value);
+  if(!value) mHoverPick = QPickResult();
+}
+
+void QPlot3D::setShowAxis(bool value) {
+  mXAxis.setShowAxis(value);
+  mXAxis.setShowLabel(value);
+
+  mYAxis.setShowAxis(value);
+  mYAxis.setShowLabel(value);
+
+  mZAxis.setShowAxis(value);
+  mZAxis.setShowLabel(value);
+}
+
+void QPlot3D::setShowAxisBox(bool value) {
+  mXAxis.setShowAxisBox(value);
+  mYAxis.setShowAxisBox(value);
+  mZAxis.setShowAxisBox(value);
+}
+
+void QPlot3D::setShowGrid(bool value) {
+  mXAxis.setShowPlane(value);
+  mXAxis.setShowGrid(value);
+
+  mYAxis.setShowPlane(value);
+  mYAxis.setShowGrid(value);
+
+  mZAxis.setShowPlane(value);
+  mZAxis.setShowGrid(value);
+}
+
+
+void QPlot3D::draw3DLine(QVector3D from, QVector3D to, double lineWidth, QColor color) {
+
+  const QVector3D tFrom = toScreenCoordinates(from);
+  const QVector3D tTo   = toScreenCoordinates(to);
+
+  // The GL line fades out over its width, the exported line is about as dark
+  if(mExportPainter != NULL) {
+    mExportPainter->setPen(QPen(color, 0.5*lineWidth, Qt::SolidLine, Qt::FlatCap));
+    mExportPainter->drawLine(QPointF(tFrom.x(), tFrom.y()), QPointF(tTo.x(), tTo.y()));
+    return;
+  }
+
+  enable2D();  // Actually, set glOrtho...
+  DrawScreenLine(tFrom, tTo, lineWidth, color);
+  disable2D();
+
+}
+
+void QPlot3D::draw3DPlane(QVector3D topLeft, QVector3D bottomRight, QColor color) {
+  if(mExportPainter == NULL) {
+    Draw3DPlane(topLeft, bottomRight, color);
+    return;
+  }
+  const QVector3D tCorners[4] = {
+    topLeft,
+    QVector3D(bottomRight.x(), topLeft.y(),     bottomRight.z()),
+    bottomRight,
+    QVector3D(topLeft.x(),     bottomRight.y(), topLeft.z())
+  };
+  QPolygonF tPolygon;
+  for (int i = 0; i < 4; i++) {
+    const QVector3D tScreen = toScreenCoordinates(tCorners[i]);
+    tPolygon << QPointF(tScreen.x(), tScreen.y());
+  }
+  mExportPainter->setPen(Qt::NoPen);
+  mExportPainter->setBrush(color);
+  mExportPainter->drawPolygon(tPolygon);
+  mExportPainter->setBrush(Qt::NoBrush);
+}
+
+QRect QPlot3D::textSize(QString string) const {
+  return QRect(0.0, 0.0, fontMetrics().width(string), fontMetrics().height());
+}
+
+void QPlot3D::addCloud(QOctreeCloud* cloud) {
+  if(mClouds.contains(cloud)) return;
+  mClouds.push_back(cloud);
+  cloud->mPlot = this;
+  rescaleAxis();
+  updateGL();
+}
+
+bool QPlot3D::removeCloud(QOctreeCloud* cloud) {
+  if(!mClouds.removeOne(cloud)) return false;
+  if(mHoverPick.cloud == cloud) mHoverPick = QPickResult();
+  // Buffers of clouds that are in other subplots are kept
+  if(!showsCloud(cloud)) {
+    releaseCloudBuffers(cloud);
+    cloud->mPlot = NULL;
+  }
+  updateGL();
+  return true;
+}
+
+bool QPlot3D::showsCloud(QOctreeCloud* cloud) const {
+  if(mClouds.contains(cloud)) return true;
+  for (int i = 0; i < mSubplots.size(); i++) {
+    if(mSubplots[i]->clouds.contains(cloud)) return true;
+  }
+  return false;
+}
+
+// Deletes the vertex buffers of the nodes of the cloud in the GL context of
+// the plot
+void QPlot3D::releaseCloudBuffers(QOctreeCloud* cloud) {
+  makeCurrent();
+  cloud->releaseBuffers();
+}
+
+// Removes a cloud that is being destroyed from all subplots
+void QPlot3D::forgetCloud(QOctreeCloud* cloud) {
+  mClouds.removeAll(cloud);
+  if(mHoverPick.cloud == cloud) mHoverPick = QPickResult();
+  for (int i = 0; i < mSubplots.size(); i++) {
+    mSubplots[i]->clouds.removeAll(cloud);
+    if(mSubplots[i]->hoverPick.cloud == cloud) mSubplots[i]->hoverPick = QPickResult();
+  }
+  releaseCloudBuffers(cloud);
+  cloud->mPlot = NULL;
+  update();
+}
+
+void QPlot3D::addQuiver(QQuiver3D* quiver) {
+  if(mQuivers.contains(quiver)) return;
+  mQuivers.push_back(quiver);
+  rescaleAxis();
+  updateGL();
+}
+
+bool QPlot3D::removeQuiver(QQuiver3D* quiver) {
+  if(!mQuivers.removeOne(quiver)) return false;
+  // Buffers of quivers that are in other subplots are kept
+  if(!showsQuiver(quiver)) releaseQuiverBuffer(quiver);
+  updateGL();
+  return true;
+}
+
+bool QPlot3D::showsQuiver(QQuiver3D* quiver) const {
+  if(mQuivers.contains(quiver)) return true;
+  for (int i = 0; i < mSubplots.size(); i++) {
+    if(mSubplots[i]->quivers.contains(quiver)) return true;
+  }
+  return false;
+}
+
+void QPlot3D::clear() {
+  const QList<QOctreeCloud*> tClouds = mClouds;
+  mCurves.clear();
+  mClouds.clear();
+  mQuivers.clear();
+  mHoverPick = QPickResult();
+  // Buffers of curves, quivers and clouds that are in other subplots are kept
+  const QList<QCurve3D*> tCurves = mCurveBuffers.keys();
+  for (int i = 0; i < tCurves.size(); i++) {
+    if(!showsCurve(tCurves[i])) releaseCurveBuffer(tCurves[i]);
+  }
+  const QList<QQuiver3D*> tQuivers = mQuiverBuffers.keys();
+  for (int i = 0; i < tQuivers.size(); i++) {
+    if(!showsQuiver(tQuivers[i])) releaseQuiverBuffer(tQuivers[i]);
+  }
+  for (int i = 0; i < tClouds.size(); i++) {
+    if(showsCloud(tClouds[i])) continue;
+    releaseCloudBuffers(tClouds[i]);
+    tClouds[i]->mPlot = NULL;
+  }
+}
+
+bool QPlot3D::saveScene(const QString& fileName, bool compress) const {
+  QFile tFile(fileName);
+  if(!tFile.open(QIODevice::WriteOnly)) return false;
+
+  QDataStream tStream(&tFile);
+  tStream.setVersion(QDataStream::Qt_5_0);
+  // The chunks are written in the byte order of this machine
+  tStream << SCENE_MAGIC << SCENE_VERSION << (quint8)(QSysInfo::ByteOrder == QSysInfo::LittleEndian);
+
+  // Camera and plot settings
+  tStream << mTranslate << mRotation << mScale << mBackgroundColor
+          << mShowAzimuthElevation << mShowLegend << mAxisEqual << mLegendFont;
+
+  const qint32 nCurves = mCurves.size();
+  tStream << nCurves;
+  for (int i = 0; i < nCurves; i++) {
+    const QCurve3D* tCurve = mCurves[i];
+    tStream << tCurve->mName << tCurve->mColor << (qint32)tCurve->mLineWidth << tCurve->mVisible
+            << tCurve->mColorMap << tCurve->mAutoScalarRange << tCurve->mScalarMin << tCurve->mScalarMax
+            << tCurve->mSimplifyTolerance
+            << (qint64)tCurve->size() << tCurve->hasTime() << tCurve->hasScalar()
+            << tCurve->mBreaks
+            << (qint32)tCurve->mStyle << tCurve->mTubeRadius << (qint32)tCurve->mTubeSides << tCurve->hasRadius()
+            << tCurve->mHasTransform << tCurve->mTranslation << tCurve->mRotation << tCurve->mScale
+            << tCurve->mShowShadows << tCurve->mShadowColor;
+    WriteChunks(tStream, (const char*)tCurve->mVertices.constData(), tCurve->size(), sizeof(QVector3D), compress);
+    if(tCurve->hasTime())
+      WriteChunks(tStream, (const char*)tCurve->timeData(), tCurve->size(), sizeof(double), compress, tCurve->timeStride());
+    if(tCurve->hasScalar())
+      WriteChunks(tStream, (const char*)tCurve->scalarData(), tCurve->size(), sizeof(float), compress, tCurve->scalarStride());
+    if(tCurve->hasRadius())
+      WriteChunks(tStream, (const char*)tCurve->mRadii.constData(), tCurve->size(), sizeof(float), compress);
+  }
+
+  mXAxis.writeScene(tStream);
+  mYAxis.writeScene(tStream);
+  mZAxis.writeScene(tStream);
+
+  return tStream.status() == QDataStream::Ok && tFile.error() == QFile::NoError;
+}
+
+bool QPlot3D::loadScene(const QString& fileName) {
+  QFile tFile(fileName);
+  if(!tFile.open(QIODevice::ReadOnly)) return false;
+
+  QDataStream tStream(&tFile);
+  tStream.setVersion(QDataStream::Qt_5_0);
+  quint32 tMagic, tVersion;
+  quint8  tLittleEndian;
+  tStream >> tMagic >> tVersion >> tLittleEndian;
+  if(tStream.status() != QDataStream::Ok || tMagic != SCENE_MAGIC || tVersion > SCENE_VERSION) return false;
+  if(tLittleEndian != (QSysInfo::ByteOrder == QSysInfo::LittleEndian)) return false;
+
+  QVector3D tTranslate, tRotation, tScale;
+  QColor tBackgroundColor;
+  bool   tShowAzimuthElevation, tShowLegend, tAxisEqual;
+  QFont  tLegendFont;
+  tStream >> tTranslate >> tRotation >> tScale >> tBackgroundColor
+          >> tShowAzimuthElevation >> tShowLegend >> tAxisEqual >> tLegendFont;
+
+  // NULL if the file can not be mapped, then the chunks are read instead
+  const uchar* tMap = tFile.map(0, tFile.size());
+
+  QList<QCurve3D*> tCurves;
+  qint32 nCurves = 0;
+  tStream >> nCurves;
+  bool tOk = tStream.status() == QDataStream::Ok && nCurves >= 0;
+  for (int i = 0; tOk && i < nCurves; i++) {
+    QCurve3D* tCurve = new QCurve3D;
+    tCurves.push_back(tCurve);
+
+    qint32 tLineWidth;
+    qint64 tSize;
+    bool   tHasTime, tHasScalar;
+    tStream >> tCurve->mName >> tCurve->mColor >> tLineWidth >> tCurve->mVisible
+            >> tCurve->mColorMap >> tCurve->mAutoScalarRange >> tCurve->mScalarMin >> tCurve->mScalarMax
+            >> tCurve->mSimplifyTolerance
+            >> tSize >> tHasTime >> tHasScalar;
+    if(tVersion >= 2) tStream >> tCurve->mBreaks;
+    qint32 tStyle = QCurve3D::LINE_STYLE;
+    qint32 tTubeSides = tCurve->mTubeSides;
+    bool   tHasRadius = false;
+    if(tVersion >= 3) tStream >> tStyle >> tCurve->mTubeRadius >> tTubeSides >> tHasRadius;
+    if(tVersion >= 4) tStream >> tCurve->mHasTransform >> tCurve->mTranslation >> tCurve->mRotation >> tCurve->mScale;
+    if(tVersion >= 5) tStream >> tCurve->mShowShadows >> tCurve->mShadowColor;
+    tCurve->mStyle = (QCurve3D::Style)qBound((int)QCurve3D::LINE_STYLE, (int)tStyle, (int)QCurve3D::RIBBON_STYLE);
+    tCurve->setTubeSides(tTubeSides);
+    tCurve->mLineWidth = tLineWidth;
+    tOk = tStream.status() == QDataStream::Ok && tSize >= 0 && tSize <= std::numeric_limits<int>::max();
+    for (int b = 0; tOk && b < tCurve->mBreaks.size(); b++) {
+      tOk = tCurve->mBreaks[b] > (b > 0 ? tCurve->mBreaks[b-1] : 0) && tCurve->mBreaks[b] < tSize;
+    }
+    if(!tOk) break;
+
+    tCurve->mVertices.resize(tSize);
+    tOk = ReadChunks(tStream, tMap, (char*)tCurve->mVertices.data(), tSize, sizeof(QVector3D));
+    if(tOk && tHasTime) {
+      tCurve->mTimes.resize(tSize);
+      tOk = ReadChunks(tStream, tMap, (char*)tCurve->mTimes.data(), tSize, sizeof(double));
+    }
+    if(tOk && tHasScalar) {
+      tCurve->mScalars.resize(tSize);
+      tOk = ReadChunks(tStream, tMap, (char*)tCurve->mScalars.data(), tSize, sizeof(float));
+    }
+    if(tOk && tHasRadius) {
+      tCurve->mRadii.resize(tSize);
+      tOk = ReadChunks(tStream, tMap, (char*)tCurve->mRadii.data(), tSize, sizeof(float));
+    }
+    if(tOk) tCurve->rebuildDerived();
+  }
+  // The axes are read aside, so that a truncated file leaves the plot as it was
+  QAxis tAxes[3];
+  for (int a = 0; tOk && a < 3; a++) {
+    tAxes[a].setAxis((QAxis::Axis)a);
+    tAxes[a].setPlot(this);
+    tAxes[a].readScene(tStream);
+    tOk = tStream.status() == QDataStream::Ok;
+  }
+  if(!tOk) {
+    qDeleteAll(tCurves);
+    return false;
+  }
+  mXAxis.swapState(tAxes[0]);
+  mYAxis.swapState(tAxes[1]);
+  mZAxis.swapState(tAxes[2]);
+
+  // Only the curves are replaced, the scene does not hold quivers and clouds.
+  // Curves of a previously loaded scene are owned by the plot
+  const QList<QCurve3D*> tOldCurves = mCurves;
+  mCurves.clear();
+  if(mHoverPick.curve != NULL) mHoverPick = QPickResult();
+  for (int i = 0; i < tOldCurves.size(); i++) {
+    if(showsCurve(tOldCurves[i])) continue;
+    releaseCurveBuffer(tOldCurves[i]);
+    if(tOldCurves[i]->parent() == this) delete tOldCurves[i];
+  }
+  for (int i = 0; i < tCurves.size(); i++) {
+    tCurves[i]->setParent(this);
+    mCurves.push_back(tCurves[i]);
+  }
+
+  mTranslate = tTranslate;
+  mRotation  = tRotation;
+  mScale     = tScale;
+  cameraChanged();
+  mShowAzimuthElevation = tShowAzimuthElevation;
+  mShowLegend = tShowLegend;
+  mAxisEqual  = tAxisEqual;
+  mLegendFont = tLegendFont;
+  setBackgroundColor(tBackgroundColor);
+
+  mXAxis.adjustPlaneView();
+  mYAxis.adjustPlaneView();
+  mZAxis.adjustPlaneView();
+  updateGL();
+  return true;
+}
+
+bool QPlot3D::removeCurve(QCurve3D* curve) {
+  if(mHoverPick.curve == curve) mHoverPick = QPickResult();
+  const bool tRemoved = mCurves.removeOne(curve);
+  if(!showsCurve(curve)) releaseCurveBuffer(curve);
+  return tRemoved;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// QOCTREECLOUD
+////////////////////////////////////////////////////////////////////////////////
+
+// A node of an octree cloud that has been read from the file
+class QOctreeNodeData {
+ public:
+  QOctreeNodeData(): buffer(QGLBuffer::VertexBuffer), lastUsed(0) {}
+  QVector<QVector3D> points;
+  QGLBuffer buffer;
+  int lastUsed;
+};
+
+// Shared by a cloud and its I/O jobs. The cloud gets a new state when it
+// opens or closes a file, so that jobs for the old file are ignored.
+class QOctreeState {
+ public:
+  QString fileName;
+  QMutex  mutex;
+  QList<QPair<int, QVector<QVector3D> > > done;
+  // Nodes that could not be read
+  QList<int> failed;
+};
+
+// Reads the points of a node on an I/O thread
+class QOctreeLoadJob: public QRunnable {
+ public:
+  QOctreeLoadJob(QSharedPointer<QOctreeState> state, int node, qint64 offset, quint32 count):
+    mState(state), mNode(node), mOffset(offset), mCount(count) {}
+
+  void run() {
+    QVector<QVector3D> tPoints(mCount);
+    const qint64 tBytes = (qint64)mCount*sizeof(QVector3D);
+    QFile tFile(mState->fileName);
+    const bool tRead = tFile.open(QIODevice::ReadOnly) && tFile.seek(mOffset) &&
+                       tFile.read((char*)tPoints.data(), tBytes) == tBytes;
+    if(!tRead) qWarning() << "QOctreeCloud: could not read node" << mNode << "of" << mState->fileName;
+
+    QMutexLocker tLock(&mState->mutex);
+    if(tRead)
+      mState->done.push_back(qMakePair(mNode, tPoints));
+    else
+      mState->failed.push_back(mNode);
+  }
+
+ private:
+  QSharedPointer<QOctreeState> mState;
+  int     mNode;
+  qint64  mOffset;
+  quint32 mCount;
+};
+
+QOctreeCloud::QOctreeCloud(QObject* parent):
+  QObject(parent),
+  mPointCount(0),
+  mColor(Qt::blue),
+  mPointSize(1.0),
+  mMinNodeSize(OCTREE_MIN_NODE_SIZE),
+  mVisible(true),
+  mLoadedBytes(0),
+  mRequestedBytes(0),
+  mMemoryBudget(OCTREE_MEMORY_BUDGET),
+  mState(new QOctreeState)
+{
+  mIoPool.setMaxThreadCount(2);
+}
+
+QOctreeCloud::~QOctreeCloud() {
+  // The plot must not draw the cloud after it is gone
+  if(mPlot != NULL) mPlot->forgetCloud(this);
+  close();
+}
+
+bool QOctreeCloud::open(const QString& fileName) {
+  close();
+
+  QFile tFile(fileName);
+  if(!tFile.open(QIODevice::ReadOnly)) return false;
+  QOctreeFormat::Header tHeader;
+  if(tFile.read((char*)&tHeader, sizeof(tHeader)) != (qint64)sizeof(tHeader) ||
+     tHeader.magic != QOctreeFormat::MAGIC || tHeader.version != QOctreeFormat::VERSION || tHeader.nodeCount == 0) {
+    qWarning() << "QOctreeCloud: not an octree file:" << fileName;
+    return false;
+  }
+
+  QVector<QOctreeFormat::Node> tNodes(tHeader.nodeCount);
+  const qint64 tBytes = (qint64)tHeader.nodeCount*sizeof(QOctreeFormat::Node);
+  if(!tFile.seek(tHeader.nodeTableOffset) || tFile.read((char*)tNodes.data(), tBytes) != tBytes) {
+    qWarning() << "QOctreeCloud: truncated octree file:" << fileName;
+    return false;
+  }
+
+  // Children always come after their parent, so the traversal ends
+  const qint64 tFileSize = tFile.size();
+  for (int i = 0; i < tNodes.size(); i++) {
+    const QOctreeFormat::Node& tNode = tNodes[i];
+    bool tValid = tNode.offset >= (qint64)sizeof(tHeader) &&
+                  tNode.offset + (qint64)tNode.count*(qint64)sizeof(QVector3D) <= tFileSize;
+    for (int c = 0; c < 8 && tValid; c++) {
+      tValid = tNode.children[c] == -1 || (tNode.children[c] > i && tNode.children[c] < tNodes.size());
+    }
+    if(!tValid) {
+      qWarning() << "QOctreeCloud: invalid node" << i << "in" << fileName;
+      return false;
+    }
+  }
+
+  mFileName   = fileName;
+  mName       = QFileInfo(fileName).fileName();
+  mNodes      = tNodes;
+  mPointCount = tHeader.pointCount;
+  mRange      = QRange(QVector3D(tHeader.min[0],tHeader.min[1],tHeader.min[2]), QVector3D(tHeader.max[0],tHeader.max[1],tHeader.max[2]));
+  mState->fileName = fileName;
+  return true;
+}
+
+void QOctreeCloud::close() {
+  // Jobs that have not started are dropped, running jobs finish into the old state
+  mIoPool.clear();
+  mState = QSharedPointer<QOctreeState>(new QOctreeState);
+  if(mPlot != NULL) mPlot->releaseCloudBuffers(this);
+  qDeleteAll(mLoaded);
+  mLoaded.clear();
+  mRequested.clear();
+  mFailed.clear();
+  mLoadedBytes    = 0;
+  mRequestedBytes = 0;
+  mNodes.clear();
+  mFileName.clear();
+  mPointCount = 0;
+}
+
+// Moves the nodes read by the I/O threads to the loaded nodes
+void QOctreeCloud::collect() {
+  QList<QPair<int, QVector<QVector3D> > > tDone;
+  QList<int> tFailed;
+  {
+    QMutexLocker tLock(&mState->mutex);
+    tDone.swap(mState->done);
+    tFailed.swap(mState->failed);
+  }
+  // Nodes that could not be read hold no memory and are not requested again
+  for (int i = 0; i < tFailed.size(); i++) {
+    if(!mRequested.remove(tFailed[i])) continue;
+    mRequestedBytes -= NodeBytes(mNodes[tFailed[i]].count);
+    mFailed.insert(tFailed[i]);
+  }
+  for (int i = 0; i < tDone.size(); i++) {
+    const int tNode = tDone[i].first;
+    if(!mRequested.remove(tNode)) continue;
+    const qint64 tBytes = NodeBytes(mNodes[tNode].count);
+    mRequestedBytes -= tBytes;
+    mLoadedBytes    += tBytes;
+    QOctreeNodeData* d = new QOctreeNodeData;
+    d->points = tDone[i].second;
+    mLoaded.insert(tNode, d);
+  }
+}
+
+// Starts reading a node if there is room for it within the memory budget
+void QOctreeCloud::request(int node, int frame) {
+  if(mRequested.size() >= OCTREE_MAX_REQUESTS) return;
+  const qint64 tBytes = NodeBytes(mNodes[node].count);
+  if(!makeRoom(tBytes, frame)) return;
+
+  mRequested.insert(node);
+  mRequestedBytes += tBytes;
+  mIoPool.start(new QOctreeLoadJob(mState, node, mNodes[node].offset, mNodes[node].count));
+}
+
+// Drops the least recently drawn nodes until bytes more fit in the budget.
+// Nodes drawn in this frame are kept. Returns false if there is no room.
+bool QOctreeCloud::makeRoom(qint64 bytes, int frame) {
+  while(mLoadedBytes + mRequestedBytes + bytes > mMemoryBudget) {
+    int tOldest = -1;
+    int tOldestFrame = frame;
+    for (QHash<int, QOctreeNodeData*>::const_iterator it = mLoaded.constBegin(); it != mLoaded.constEnd(); ++it) {
+      if(it.value()->lastUsed < tOldestFrame) {
+        tOldest      = it.key();
+        tOldestFrame = it.value()->lastUsed;
+      }
+    }
+    if(tOldest < 0) return false;
+    evict(tOldest);
+  }
+  return true;
+}
+
+// Deletes the vertex buffers of the loaded nodes and keeps their points.
+// Must be called with the GL context of the plot current.
+void QOctreeCloud::releaseBuffers() {
+  for (QHash<int, QOctreeNodeData*>::iterator it = mLoaded.begin(); it != mLoaded.end(); ++it) {
+    it.value()->buffer.destroy();
+  }
+}
+
+// Must be called with the GL context of the plot current
+void QOctreeCloud::evict(int node) {
+  QOctreeNodeData* d = mLoaded.take(node);
+  if(d == NULL) return;
+  mLoadedBytes -= NodeBytes(mNodes[node].count);
+  d->buffer.destroy();
+  delete d;
+}
+
+#ifdef QPLOT3D_SERVER
+////////////////////////////////////////////////////////////////////////////////
+// QPLOTSERVER
+////////////////////////////////////////////////////////////////////////////////
+
+// Bytes a client socket buffers while the server is busy, beyond which the
+// client blocks when writing.
+static const int SERVER_READ_BUFFER = 4 << 20;
+
+// A decoded message. Appends to the same curve are merged into one.
+class QPlotServerOp {
+ public:
+  quint32 type;
+  quint32 client;
+  quint64 curve;
+  QString name;
+  QVector<QVector3D> points;
+  QPlotProtocol::Style style;
+  qint64  stamp;
+};
+
+class QPlotServerWorker::Client {
+ public:
+  quint32 id;
+  QLocalSocket* socket;
+  QByteArray buffer;
+};
+
+QPlotServer::QPlotServer(QPlot3D* plot, QObject* parent):
+  QObject(parent),
+  mPlot(plot),
+  mWorker(new QPlotServerWorker(this)),
+  mQueuedPoints(0),
+  mMaxQueuedPoints(32 << 20),
+  mNotified(false),
+  mBusy(false)
+{
+  mWorker->moveToThread(&mThread);
+  connect(&mThread, SIGNAL(finished()), mWorker, SLOT(deleteLater()));
+  mThread.start();
+}
+
+QPlotServer::~QPlotServer() {
+  close();
+  mThread.quit();
+  mThread.wait();
+
+  // The curves are owned by the server, take them out of every subplot
+  if(mPlot.isNull()) return;
+  const int tCurrent = mPlot->currentSubplot();
+  const int nSubplots = std::max(1, mPlot->mSubplots.size());
+  for (int s = 0; s < nSubplots; s++) {
+    mPlot->setCurrentSubplot(s);
+    for (QHash<quint64, QCurve3D*>::const_iterator it = mCurves.constBegin(); it != mCurves.constEnd(); ++it) {
+      mPlot->removeCurve(it.value());
+    }
+  }
+  mPlot->setCurrentSubplot(tCurrent);
+  mPlot->update();
+}
+
+bool QPlotServer::listen(const QString& name) {
+  bool tOk = false;
+  QMetaObject::invokeMethod(mWorker, "listen", Qt::BlockingQueuedConnection, Q_RETURN_ARG(bool, tOk), Q_ARG(QString, name));
+  return tOk;
+}
+
+void QPlotServer::close() {
+  QMetaObject::invokeMethod(mWorker, "close", Qt::BlockingQueuedConnection);
+}
+
+qint64 QPlotServer::queuedPoints() const {
+  QMutexLocker tLock(&mMutex);
+  return mQueuedPoints;
+}
+
+// Called by the worker with the messages it decoded. Returns true if the
+// plot is too far behind, in which case the worker stops reading.
+bool QPlotServer::enqueue(QList<QPlotServerOp>& ops, qint64 points) {
+  QMutexLocker tLock(&mMutex);
+  mQueue.append(ops);
+  mQueuedPoints += points;
+  if(!mNotified) {
+    mNotified = true;
+    QMetaObject::invokeMethod(this, "applyQueued", Qt::QueuedConnection);
+  }
+  if(mQueuedPoints > mMaxQueuedPoints) mBusy = true;
+  return mBusy;
+}
+
+// Feeds the decoded messages into the curves, on the GUI thread
+void QPlotServer::applyQueued() {
+  QList<QPlotServerOp> tOps;
+  {
+    QMutexLocker tLock(&mMutex);
+    tOps.swap(mQueue);
+    mNotified = false;
+  }
+  if(mPlot.isNull()) return;
+
+  qint64 tPoints = 0;
+  for (int i = 0; i < tOps.size(); i++) {
+    QPlotServerOp& tOp = tOps[i];
+    QCurve3D* tCurve = mCurves.value(tOp.curve, NULL);
+    switch(tOp.type) {
+    case QPlotProtocol::CREATE_CURVE:
+      if(tCurve == NULL) {
+        tCurve = new QCurve3D(tOp.name);
+        tCurve->setParent(this);
+        mCurves.insert(tOp.curve, tCurve);
+        mPlot->addCurve(tCurve);
+      } else {
+        tCurve->setName(tOp.name);
+      }
+      break;
+    case QPlotProtocol::APPEND_XYZ:
+      tPoints += tOp.points.size();
+      if(tCurve != NULL) tCurve->addData(tOp.points);
+      break;
+    case QPlotProtocol::SET_STYLE:
+      if(tCurve != NULL) {
+        tCurve->setColor(QColor::fromRgba(tOp.style.rgba));
+        tCurve->setLineWidth((int)tOp.style.lineWidth);
+        tCurve->setStyle((QCurve3D::Style)qBound((int)QCurve3D::LINE_STYLE, (int)tOp.style.style, (int)QCurve3D::RIBBON_STYLE));
+        tCurve->setTubeRadius(tOp.style.tubeRadius);
+      }
+      break;
+    case QPlotProtocol::CLEAR:
+      if(tCurve != NULL) tCurve->clear();
+      break;
+    case QPlotProtocol::PING:
+      QMetaObject::invokeMethod(mWorker, "sendPong", Qt::QueuedConnection, Q_ARG(quint32, tOp.client), Q_ARG(qint64, tOp.stamp));
+      break;
+    }
+  }
+  if(tOps.isEmpty()) return;
+
+  // One rescale and one repaint for everything that was decoded
+  mPlot->rescaleAxis();
+  mPlot->update();
+
+  bool   tResume = false;
+  qint64 tQueued;
+  {
+    QMutexLocker tLock(&mMutex);
+    mQueuedPoints -= tPoints;
+    tQueued = mQueuedPoints;
+    if(mBusy && mQueuedPoints <= mMaxQueuedPoints/2) {
+      mBusy   = false;
+      tResume = true;
+    }
+  }
+  if(tResume) {
+    QMetaObject::invokeMethod(mWorker, "setBusy", Qt::QueuedConnection, Q_ARG(bool, false), Q_ARG(qint64, tQueued));
+    emit backPressure(false, tQueued);
+  }
+}
+
+QPlotServerWorker::QPlotServerWorker(QPlotServer* server):
+  mPlotServer(server),
+  mServer(NULL),
+  mNextClient(0),
+  mBusy(false)
+{
+}
+
+QPlotServerWorker::~QPlotServerWorker() {
+  close();
+}
+
+bool QPlotServerWorker::listen(const QString& name) {
+  close();
+  mServer = new QLocalServer(this);
+  connect(mServer, SIGNAL(newConnection()), this, SLOT(newConnection()));
+  QLocalServer::removeServer(name);
+  return mServer->listen(name);
+}
+
+void QPlotServerWorker::close() {
+  const QList<Client*> tClients = mClients.values();
+  mClients.clear();
+  for (int i = 0; i < tClients.size(); i++) {
+    tClients[i]->socket->disconnect(this);
+    tClients[i]->socket->deleteLater();
+    delete tClients[i];
+  }
+  delete mServer;
+  mServer = NULL;
+}
+
+void QPlotServerWorker::newConnection() {
+  while(mServer->hasPendingConnections()) {
+    Client* tClient = new Client;
+    tClient->id     = mNextClient++;
+    tClient->socket = mServer->nextPendingConnection();
+    tClient->socket->setReadBufferSize(SERVER_READ_BUFFER);
+    mClients.insert(tClient->socket, tClient);
+    connect(tClient->socket, SIGNAL(readyRead()), this, SLOT(readClient()));
+    connect(tClient->socket, SIGNAL(disconnected()), this, SLOT(clientDisconnected()));
+    readClient(tClient);
+  }
+}
+
+void QPlotServerWorker::clientDisconnected() {
+  QLocalSocket* tSocket = qobject_cast<QLocalSocket*>(sender());
+  Client* tClient = mClients.take(tSocket);
+  if(tClient == NULL) return;
+  tSocket->deleteLater();
+  delete tClient;
+}
+
+void QPlotServerWorker::readClient() {
+  Client* tClient = mClients.value(qobject_cast<QLocalSocket*>(sender()), NULL);
+  if(tClient != NULL) readClient(tClient);
+}
+
+// Decodes the complete messages of a client. While the plot is behind the
+// data is left in the socket, so that the client blocks.
+void QPlotServerWorker::readClient(Client* client) {
+  while(!mBusy && client->socket->bytesAvailable() > 0) {
+    client->buffer.append(client->socket->readAll());
+
+    QList<QPlotServerOp> tOps;
+    qint64 tPoints = 0;
+    int    tOffset = 0;
+    const char* tData = client->buffer.constData();
+    const int   tSize = client->buffer.size();
+    while(tSize - tOffset >= (int)sizeof(QPlotProtocol::Header)) {
+      QPlotProtocol::Header tHeader;
+      memcpy(&tHeader, tData + tOffset, sizeof(tHeader));
+      if(tHeader.size > QPlotProtocol::MAX_PAYLOAD) {
+        qWarning() << "QPlotServer: closing client with a message of" << tHeader.size << "bytes";
+        client->socket->abort();
+        return;
+      }
+      if(tSize - tOffset - (int)sizeof(tHeader) < (int)tHeader.size) break;
+      const char* tPayload = tData + tOffset + sizeof(tHeader);
+      tOffset += sizeof(tHeader) + tHeader.size;
+
+      const quint64 tCurve = ((quint64)client->id << 32) | tHeader.curve;
+      if(tHeader.type == QPlotProtocol::APPEND_XYZ) {
+        // Merge with an append to the same curve just before
+        const int nPoints = tHeader.size/sizeof(QVector3D);
+        if(tOps.isEmpty() || tOps.last().type != QPlotProtocol::APPEND_XYZ || tOps.last().curve != tCurve) {
+          QPlotServerOp tOp;
+          tOp.type   = tHeader.type;
+          tOp.client = client->id;
+          tOp.curve  = tCurve;
+          tOps.push_back(tOp);
+        }
+        QVector<QVector3D>& tPointsOut = tOps.last().points;
+        const int tFirst = tPointsOut.size();
+        tPointsOut.resize(tFirst + nPoints);
+        memcpy(tPointsOut.data() + tFirst, tPayload, nPoints*sizeof(QVector3D));
+        tPoints += nPoints;
+        continue;
+      }
+
+      QPlotServerOp tOp;
+      tOp.type   = tHeader.type;
+      tOp.client = client->id;
+      tOp.curve  = tCurve;
+      tOp.stamp  = 0;
+      if(tHeader.type == QPlotProtocol::CREATE_CURVE) {
+        tOp.name = QString::fromUtf8(tPayload, tHeader.size);
+      } else if(tHeader.type == QPlotProtocol::SET_STYLE && tHeader.size >= sizeof(QPlotProtocol::Style)) {
+        memcpy(&tOp.style, tPayload, sizeof(QPlotProtocol::Style));
+      } else if(tHeader.type == QPlotProtocol::PING && tHeader.size >= sizeof(qint64)) {
+        memcpy(&tOp.stamp, tPayload, sizeof(qint64));
+      } else if(tHeader.type != QPlotProtocol::CLEAR) {
+        continue;
+      }
+      tOps.push_back(tOp);
+    }
+    client->buffer.remove(0, tOffset);
+
+    if(!tOps.isEmpty() && mPlotServer->enqueue(tOps, tPoints)) setBusy(true, mPlotServer->queuedPoints());
+  }
+}
+
+// Stops or resumes reading from the clients, and tells them
+void QPlotServerWorker::setBusy(bool busy, qint64 queuedPoints) {
+  if(busy == mBusy) return;
+  mBusy = busy;
+  if(busy) QMetaObject::invokeMethod(mPlotServer, "backPressure", Qt::QueuedConnection, Q_ARG(bool, true), Q_ARG(qint64, queuedPoints));
+
+  QPlotProtocol::Status tStatus;
+  tStatus.queuedPoints = queuedPoints;
+  tStatus.busy         = busy;
+  const QList<Client*> tClients = mClients.values();
+  for (int i = 0; i < tClients.size(); i++) {
+    send(tClients[i], QPlotProtocol::STATUS, &tStatus, sizeof(tStatus));
+  }
+  for (int i = 0; !mBusy && i < tClients.size(); i++) {
+    readClient(tClients[i]);
+  }
+}
+
+void QPlotServerWorker::sendPong(quint32 client, qint64 stamp) {
+  QHashIterator<QLocalSocket*, Client*> it(mClients);
+  while(it.hasNext()) {
+    it.next();
+    if(it.value()->id == client) send(it.value(), QPlotProtocol::PONG, &stamp, sizeof(stamp));
+  }
+}
+
+void QPlotServerWorker::send(Client* client, quint32 type, const void* payload, quint32 size) {
+  QPlotProtocol::Header tHeader;
+  tHeader.type  = type;
+  tHeader.curve = 0;
+  tHeader.size  = size;
+  client->socket->write((const char*)&tHeader, sizeof(tHeader));
+  client->socket->write((const char*)payload, size);
+}
+#endif
+
+#ifdef QPLOT3D_QUICK
+////////////////////////////////////////////////////////////////////////////////
+// QPLOT3DITEM
+////////////////////////////////////////////////////////////////////////////////
+
+// Renders a QPlot3DItem on the render thread. The curves are copied into
+// curves owned by the renderer in synchronize(), while the GUI thread is
+// blocked, so render() never reads data that the GUI thread may change.
+// The renderer is the canvas of its own axes, which are drawn by QAxis like
+// the axes of QPlot3D. Their text is painted after the GL drawing.
+class QPlot3DItemRenderer: public QQuickFramebufferObject::Renderer, public QPlotCanvas {
+ public:
+  QPlot3DItemRenderer();
+  ~QPlot3DItemRenderer();
+
+  bool      showTickLabels() const { return true; }
+  double    azimuth() const;
+  double    elevation() const { return mRotation.x(); }
+  QRect     textSize(QString string) const;
+  QVector3D toScreenCoordinates(const QVector3D& worldCoord) const;
+  QVector3D cameraPositionInWorldCoordinates() const;
+  void      draw3DLine(QVector3D from, QVector3D to, double lineWidth, QColor color);
+  void      draw3DPlane(QVector3D topLeft, QVector3D bottomRight, QColor color);
+  void      renderTextAtWorldCoordinates(const QVector3D& vec, QString string, QFont font);
+  void      renderTextAtScreenCoordinates(int x, int y, QString string, QFont font);
+
+ protected:
+  QOpenGLFramebufferObject* createFramebufferObject(const QSize& size);
+  void synchronize(QQuickFramebufferObject* item);
+  void render();
+
+ private:
+  struct ColorMap {
+    ColorMap(): texture(0), serial(0) {}
+    GLuint texture;
+    int    serial;
+  };
+  struct Text {
+    QPoint  pos;
+    QString string;
+    QFont   font;
+    QColor  color;
+  };
+
+  void bindColorMap(const QCurve3D* copy);
+  void drawLegend();
+  void enable2D();
+  void disable2D();
+
+  QQuickWindow* mWindow;
+  QHash<const QCurve3D*, QCurve3D*> mCopies;
+  QList<QCurve3D*> mOrder;
+  QHash<const QCurve3D*, ColorMap> mColorMaps;
+  QColor    mBackgroundColor;
+  QVector3D mTranslate, mRotation, mScale;
+  bool      mAxisEqual;
+  QAxis     mXAxis, mYAxis, mZAxis;
+  QSize     mSize;
+  QFont     mFont;
+  QFont     mLegendFont;
+  QList<Text> mTexts;
+};
+
+QPlot3DItemRenderer::QPlot3DItemRenderer():
+  mWindow(NULL),
+  mScale(1.0,1.0,1.0),
+  mAxisEqual(false),
+  mFont("Helvetica"),
+  mLegendFont("Helvetica", 12)
+{
+  mXAxis.setAxis(QAxis::X_AXIS);
+  mXAxis.setPlot(this);
+  mYAxis.setAxis(QAxis::Y_AXIS);
+  mYAxis.setPlot(this);
+  mZAxis.setAxis(QAxis::Z_AXIS);
+  mZAxis.setPlot(this);
+
+  // Same labels as QPlot3D
+  mXAxis.setXLabel("X"); mZAxis.setYLabel("X");
+  mYAxis.setXLabel("Y"); mXAxis.setYLabel("Y");
+  mZAxis.setXLabel("Z"); mYAxis.setYLabel("Z");
+}
+
+// The renderer is deleted on the render thread with its context current
+QPlot3DItemRenderer::~QPlot3DItemRenderer() {
+  for (QHash<const QCurve3D*, ColorMap>::const_iterator it = mColorMaps.constBegin(); it != mColorMaps.constEnd(); ++it) {
+    glDeleteTextures(1, &it.value().texture);
+  }
+  qDeleteAll(mCopies);
+}
+
+QOpenGLFramebufferObject* QPlot3DItemRenderer::createFramebufferObject(const QSize& size) {
+  QOpenGLFramebufferObjectFormat tFormat;
+  tFormat.setAttachment(QOpenGLFramebufferObject::CombinedDepthStencil);
+  tFormat.setSamples(4);
+  return new QOpenGLFramebufferObject(size, tFormat);
+}
+
+void QPlot3DItemRenderer::synchronize(QQuickFramebufferObject* item) {
+  const QPlot3DItem* tItem = static_cast<const QPlot3DItem*>(item);
+  mWindow          = item->window();
+  mBackgroundColor = tItem->mBackgroundColor;
+  mTranslate       = tItem->mTranslate;
+  mRotation        = tItem->mRotation;
+  mAxisEqual       = tItem->mAxisEqual;
+
+  mOrder.clear();
+  QHash<const QCurve3D*, QCurve3D*> tCopies;
+  const int nCurves = tItem->mCurves.size();
+  for (int i = 0; i < nCurves; i++) {
+    const QCurve3D* tCurve = tItem->mCurves[i];
+    QCurve3D* tCopy = mCopies.take(tCurve);
+    if(tCopy == NULL) {
+      tCopy = new QCurve3D;
+      tCopy->mSerial = tCurve->mSerial - 1;
+    }
+    tCopies.insert(tCurve, tCopy);
+    mOrder.push_back(tCopy);
+
+    // Copy everything again when existing vertices have changed, otherwise
+    // only the appended vertices and the last vertex, which the
+    // simplification may have moved.
+    if(tCopy->mSerial != tCurve->mSerial) {
+      tCopy->mSerial = tCurve->mSerial;
+      tCopy->mVertices.clear();
+      tCopy->mScalars.clear();
+    }
+    int tFrom = tCopy->mVertices.size();
+    if(tCurve->mSimplifyTolerance > 0.0) tFrom = std::max(0, tFrom-1);
+    const int tSize = tCurve->size();
+    tCopy->mVertices.resize(tSize);
+    std::copy(tCurve->mVertices.constBegin() + tFrom, tCurve->mVertices.constEnd(), tCopy->mVertices.begin() + tFrom);
+
+    // Scalars are read one by one, since a vertex layout may pack them
+    if(tCurve->hasScalar()) {
+      const int tScalarFrom = std::min(tFrom, tCopy->mScalars.size());
+      tCopy->mScalars.resize(tSize);
+      for (int v = tScalarFrom; v < tSize; v++) {
+        tCopy->mScalars[v] = tCurve->scalar(v);
+      }
+    } else {
+      tCopy->mScalars.clear();
+    }
+    if(tCopy->mColorMapSerial != tCurve->mColorMapSerial) {
+      tCopy->mColorMap       = tCurve->mColorMap;
+      tCopy->mColorMapSerial = tCurve->mColorMapSerial;
+    }
+
+    tCopy->mBreaks          = tCurve->mBreaks;
+    tCopy->mRange           = tCurve->mRange;
+    tCopy->mName            = tCurve->mName;
+    tCopy->mColor           = tCurve->mColor;
+    tCopy->mLineWidth       = tCurve->mLineWidth;
+    tCopy->mVisible         = tCurve->mVisible;
+    tCopy->mHasTransform    = tCurve->mHasTransform;
+    tCopy->mTranslation     = tCurve->mTranslation;
+    tCopy->mRotation        = tCurve->mRotation;
+    tCopy->mScale           = tCurve->mScale;
+    tCopy->mAutoScalarRange = tCurve->mAutoScalarRange;
+    tCopy->mScalarMin       = tCurve->mScalarMin;
+    tCopy->mScalarMax       = tCurve->mScalarMax;
+    tCopy->mScalarDataMin   = tCurve->mScalarDataMin;
+    tCopy->mScalarDataMax   = tCurve->mScalarDataMax;
+  }
+
+  // Curves that were removed from the item
+  for (QHash<const QCurve3D*, QCurve3D*>::const_iterator it = mCopies.constBegin(); it != mCopies.constEnd(); ++it) {
+    if(!mColorMaps.contains(it.value())) continue;
+    const GLuint tTexture = mColorMaps.take(it.value()).texture;
+    glDeleteTextures(1, &tTexture);
+  }
+  qDeleteAll(mCopies);
+  mCopies = tCopies;
+}
+
+void QPlot3DItemRenderer::render() {
+  // The scene graph may have left a program and a buffer bound
+  QOpenGLFunctions* f = QOpenGLContext::currentContext()->functions();
+  f->glUseProgram(0);
+  f->glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  mSize = framebufferObject()->size();
+  glViewport(0, 0, mSize.width(), mSize.height());
+  glClearColor(mBackgroundColor.redF(), mBackgroundColor.greenF(), mBackgroundColor.blueF(), mBackgroundColor.alphaF());
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glShadeModel(GL_SMOOTH);
+  glEnable(GL_MULTISAMPLE);
+  glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  double zNear = 0.01;
+  double zFar  = 10000.0;
+  double aspect = (double)mSize.width()/(double)std::max(1, mSize.height());
+  double fW = tan( 25*3.141592/180.0)*zNear;
+  double fH = fW/aspect;
+  glFrustum(-fW,fW,-fH,fH,zNear,zFar);
+
+  // Same range and camera as QPlot3D::rescaleAxis() and loadCamera()
+  QRange tRange(std::numeric_limits<double>::max(),-std::numeric_limits<double>::max());
+  const int nCurves = mOrder.size();
+  for (int i = 0; i < nCurves; i++) {
+    if(mOrder[i]->size() == 0) continue;
+    const QRange tCurveRange = mOrder[i]->transformedRange();
+    tRange.setIfMin(tCurveRange);
+    tRange.setIfMax(tCurveRange);
+  }
+  if(tRange.min.x() > tRange.max.x()) tRange = QRange(0.0, 1.0);
+
+  // The ticks need an extent along every axis
+  const QVector3D tPad(tRange.max.x() > tRange.min.x() ? 0.0 : 0.5,
+                       tRange.max.y() > tRange.min.y() ? 0.0 : 0.5,
+                       tRange.max.z() > tRange.min.z() ? 0.0 : 0.5);
+  tRange.min -= tPad;
+  tRange.max += tPad;
+  mXAxis.setRange(tRange);
+  mYAxis.setRange(tRange);
+  mZAxis.setRange(tRange);
+
+  QVector3D tDelta = tRange.delta();
+  if(mAxisEqual) {
+    const double k = std::max(tDelta.x(),std::max(tDelta.y(),tDelta.z()));
+    tDelta = QVector3D(k,k,k);
+  }
+  mScale = QVector3D(10.0/tDelta.x(), 10.0/tDelta.y(), 10.0/tDelta.z());
+  const QVector3D tCenter = tRange.center();
+
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  glTranslatef(mTranslate.x(),mTranslate.y(),mTranslate.z());
+  glRotatef(mRotation.x()-90, 1.0, 0.0, 0.0);
+  glRotatef(mRotation.y(), 0.0, 1.0, 0.0);
+  glRotatef(mRotation.z(), 0.0, 0.0, 1.0);
+  glScalef(mScale.x(),mScale.y(),mScale.z());
+  glTranslatef(-tCenter.x(),-tCenter.y(),-tCenter.z());
+
+  // Axis planes, grid and ticks in the background
+  mTexts.clear();
+  mXAxis.adjustPlaneView();
+  mYAxis.adjustPlaneView();
+  mZAxis.adjustPlaneView();
+  mXAxis.draw();
+  mYAxis.draw();
+  mZAxis.draw();
+
+  glEnable(GL_BLEND);
+  for (int i = 0; i < nCurves; i++) {
+    const QCurve3D* tCopy = mOrder[i];
+    if(!tCopy->isVisible() || tCopy->size() < 2) continue;
+    glVertexPointer(3, GL_FLOAT, 0, tCopy->mVertices.constData());
+    if(tCopy->hasScalar()) {
+      glTexCoordPointer(1, GL_FLOAT, 0, tCopy->mScalars.constData());
+      bindColorMap(tCopy);
+    }
+    if(tCopy->hasTransform()) {
+      glPushMatrix();
+      glMultMatrixf(tCopy->transform().constData());
+    }
+
+    tCopy->draw(0, tCopy->size(), 1);
+
+    if(tCopy->hasTransform()) glPopMatrix();
+    if(tCopy->hasScalar()) {
+      glDisable(GL_TEXTURE_1D);
+      glMatrixMode(GL_TEXTURE);
+      glLoadIdentity();
+      glMatrixMode(GL_MODELVIEW);
+    }
+  }
+
+  drawLegend();
+  glDisable(GL_BLEND);
+
+  // Text of the axes and the legend
+  if(!mTexts.isEmpty()) {
+    QOpenGLPaintDevice tDevice(mSize);
+    QPainter tPainter(&tDevice);
+    for (int i = 0; i < mTexts.size(); i++) {
+      tPainter.setPen(mTexts[i].color);
+      tPainter.setFont(mTexts[i].font);
+      tPainter.drawText(mTexts[i].pos, mTexts[i].string);
+    }
+  }
+
+  if(mWindow != NULL) mWindow->resetOpenGLState();
+}
+
+// Like QPlot3D::bindColorMap(), with one texture per copied curve
+void QPlot3DItemRenderer::bindColorMap(const QCurve3D* copy) {
+  ColorMap& tColorMap = mColorMaps[copy];
+  if(tColorMap.texture == 0) {
+    glGenTextures(1, &tColorMap.texture);
+    tColorMap.serial = copy->mColorMapSerial - 1;
+  }
+  glBindTexture(GL_TEXTURE_1D, tColorMap.texture);
+  if(tColorMap.serial != copy->mColorMapSerial) {
+    tColorMap.serial = copy->mColorMapSerial;
+    UploadColorMap(copy->mColorMap);
+  }
+
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+  glEnable(GL_TEXTURE_1D);
+
+  double tDelta = copy->scalarMax() - copy->scalarMin();
+  if(tDelta == 0.0) tDelta = 1.0;
+  glMatrixMode(GL_TEXTURE);
+  glLoadIdentity();
+  glScaled(1.0/tDelta, 1.0, 1.0);
+  glTranslated(-copy->scalarMin(), 0.0, 0.0);
+  glMatrixMode(GL_MODELVIEW);
+}
+
+// Same box as the legend of QPlot3D, with a row for every named curve that
+// fits in the item
+void QPlot3DItemRenderer::drawLegend() {
+  QList<const QCurve3D*> tCurves;
+  const QFontMetrics tMetrics(mLegendFont);
+  const double textHeight = tMetrics.height();
+  const int    tRows      = std::max(1, (int)((mSize.height()-20)/textHeight));
+  double tTextWidth = 0;
+  for (int i = 0; i < mOrder.size() && tCurves.size() < tRows; i++) {
+    if(mOrder[i]->mName.isEmpty()) continue;
+    tCurves.push_back(mOrder[i]);
+    tTextWidth = std::max(tTextWidth, (double)tMetrics.width(mOrder[i]->mName));
+  }
+  if(tCurves.isEmpty()) return;
+
+  const double tWidth  = 5 + 20 + 5 + tTextWidth + 5;
+  const double tHeight = 5 + tCurves.size()*textHeight + 5;
+  double x0 = mSize.width()-tWidth-5;
+  double y0 = 5;
+
+  enable2D();
+  Draw2DPlane(QVector2D(x0,y0),             QVector2D(x0+tWidth,y0+tHeight),QColor(204,204,217,128));
+  Draw2DLine(QVector2D(x0,y0),                QVector2D(x0+tWidth,y0),         1, QColor(0,0,0,255));
+  Draw2DLine(QVector2D(x0+tWidth,y0),         QVector2D(x0+tWidth,y0+tHeight), 1, QColor(0,0,0,255));
+  Draw2DLine(QVector2D(x0+tWidth,y0+tHeight), QVector2D(x0,y0+tHeight),        1, QColor(0,0,0,255));
+  Draw2DLine(QVector2D(x0,y0+tHeight),        QVector2D(x0,y0),                1, QColor(0,0,0,255));
+
+  // Curves colored by scalars show their colormap as the swatch
+  x0 += 5;
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+  for (int i = 0; i < tCurves.size(); i++) {
+    const QCurve3D* tCurve     = tCurves[i];
+    const bool      tColorMap  = tCurve->hasScalar() && mColorMaps.contains(tCurve);
+    const QColor    tColor     = tColorMap ? QColor(Qt::white) : tCurve->color();
+    const double    tCenter    = 10 + (i+0.5)*textHeight;
+    const double    tHalfWidth = 0.5*std::max(tColorMap ? 2.0 : 1.0, tCurve->lineWidth());
+    if(tColorMap) {
+      glBindTexture(GL_TEXTURE_1D, mColorMaps[tCurve].texture);
+      glEnable(GL_TEXTURE_1D);
+    }
+    glColor4f(tColor.redF(), tColor.greenF(), tColor.blueF(), tColor.alphaF());
+    glBegin(GL_QUADS);
+    glTexCoord1f(0.0); glVertex2f(x0,    tCenter-tHalfWidth);
+    glTexCoord1f(1.0); glVertex2f(x0+20, tCenter-tHalfWidth);
+    glTexCoord1f(1.0); glVertex2f(x0+20, tCenter+tHalfWidth);
+    glTexCoord1f(0.0); glVertex2f(x0,    tCenter+tHalfWidth);
+    glEnd();
+    if(tColorMap) glDisable(GL_TEXTURE_1D);
+  }
+  disable2D();
+
+  x0 += 25;
+  y0 = 10;
+  for (int i = 0; i < tCurves.size(); i++) {
+    y0 += textHeight;
+    Text tText;
+    tText.pos    = QPoint((int)x0, (int)y0);
+    tText.string = tCurves[i]->mName;
+    tText.font   = mLegendFont;
+    tText.color  = tCurves[i]->isVisible() ? QColor(Qt::black) : QColor(128,128,128);
+    mTexts.push_back(tText);
+  }
+}
+
+void QPlot3DItemRenderer::enable2D() {
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  glOrtho(0,mSize.width(),mSize.height(),0,0.01,-10000.0);
+
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+}
+
+void QPlot3DItemRenderer::disable2D() {
+  glPopMatrix();
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+}
+
+double QPlot3DItemRenderer::azimuth() const {
+  double tAzimuth = -mRotation.z();
+  return tAzimuth - floor(tAzimuth/360.0)*360.0;
+}
+
+QRect QPlot3DItemRenderer::textSize(QString string) const {
+  const QFontMetrics tMetrics(mFont);
+  return QRect(0, 0, tMetrics.width(string), tMetrics.height());
+}
+
+QVector3D QPlot3DItemRenderer::toScreenCoordinates(const QVector3D& vec) const {
+  GLdouble m[16];
+  GLdouble p[16];
+  glGetDoublev(GL_MODELVIEW_MATRIX,&m[0]);
+  glGetDoublev(GL_PROJECTION_MATRIX,&p[0]);
+
+  QVector3D tScreen(0.0,0.0,0.0);
+  ProjectToScreen(m,p,mSize.width(),mSize.height(),vec,&tScreen);
+  return tScreen;
+}
+
+QVector3D QPlot3DItemRenderer::cameraPositionInWorldCoordinates() const {
+  QQuaternion q1 = QQuaternion::fromAxisAndAngle(1.0, 0.0, 0.0, (mRotation.x()-90));
+  QQuaternion q2 = QQuaternion::fromAxisAndAngle(0.0, 1.0, 0.0, mRotation.y());
+  QQuaternion q3 = QQuaternion::fromAxisAndAngle(0.0, 0.0, 1.0, mRotation.z());
+  QQuaternion q  = (q1*q2*q3).conjugate();
+
+  return mXAxis.range().center() + q.rotatedVector(-QVector3D(mTranslate.x()/mScale.x(),mTranslate.y()/mScale.y(),mTranslate.z()/mScale.z()));
+}
+
+void QPlot3DItemRenderer::draw3DLine(QVector3D from, QVector3D to, double lineWidth, QColor color) {
+  const QVector3D tFrom = toScreenCoordinates(from);
+  const QVector3D tTo   = toScreenCoordinates(to);
+  enable2D();
+  DrawScreenLine(tFrom, tTo, lineWidth, color);
+  disable2D();
+}
+
+void QPlot3DItemRenderer::draw3DPlane(QVector3D topLeft, QVector3D bottomRight, QColor color) {
+  Draw3DPlane(topLeft, bottomRight, color);
+}
+
+void QPlot3DItemRenderer::renderTextAtWorldCoordinates(const QVector3D& vec, QString string, QFont font) {
+  const QVector3D tScreen = toScreenCoordinates(vec);
+  renderTextAtScreenCoordinates(tScreen.x(), tScreen.y(), string, font);
+}
+
+// Kept with the current color, like renderText(), until the GL drawing is done
+void QPlot3DItemRenderer::renderTextAtScreenCoordinates(int x, int y, QString string, QFont font) {
+  mFont = font;
+  GLfloat tColor[4];
+  glGetFloatv(GL_CURRENT_COLOR, tColor);
+  Text tText;
+  tText.pos    = QPoint(x,y);
+  tText.string = string;
+  tText.font   = font;
+  tText.color  = QColor::fromRgbF(tColor[0],tColor[1],tColor[2],tColor[3]);
+  mTexts.push_back(tText);
+}
+
+QPlot3DItem::QPlot3DItem(QQuickItem* parent):
+  QQuickFramebufferObject(parent),
+  mBackgroundColor(Qt::white),
+  mTranslate(0,0,-20),
+  mRotation(30,0,-130),
+  mAxisEqual(false)
+{
+  setAcceptedMouseButtons(Qt::LeftButton | Qt::RightButton);
+}
+
+QQuickFramebufferObject::Renderer* QPlot3DItem::createRenderer() const {
+  return new QPlot3DItemRenderer;
+}
+
+void QPlot3DItem::addCurve(QCurve3D* curve) {
+  mCurves.push_back(curve);
+  update();
+}
+
+bool QPlot3DItem::removeCurve(QCurve3D* curve) {
+  const bool tRemoved = mCurves.removeOne(curve);
+  update();
+  return tRemoved;
+}
+
+void QPlot3DItem::clear() {
+  mCurves.clear();
+  update();
+}
+
+double QPlot3DItem::azimuth() const {
+  double tAzimuth = -mRotation.z();
+  return tAzimuth - floor(tAzimuth/360.0)*360.0;
+}
+
+void QPlot3DItem::mousePressEvent(QMouseEvent* event) {
+  mLastMousePos = event->localPos();
+  event->accept();
+}
+
+void QPlot3DItem::mouseMoveEvent(QMouseEvent* event) {
+  const double dx = event->localPos().x() - mLastMousePos.x();
+  const double dy = event->localPos().y() - mLastMousePos.y();
+
+  if (event->buttons() & Qt::LeftButton) {
+    if(event->modifiers() == Qt::ControlModifier) {
+      mRotation.setY(mRotation.y() + dx);
+    } else {
+      if( (mRotation.x() + dy < 90) && (mRotation.x() + dy > -90))
+        mRotation.setX(mRotation.x() + dy);
+      mRotation.setZ(mRotation.z() + dx);
+    }
+  } else {
+    mTranslate += QVector3D(dx/32.0,-dy/32.0,0.0);
+  }
+  mLastMousePos = event->localPos();
+  emit cameraChanged();
+  update();
+}
+
+void QPlot3DItem::wheelEvent(QWheelEvent* event) {
+  event->accept();
+  setZoom(zoom() + (double)event->angleDelta().y()/32);
 }
+#endif
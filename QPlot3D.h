@@ -22,6 +22,17 @@
 
 #include <QtCore>
 #include <QtOpenGL>
+#include <cstddef>
+#ifdef QPLOT3D_QUICK
+#include <QtQuick/QQuickFramebufferObject>
+#include <QtQuick/QQuickWindow>
+#endif
+#ifdef QPLOT3D_SERVER
+#include <QtNetwork>
+#endif
+#ifdef QPLOT3D_SVG
+#include <QtSvg>
+#endif
 
 
 /*!
@@ -29,6 +40,13 @@
  */
 
 class QPlot3D;
+class QCurve3D;
+class QCurveDerivedState;
+class QDensity;
+class QOctreeCloud;
+class QQuiver3D;
+class QOctreeState;
+class QOctreeNodeData;
 
 /*!
   Class that represents a 3D range (similar to a bounding box).
@@ -38,6 +56,7 @@ class QRange {
  public:
   QRange();
   QRange(double _min, double _max);
+  QRange(const QVector3D& _min, const QVector3D& _max);
   QVector3D center() const;
   QVector3D delta() const;
   void setIfMin(QVector3D in);
@@ -48,6 +67,23 @@ class QRange {
   QVector3D max;
 };
 
+/*!
+  Class that holds the result of QPlot3D::pick().
+  If no curve point was found within the pick radius, curve is NULL.
+  Points of an octree cloud are returned with cloud set instead of curve,
+  and index is the index of the point in the octree file.
+*/
+class QPickResult {
+ public:
+  QPickResult();
+  bool isValid() const { return curve != NULL || cloud != NULL; }
+  QCurve3D* curve;
+  QOctreeCloud* cloud;
+  qint64    index;
+  QVector3D point;
+  double    distance;
+};
+
 /*!
   The QCurve3D class is a container for the data representing a 3D-curve. 
   The class also encaspulates attributes associated with the 
@@ -68,34 +104,165 @@ class QRange {
   aCurve[aCurve.size()-1].setZ(3.0);
   
   \endcode
+
+  A curve can also carry a timestamp per vertex. Timestamps must be
+  non-decreasing and are used by QPlot3D::setTimeWindow() to only draw
+  a part of the curve.
+
+  \code
+  aCurve.addData(QVector3D(0.0, 0.0, 0.0), 0.0);
+  aCurve.addData(QVector3D(1.0, 1.0, 1.0), 0.1);
+  \endcode
+
+  A scalar per vertex can be used to color the curve through a colormap.
+  The colormap and the scalar range can be changed without touching the
+  vertex data.
+
+  \code
+  aCurve.addScalar(12.0);
+  aCurve.addScalar(15.0);
+  aCurve.setScalarRange(10.0, 20.0);
+  \endcode
+
+  Hidden curves are not drawn or picked, and their vertex buffers may be
+  evicted by a plot that is over its GPU memory budget.
+
+  A curve can have a model transform, made of a scale, a rotation and a
+  translation applied in that order. It is applied when drawing, so moving a
+  rigid object only changes the transform, not the vertices. Call
+  QPlot3D::rescaleAxis() if the axes should grow to where it moved.
+
+  \code
+  aCurve.setTranslation(QVector3D(5,0,0));
+  aCurve.setRotation(QQuaternion::fromAxisAndAngle(0,0,1,45));
+  \endcode
+
+  With setShowShadows() the curve is also drawn flattened onto each axis
+  plane that is shown, in the shadow color. The shadows are made from the
+  vertex buffer of the curve and follow the planes when they flip.
+
+  Dense samples can be simplified as they are added. With a simplify
+  tolerance, points closer than the tolerance to the last point are dropped,
+  and the last point is moved forward as long as the points it replaces are
+  within the tolerance of the line it is on. A scalar or radius added right
+  after a point goes with it: it is dropped with a dropped point, and
+  replaces the one of the last point when that point is moved.
+
+  \code
+  aCurve.setSimplifyTolerance(0.01);
+  \endcode
+
+  A curve can have gaps, for example where a track has dropouts. A sample
+  with a NaN coordinate, or a call to addBreak(), ends the current line and
+  the next sample starts a new one. Gap markers are not stored as vertices,
+  so they take no timestamp or scalar and are never part of the range or
+  picked. The lines of a curve are drawn with one multi-draw call.
+
+  \code
+  aCurve.addData(0.0, 0.0, 0.0);
+  aCurve.addData(1.0, 1.0, 1.0);
+  aCurve.addBreak();
+  aCurve.addData(2.0, 2.0, 2.0);
+  aCurve.addData(3.0, 3.0, 3.0);
+  \endcode
+
+  Curves can be drawn as shaded tubes or ribbons instead of lines. The
+  geometry is made from the vertex buffer of the curve by a vertex shader,
+  one instance per segment, so it takes no memory per segment. The radius
+  is in the units of the plot box, which is 10 wide, and can be scaled per
+  vertex with addRadius(). Without shader or instancing support, and while
+  the plot draws thin lines to keep up, curves are drawn as lines.
+
+  \code
+  aCurve.setStyle(QCurve3D::TUBE_STYLE);
+  aCurve.setTubeRadius(0.1);
+  aCurve.setTubeSides(12);
+  \endcode
  */
 class QCurve3D: public QObject{
   Q_OBJECT
    friend class QPlot3D;
+   friend class QPlot3DItemRenderer;
 
  public:
   QCurve3D();
   QCurve3D(QString name);
+  ~QCurve3D();
 
   // Getters
   QColor color() const { return mColor; }
   double lineWidth() const { return mLineWidth; }
-  QVector3D& value(int index)  { return mVertices[index]; }
+  QVector3D& value(int index)  { mSerial++; if(index < mChangedFirst) mChangedFirst = index; return mVertices[index]; }
   const QVector3D& value(int index) const { return mVertices[index]; }
   QRange range() const { return mRange; }
+  QRange transformedRange() const;
+  bool        hasTransform() const { return mHasTransform; }
+  QVector3D   translation() const { return mTranslation; }
+  QQuaternion rotation() const { return mRotation; }
+  QVector3D   scale() const { return mScale; }
+  QMatrix4x4  transform() const;
+  bool   showShadows() const { return mShowShadows; }
+  QColor shadowColor() const { return mShadowColor; }
   QString name() const { return mName;}
+  enum Style {
+    LINE_STYLE   = 0,
+    TUBE_STYLE   = 1,  // Shaded tube around the curve
+    RIBBON_STYLE = 2   // Shaded band, held level with the xy plane
+  };
+  Style  style() const { return mStyle; }
+  double tubeRadius() const { return mTubeRadius; }
+  int    tubeSides() const { return mTubeSides; }
+  double radius(int index) const { return mRadii[index]; }
+  bool   hasRadius() const { return !mVertices.isEmpty() && mRadii.size() == mVertices.size(); }
+  double time(int index) const { return *(const double*)((const char*)timeData() + index*timeStride()); }
+  bool hasTime() const { return !mVertices.isEmpty() && (timeOffset() < 0 ? mTimes.size() == mVertices.size() : attributeStride() > 0); }
+  double scalar(int index) const { return *(const float*)((const char*)scalarData() + index*scalarStride()); }
+  bool hasScalar() const { return !mVertices.isEmpty() && (scalarOffset() < 0 ? mScalars.size() == mVertices.size() : attributeStride() > 0); }
+  double scalarMin() const { return mAutoScalarRange ? mScalarDataMin : mScalarMin; }
+  double scalarMax() const { return mAutoScalarRange ? mScalarDataMax : mScalarMax; }
+  QVector<QColor> colorMap() const { return mColorMap; }
+  bool isVisible() const { return mVisible; }
+  double simplifyTolerance() const { return mSimplifyTolerance; }
+  // What the simplification did with the last point added
+  enum FilterResult { KEEP_POINT, DROP_POINT, REPLACE_POINT };
+  FilterResult lastFilterResult() const { return mLastFilter; }
+  int  droppedCount() const { return mDroppedCount; }
+  const QVector<int>& breaks() const { return mBreaks; }
+  qint64 cpuBytes() const;
+  qint64 derivedBytes() const;
 
   // Setters
-  void setColor(QColor color) { mColor = color; }
-  void setLineWidth(int value) { mLineWidth = value; }
-  void setName(QString name) { mName = name; }
+  void setColor(QColor color) { mColor = color; mStyleSerial++; }
+  void setLineWidth(int value) { mLineWidth = value; mStyleSerial++; }
+  void setName(QString name) { mName = name; mStyleSerial++; }
+  void setScalar(int index, double value);
+  void setScalarRange(double min, double max) { mScalarMin = min; mScalarMax = max; mAutoScalarRange = false; }
+  void setAutoScalarRange() { mAutoScalarRange = true; }
+  void setColorMap(const QVector<QColor>& colors) { mColorMap = colors; mColorMapSerial++; }
+  void setVisible(bool value) { mVisible = value; mStyleSerial++; }
+  void setStyle(Style style) { mStyle = style; }
+  void setTubeRadius(double value) { mTubeRadius = value; }
+  void setTubeSides(int value) { mTubeSides = qBound(3, value, 64); }
+  void setSimplifyTolerance(double value) { mSimplifyTolerance = value; mFloating = false; }
+  void setTranslation(const QVector3D& value) { mTranslation = value; mHasTransform = true; }
+  void setRotation(const QQuaternion& value) { mRotation = value; mHasTransform = true; }
+  void setScale(const QVector3D& value) { mScale = value; mHasTransform = true; }
+  void clearTransform();
+  void setShowShadows(bool value) { mShowShadows = value; }
+  void setShadowColor(QColor color) { mShadowColor = color; }
 
   // Misc
   void addData(const double& x, const double& y, const double& z);
   void addData(const QVector<double>& x, const QVector<double>& y, const QVector<double>& z);
   void addData(const QVector<QVector3D>& data);
   void addData(const QVector3D& data);
-  void clear() { mVertices.clear(); }
+  void addData(const double& x, const double& y, const double& z, const double& time);
+  void addData(const QVector3D& data, double time);
+  void addScalar(double value);
+  void addRadius(double value);
+  void addBreak();
+  void indexRange(double t0, double t1, int* first, int* end) const;
+  void clear();
   int  size() const { return mVertices.size(); }
 
   // Operators
@@ -103,17 +270,411 @@ class QCurve3D: public QObject{
   const QVector3D& operator[](int i) const;  
 
  protected:
-  void draw() const;
+  void draw(int first, int end, int stride, double alpha = 1.0, int maxLineWidth = 0) const;
+  void drawShadow(int first, int end, int stride) const;
+  bool updateDerived(QThreadPool* pool);
+
+  // Packed per-vertex attributes beyond the position, kept by QLayoutCurve3D.
+  // The stride is 0 when the curve has no attributes for all of its vertices.
+  // Scalars and timestamps are read from the attributes at their offset
+  // when it is not -1.
+  virtual int  attributeStride() const { return 0; }
+  virtual const void* attributeData() const { return NULL; }
+  virtual void* attributeData() { return NULL; }
+  virtual bool bindsAttributes() const { return false; }
+  virtual int  scalarOffset() const { return -1; }
+  virtual int  timeOffset() const { return -1; }
+  virtual void enableAttributes(const void* pointer, int stride) const { Q_UNUSED(pointer); Q_UNUSED(stride); }
+  virtual void disableAttributes() const {}
+  virtual void clearAttributes() {}
+  void extendScalarRange(double value);
 
  private:
+  void addToPickIndex(int index);
+  void strips(int first, int end, int stride, QVector<GLint>* firsts, QVector<GLsizei>* counts) const;
+  void rebuildDerived();
+  void appendVertex(const QVector3D& data);
+  FilterResult filterPoint(const QVector3D& data);
+  bool attributeIndex(int count, int* index) const;
+  const float*  scalarData() const;
+  int           scalarStride() const;
+  const double* timeData() const;
+  int           timeStride() const;
+
   QString mName;
   QColor  mColor;
   int     mLineWidth;
+  bool    mVisible;
+  Style   mStyle;
+  double  mTubeRadius;
+  int     mTubeSides;
 
   QVector<QVector3D> mVertices;
-  QVector<GLushort>  mFaces;  
+  QVector<double>    mTimes;
+  QVector<float>     mScalars;
+  QVector<float>     mRadii;
   QRange mRange;
 
+  // Model transform applied when drawing
+  bool        mHasTransform;
+  QVector3D   mTranslation;
+  QQuaternion mRotation;
+  QVector3D   mScale;
+
+  bool   mShowShadows;
+  QColor mShadowColor;
+
+  // Indices of the vertices that start a new line after a gap, increasing.
+  QVector<int> mBreaks;
+
+  QVector<QColor> mColorMap;
+  int    mColorMapSerial;
+  // Incremented when the name, color, line width or visibility change, so
+  // that plots know that their legend must be drawn again.
+  int    mStyleSerial;
+  bool   mAutoScalarRange;
+  double mScalarMin, mScalarMax, mScalarDataMin, mScalarDataMax;
+
+  // Incremented when existing vertices may have changed, so that plots
+  // know that their vertex buffers must be uploaded again.
+  int mSerial;
+
+  // Two level bounding volume hierarchy over consecutive vertices used for picking.
+  QVector<QRange> mPickLeaves;
+  QVector<QRange> mPickNodes;
+
+  // The range and pick index are extended as data is appended. When vertices
+  // are changed they are computed again by a worker from a snapshot of the
+  // vertices, and the previous ones are used until the result is ready.
+  QSharedPointer<QCurveDerivedState> mDerivedState;
+  int mDerivedSerial, mJobSerial;
+  // Index of the first vertex changed since they were derived, only the
+  // pick leaves before it are computed again.
+  int mChangedFirst;
+
+  // Streaming simplification. The last vertex is floating when it may still
+  // be moved along mSimplifyDirection from the vertex before it.
+  double    mSimplifyTolerance;
+  int       mDroppedCount;
+  bool      mFloating;
+  QVector3D mSimplifyDirection;
+  FilterResult mLastFilter;
+
+};
+
+/*!
+  Vertex layouts of QLayoutCurve3D. A layout has a packed Vertex that is
+  appended to the curve and an append path that feeds its position to the
+  curve. Layouts with HAS_ATTRIBUTES also have packed Attributes, which are
+  kept beside the positions instead of in the runtime vectors of QCurve3D.
+  Layouts with BINDS_ATTRIBUTES upload them to their own vertex buffer and
+  bind them to the fixed function arrays by enable(). SCALAR_OFFSET and
+  TIME_OFFSET tell where a scalar or a timestamp is in the Attributes, or
+  are -1 when the layout has none.
+ */
+class QPositionLayout {
+ public:
+  class Vertex {
+  public:
+    Vertex() {}
+    Vertex(const QVector3D& p): position(p) {}
+    QVector3D position;
+  };
+  class Attributes {};
+  enum { HAS_ATTRIBUTES = 0, BINDS_ATTRIBUTES = 0, SCALAR_OFFSET = -1, TIME_OFFSET = -1 };
+  static void append(QCurve3D* curve, const Vertex& v) { curve->addData(v.position); }
+  static Attributes attributes(const Vertex&, const Attributes*) { return Attributes(); }
+  static void enable(const void*, int) {}
+  static void disable() {}
+};
+
+// Timestamped positions for the time window of the plot. The timestamps are
+// only read on the CPU, so they are not uploaded.
+class QTimeLayout: public QPositionLayout {
+ public:
+  class Attributes {
+  public:
+    double time;
+  };
+  class Vertex {
+  public:
+    Vertex(): time(0) {}
+    Vertex(const QVector3D& p, double t): position(p), time(t) {}
+    QVector3D position;
+    double    time;
+  };
+  enum { HAS_ATTRIBUTES = 1, BINDS_ATTRIBUTES = 0, SCALAR_OFFSET = -1, TIME_OFFSET = offsetof(Attributes, time) };
+  static void append(QCurve3D* curve, const Vertex& v) { curve->addData(v.position); }
+  // Keeps the timestamps monotonic so that they can be binary searched
+  static Attributes attributes(const Vertex& v, const Attributes* last) {
+    Attributes tAttributes;
+    tAttributes.time = (last != NULL && v.time < last->time) ? last->time : v.time;
+    return tAttributes;
+  }
+};
+
+// Positions with a scalar that is mapped through the colormap of the curve
+class QScalarLayout: public QPositionLayout {
+ public:
+  class Attributes {
+  public:
+    float scalar;
+  };
+  class Vertex {
+  public:
+    Vertex(): scalar(0) {}
+    Vertex(const QVector3D& p, float s): position(p), scalar(s) {}
+    QVector3D position;
+    float     scalar;
+  };
+  enum { HAS_ATTRIBUTES = 1, BINDS_ATTRIBUTES = 1, SCALAR_OFFSET = offsetof(Attributes, scalar), TIME_OFFSET = -1 };
+  static void append(QCurve3D* curve, const Vertex& v) { curve->addData(v.position); }
+  static Attributes attributes(const Vertex& v, const Attributes*) {
+    Attributes tAttributes;
+    tAttributes.scalar = v.scalar;
+    return tAttributes;
+  }
+  // The scalar is the texture coordinate into the colormap, the curve
+  // enables the array when it draws
+  static void enable(const void* pointer, int stride) {
+    glTexCoordPointer(1, GL_FLOAT, stride, (const char*)pointer + SCALAR_OFFSET);
+  }
+};
+
+// Positions with a color each, drawn with the line style
+class QColorLayout {
+ public:
+  class Attributes {
+  public:
+    GLubyte rgba[4];
+  };
+  class Vertex {
+  public:
+    Vertex() {}
+    Vertex(const QVector3D& p, const QColor& c): position(p) {
+      color.rgba[0] = c.red(); color.rgba[1] = c.green(); color.rgba[2] = c.blue(); color.rgba[3] = c.alpha();
+    }
+    QVector3D  position;
+    Attributes color;
+  };
+  enum { HAS_ATTRIBUTES = 1, BINDS_ATTRIBUTES = 1, SCALAR_OFFSET = -1, TIME_OFFSET = -1 };
+  static void append(QCurve3D* curve, const Vertex& v) { curve->addData(v.position); }
+  static Attributes attributes(const Vertex& v, const Attributes*) { return v.color; }
+  static void enable(const void* pointer, int stride) {
+    glColorPointer(4, GL_UNSIGNED_BYTE, stride, pointer);
+    glEnableClientState(GL_COLOR_ARRAY);
+  }
+  static void disable() { glDisableClientState(GL_COLOR_ARRAY); }
+};
+
+/*!
+  Curve whose vertices have the layout given as template argument. The
+  packed vertex, the append path and the attribute bindings are chosen at
+  compile time, and the curve is added to a plot like any QCurve3D. The
+  scalars and timestamps of a layout are read from its packed attributes by
+  scalar(), time(), the time window and the colormap.
+
+  Example:
+  \code
+  QLayoutCurve3D<QColorLayout> aCurve("Colored");
+  aCurve.addVertex(QColorLayout::Vertex(QVector3D(0,0,0), Qt::red));
+  aCurve.addVertex(QColorLayout::Vertex(QVector3D(1,1,1), Qt::blue));
+  mPlot->addCurve(&aCurve);
+  \endcode
+ */
+template<class Layout>
+class QLayoutCurve3D: public QCurve3D {
+ public:
+  typedef typename Layout::Vertex     Vertex;
+  typedef typename Layout::Attributes Attributes;
+
+  QLayoutCurve3D() {}
+  QLayoutCurve3D(QString name): QCurve3D(name) {}
+
+  void addVertex(const Vertex& vertex) {
+    const int tSize = size();
+    Layout::append(this, vertex);
+    if(!Layout::HAS_ATTRIBUTES) return;
+    const bool tAdded = size() > tSize;
+    // Only a vertex moved by the simplification takes the latest attributes,
+    // dropped points are left out
+    if(!tAdded && (lastFilterResult() != REPLACE_POINT || mAttributes.size() != size())) return;
+
+    const Attributes* tLast = mAttributes.isEmpty() ? NULL : &mAttributes.last();
+    const Attributes tAttributes = Layout::attributes(vertex, tLast);
+    if(Layout::SCALAR_OFFSET >= 0) extendScalarRange(*(const float*)((const char*)&tAttributes + Layout::SCALAR_OFFSET));
+    if(tAdded)
+      mAttributes.push_back(tAttributes);
+    else
+      mAttributes.last() = tAttributes;
+  }
+  void addVertices(const QVector<Vertex>& vertices) {
+    if(Layout::HAS_ATTRIBUTES) mAttributes.reserve(mAttributes.size() + vertices.size());
+    for (int i = 0; i < vertices.size(); i++) {
+      addVertex(vertices[i]);
+    }
+  }
+  const Attributes& attributes(int index) const { return mAttributes[index]; }
+
+ protected:
+  int attributeStride() const {
+    return Layout::HAS_ATTRIBUTES && size() > 0 && mAttributes.size() == size() ? sizeof(Attributes) : 0;
+  }
+  const void* attributeData() const { return mAttributes.constData(); }
+  void* attributeData() { return mAttributes.data(); }
+  bool bindsAttributes() const { return Layout::BINDS_ATTRIBUTES; }
+  int  scalarOffset() const { return Layout::SCALAR_OFFSET; }
+  int  timeOffset() const { return Layout::TIME_OFFSET; }
+  void enableAttributes(const void* pointer, int stride) const { Layout::enable(pointer, stride); }
+  void disableAttributes() const { Layout::disable(); }
+  void clearAttributes() { mAttributes.clear(); }
+
+ private:
+  QVector<Attributes> mAttributes;
+};
+
+// Positions only, which is what QCurve3D stores
+template<>
+class QLayoutCurve3D<QPositionLayout>: public QCurve3D {
+ public:
+  typedef QPositionLayout::Vertex Vertex;
+
+  QLayoutCurve3D() {}
+  QLayoutCurve3D(QString name): QCurve3D(name) {}
+
+  void addVertex(const Vertex& vertex) { addData(vertex.position); }
+  void addVertices(const QVector<Vertex>& vertices) {
+    for (int i = 0; i < vertices.size(); i++) {
+      addData(vertices[i].position);
+    }
+  }
+};
+
+/*!
+  Class that holds a vector field, as an arrow at each sample position.
+  The position and vector of every sample are kept next to each other in
+  one array, and a plot draws all arrows with one instanced draw of an
+  arrow mesh. The arrows are scaled by scale() times the length of their
+  vector, and are colored by the length of their vector through the
+  colormap when it is set. Dense fields are thinned by drawing only every
+  stride():th arrow.
+
+  Example:
+  \code
+  QQuiver3D aField("Velocity");
+  aField.addArrow(QVector3D(0,0,0), QVector3D(1,0,0));
+  aField.setScale(0.5);
+  aField.setColorMap(QVector<QColor>() << Qt::blue << Qt::red);
+  mPlot->addQuiver(&aField);
+  \endcode
+ */
+class QQuiver3D: public QObject {
+  Q_OBJECT
+  friend class QPlot3D;
+ public:
+  QQuiver3D();
+  QQuiver3D(QString name);
+
+  // Getters
+  QString   name() const { return mName; }
+  QColor    color() const { return mColor; }
+  double    scale() const { return mScale; }
+  int       stride() const { return mStride; }
+  QVector<QColor> colorMap() const { return mColorMap; }
+  bool      isVisible() const { return mVisible; }
+  int       size() const { return mSamples.size()/2; }
+  QVector3D position(int index) const { return mSamples[2*index]; }
+  QVector3D vector(int index) const { return mSamples[2*index+1]; }
+  double    magnitudeMin() const { return mMagnitudeMin; }
+  double    magnitudeMax() const { return mMagnitudeMax; }
+  QRange    range() const;
+
+  // Setters
+  void setName(QString name) { mName = name; }
+  void setColor(QColor color) { mColor = color; }
+  void setScale(double value) { mScale = value; }
+  void setStride(int value) { mStride = qMax(1, value); }
+  void setColorMap(const QVector<QColor>& colors) { mColorMap = colors; mColorMapSerial++; }
+  void setVisible(bool value) { mVisible = value; }
+
+  // Misc
+  void addArrow(const QVector3D& position, const QVector3D& vector);
+  void addArrows(const QVector<QVector3D>& positions, const QVector<QVector3D>& vectors);
+  void clear();
+
+ private:
+  QString mName;
+  QColor  mColor;
+  double  mScale;
+  int     mStride;
+  bool    mVisible;
+
+  // Position and vector of each sample, interleaved
+  QVector<QVector3D> mSamples;
+  QRange  mRange;
+  double  mMagnitudeMin, mMagnitudeMax;
+  int     mSerial;
+
+  QVector<QColor> mColorMap;
+  int     mColorMapSerial;
+};
+
+/*!
+  Class that holds the vertex buffer of a curve in the GL context of a plot.
+  Appended vertices are written to the end of the buffer, the whole buffer
+  is only uploaded again when existing vertices have changed.
+ */
+class QCurveBuffer {
+ public:
+  QCurveBuffer();
+  qint64 bytes() const;
+  void evict();
+  QGLBuffer vertices;
+  int count;
+  int capacity;
+  int serial;
+
+  QGLBuffer scalars;
+  int scalarCount;
+  int scalarCapacity;
+
+  QGLBuffer radii;
+  int radiusCount;
+  int radiusCapacity;
+
+  // Packed attributes of the vertex layout of the curve
+  QGLBuffer attributes;
+  int attributeCount;
+  int attributeCapacity;
+  int attributeStride;
+
+  GLuint colorMap;
+  int colorMapSerial;
+
+  // Frame the buffer was last drawn in
+  int lastUsed;
+};
+
+/*!
+  Canvas that a QAxis draws itself on. It is implemented by QPlot3D, and by
+  the renderer of QPlot3DItem, so that the item shows the same axes.
+ */
+class QPlotCanvas {
+ public:
+  virtual ~QPlotCanvas() {}
+
+  virtual bool      showTickLabels() const = 0;
+  virtual double    azimuth() const = 0;
+  virtual double    elevation() const = 0;
+  virtual QRect     textSize(QString string) const = 0;
+  virtual QVector3D toScreenCoordinates(const QVector3D& worldCoord) const = 0;
+  virtual QVector3D cameraPositionInWorldCoordinates() const = 0;
+  virtual void      draw3DLine(QVector3D from, QVector3D to, double lineWidth, QColor color) = 0;
+  virtual void      draw3DPlane(QVector3D topLeft, QVector3D bottomRight, QColor color) = 0;
+  virtual void      renderTextAtWorldCoordinates(const QVector3D& vec, QString string, QFont font) = 0;
+  virtual void      renderTextAtScreenCoordinates(int x, int y, QString string, QFont font) = 0;
+
+  QVector3D toScreenCoordinates(double worldX, double worldY, double worldZ) const { return toScreenCoordinates(QVector3D(worldX,worldY,worldZ)); }
 };
 
 /*!
@@ -130,6 +691,7 @@ class QCurve3D: public QObject{
 class QAxis: public QObject  {
   Q_OBJECT
   friend class QPlot3D;
+  friend class QPlot3DItemRenderer;
  public:
   QAxis();
   enum Axis{
@@ -178,7 +740,12 @@ class QAxis: public QObject  {
  protected: 
   void draw() const;
   void drawAxisBox() const;
-  void setPlot(QPlot3D* plot) { mPlot = plot; }
+  void drawDensity(GLuint texture) const;
+  void setPlot(QPlotCanvas* plot) { mPlot = plot; }
+  void writeLayerKey(QDataStream& stream) const;
+  void writeScene(QDataStream& stream) const;
+  void readScene(QDataStream& stream);
+  void swapState(QAxis& other);
   void setXLabel(QString label) { mXLabel = label; }
   void setYLabel(QString label) { mYLabel = label; }
   double mScale;
@@ -191,7 +758,7 @@ class QAxis: public QObject  {
   void drawXTickLabel( QVector3D start, QVector3D stop, QString string ) const;
 
  private:
-  QPlot3D* mPlot;
+  QPlotCanvas* mPlot;
   QRange mRange;
   Axis  mAxis;
   bool mAdjustPlaneView, mShowPlane, mShowGrid, mShowAxis, mShowLabel, mShowAxisBox;
@@ -203,12 +770,296 @@ class QAxis: public QObject  {
   QFont mLabelFont, mTicksFont;
 };
 
+/*!
+  Class that represents a scripted camera path for QPlot3D::renderCameraPath().
+  The camera is interpolated linearly between keys, which must be added in
+  increasing time order.
+
+  Example:
+  \code
+  // One full turn around the data in ten seconds
+  QCameraPath path;
+  path.addKey( 0.0,   0.0, 30.0, -20.0);
+  path.addKey(10.0, 360.0, 30.0, -20.0);
+  mPlot->renderCameraPath(path, 30.0, QSize(1920,1080), "frame%1.bmp");
+  \endcode
+ */
+class QCameraPath {
+ public:
+  void addKey(double time, double azimuth, double elevation, double zoom);
+  void cameraAt(double time, double* azimuth, double* elevation, double* zoom) const;
+  double startTime() const { return mTimes.isEmpty() ? 0.0 : mTimes.first(); }
+  double duration() const { return mTimes.isEmpty() ? 0.0 : mTimes.last() - mTimes.first(); }
+  bool isEmpty() const { return mTimes.isEmpty(); }
+
+ private:
+  QVector<double> mTimes, mAzimuths, mElevations, mZooms;
+};
+
+/*!
+  Class that links the cameras of several plots, or of subplots within a
+  plot. When the camera of one of them is moved, the linked components of
+  its camera are copied to the others once, and all linked plots are
+  repainted together on the next pass of the event loop.
+
+  Example:
+  \code
+  // Raw and filtered data rotate together, but are zoomed separately
+  QCameraLink tLink(QCameraLink::ROTATION | QCameraLink::PAN);
+  tLink.addPlot(&tRawPlot);
+  tLink.addPlot(&tFilteredPlot);
+  \endcode
+ */
+class QCameraLink: public QObject {
+  Q_OBJECT
+  friend class QPlot3D;
+ public:
+  enum Component {
+    ROTATION = 0x1,
+    ZOOM     = 0x2,
+    PAN      = 0x4,
+    ALL      = ROTATION | ZOOM | PAN
+  };
+  QCameraLink(int components = ALL, QObject* parent = NULL);
+  ~QCameraLink();
+
+  void addPlot(QPlot3D* plot, int subplot = 0);
+  void removePlot(QPlot3D* plot, int subplot = -1);
+  int  plotCount() const { return mMembers.size(); }
+  int  components() const { return mComponents; }
+  void setComponents(int components) { mComponents = components; }
+
+ private slots:
+  void repaint();
+
+ private:
+  bool cameraChanged(QPlot3D* plot, int subplot);
+
+  class Member {
+  public:
+    QPlot3D* plot;
+    int      subplot;
+  };
+  QList<Member> mMembers;
+  int  mComponents;
+  bool mRepaintPending;
+  int  mSource;
+  QVector3D mTranslate, mRotation;
+};
+
+/*!
+  Layout of the octree files written by tools/octree and read by
+  QOctreeCloud, in the byte order of the machine. The file starts with a
+  Header, followed by the points of the nodes as x, y and z floats, and
+  ends with the table of nodes at nodeTableOffset. Node 0 is the root.
+
+  Every node holds an evenly spread sample of the points below it that
+  are not in its parents, so drawing a node and any of its descendants
+  adds detail without drawing a point twice.
+ */
+class QOctreeFormat {
+ public:
+  static const quint32 MAGIC   = 0x54434f51;  // "QOCT"
+  static const quint32 VERSION = 1;
+
+  class Header {
+  public:
+    quint32 magic;
+    quint32 version;
+    quint32 nodeCount;
+    quint32 reserved;
+    qint64  pointCount;
+    qint64  nodeTableOffset;
+    float   min[3];
+    float   max[3];
+  };
+
+  class Node {
+  public:
+    float   min[3];
+    float   max[3];
+    qint64  offset;       // Of the first point in the file
+    quint32 count;
+    qint32  children[8];  // -1 for no child
+    quint32 reserved;
+  };
+};
+
+/*!
+  Class that draws a point set too large for memory from an octree file.
+  Only the nodes that are in view, and larger on screen than minNodeSize()
+  pixels, are read from the file by background I/O threads. Nodes that
+  have not been drawn for the longest time are dropped when the loaded
+  nodes would exceed memoryBudget() bytes, counting both the points in
+  memory and their vertex buffers.
+
+  Octree files are made from raw float x, y, z files with tools/octree.
+  The samples of trajectories are drawn as points.
+
+  Example:
+  \code
+  QOctreeCloud aCloud;
+  aCloud.open("archive.qoct");
+  aCloud.setMemoryBudget(512 << 20);
+  mPlot->addCloud(&aCloud);
+  \endcode
+ */
+class QOctreeCloud: public QObject {
+  Q_OBJECT
+  friend class QPlot3D;
+ public:
+  QOctreeCloud(QObject* parent = NULL);
+  ~QOctreeCloud();
+
+  bool open(const QString& fileName);
+  void close();
+  bool isOpen() const { return !mNodes.isEmpty(); }
+
+  // Getters
+  QString fileName() const { return mFileName; }
+  QString name() const { return mName; }
+  QRange  range() const { return mRange; }
+  qint64  pointCount() const { return mPointCount; }
+  int     nodeCount() const { return mNodes.size(); }
+  int     loadedNodeCount() const { return mLoaded.size(); }
+  qint64  loadedBytes() const { return mLoadedBytes; }
+  qint64  memoryBudget() const { return mMemoryBudget; }
+  double  minNodeSize() const { return mMinNodeSize; }
+  QColor  color() const { return mColor; }
+  double  pointSize() const { return mPointSize; }
+  bool    isVisible() const { return mVisible; }
+
+  // Setters
+  void setName(const QString& name) { mName = name; }
+  void setMemoryBudget(qint64 bytes) { mMemoryBudget = bytes; }
+  void setMinNodeSize(double pixels) { mMinNodeSize = pixels; }
+  void setIoThreads(int count) { mIoPool.setMaxThreadCount(qMax(1, count)); }
+  void setColor(QColor color) { mColor = color; }
+  void setPointSize(double value) { mPointSize = value; }
+  void setVisible(bool value) { mVisible = value; }
+
+ private:
+  void collect();
+  void request(int node, int frame);
+  bool makeRoom(qint64 bytes, int frame);
+  void evict(int node);
+  void releaseBuffers();
+  static qint64 NodeBytes(quint32 count) { return 2*(qint64)count*sizeof(QVector3D); }
+
+  QString mFileName, mName;
+  QVector<QOctreeFormat::Node> mNodes;
+  QRange  mRange;
+  qint64  mPointCount;
+  QColor  mColor;
+  double  mPointSize, mMinNodeSize;
+  bool    mVisible;
+
+  // Nodes in memory, nodes being read by the I/O threads, and nodes that
+  // could not be read
+  QHash<int, QOctreeNodeData*> mLoaded;
+  QSet<int> mRequested;
+  QSet<int> mFailed;
+  qint64 mLoadedBytes, mRequestedBytes, mMemoryBudget;
+  QThreadPool mIoPool;
+  QSharedPointer<QOctreeState> mState;
+
+  // Plot that shows the cloud, which deletes the vertex buffers of the nodes
+  // in its GL context
+  QPointer<QPlot3D> mPlot;
+};
+
 /*!
   Class that represents the plot window.
   A QPlot3D is a continer for all the curves, axes and legend and responsible for adding curves, removeing curves and drawing curve, axes, and legends.
 
   User interactions like rotation, zooming and panning  with the mouse is included int QPlot3D.
 
+  The axis planes and the overlay (axis box, legend and text box) are
+  rendered into cached layers that are only rendered again when something
+  they show has changed. Streaming data then only costs drawing the curves.
+
+  While the user rotates, pans or zooms, the plot lowers its quality level
+  when the frame time is above the target frame time and raises it again
+  when there is time to spare. When the interaction stops one frame is
+  rendered in full quality.
+
+  Curves with timestamps can be played back with setTimeWindow(). Only the
+  vertices within the window are drawn from the vertex buffers, which are
+  found by binary search, so moving the window never touches the data.
+
+  Frames can be recorded to an image sequence with startRecording(), or
+  rendered offscreen along a QCameraPath at a fixed timestep with
+  renderCameraPath(). Pixels are read back through a ring of pixel buffer
+  objects and the images are written by worker threads.
+
+  exportFigure() writes the plot as a PDF or SVG figure, with the same camera
+  as on screen. The axis planes, grid, ticks and labels are drawn through a
+  QPainter instead of GL. Curves are projected to the page, the parts that
+  are off the page are dropped and each polyline is simplified to the given
+  tolerance in pixels, so the number of points written is bounded by how
+  much of the page the curves cover rather than by the number of vertices.
+
+  \code
+  mPlot.exportFigure("figure.pdf", QSize(800,600));
+  \endcode
+
+  The memory used by the curves is reported by cpuBytes(), gpuBytes() and
+  derivedBytes(). With a GPU memory budget the vertex buffers of curves that
+  are hidden or outside the view are evicted, least recently drawn first,
+  and uploaded again when the curves come back into view.
+
+  The legend lists the curves whose names contain the legend filter. When
+  they do not fit in the widget the legend is split into pages, which are
+  scrolled with the mouse wheel over the legend or with setLegendPage().
+
+  saveScene() writes the curves, the axis settings and the camera to a
+  versioned binary file, with the curve data in optionally compressed
+  chunks. loadScene() replaces the curves of the plot with the curves in
+  the file, which are then owned by the plot; quivers and clouds are kept as
+  they are. Uncompressed chunks are copied straight from the memory mapped
+  file.
+
+  The cameras of plots and subplots are kept in sync with a QCameraLink.
+
+  Vector fields are added as a QQuiver3D, whose arrows are drawn with one
+  instanced draw call.
+
+  Point sets larger than memory are added as a QOctreeCloud, which streams
+  in the nodes of an octree file that are in view. Clouds are scaled to by
+  rescaleAxis() and picked like curves.
+
+  When there are too many samples to draw, setDensityMode() shows how
+  densely the visible curves fill a voxel grid aligned with the axis planes,
+  as translucent voxels or as heatmaps on the axis planes. Vertices are
+  binned with the model transform of their curve, and clipped ones are left
+  out. The grid is binned in parallel by the worker pool, and only the
+  vertices appended since the last binning are added while the axis ranges,
+  clip planes and transforms stay the same. Clouds and quivers are still
+  drawn on top of the density.
+
+  Up to MAX_CLIP_PLANES clip planes, or an axis aligned clip box, cut away
+  parts of the curves while drawing and picking. A plane a*x+b*y+c*z+d = 0
+  in data coordinates keeps the points where a*x+b*y+c*z+d >= 0. The planes
+  are applied by the GL per vertex, so moving them does not touch the curve
+  data. The axes can follow the clip box with setAxisFollowsClipBox().
+
+  \code
+  mPlot.setClipBox(QRange(QVector3D(-1,-1,0), QVector3D(1,1,5)));
+  mPlot.setAxisFollowsClipBox(true);
+  \endcode
+
+  One plot can show a grid of subplots with setSubplotGrid(). Each subplot
+  has its own curves, camera, axes, legend, legend filter, time window and
+  clip planes, and all of them are drawn in
+  the GL context of the plot. The functions of the plot apply to the current
+  subplot, which is selected with setCurrentSubplot() or by clicking in it.
+
+  \code
+  mPlot.setSubplotGrid(2, 2);
+  mPlot.setCurrentSubplot(3);
+  mPlot.addCurve(&aCurve);
+  \endcode
+
   Example: 
   \code
   // Setup a plot
@@ -237,19 +1088,90 @@ class QAxis: public QObject  {
 
   
  */
-class QPlot3D: public QGLWidget {
+class QPlot3D: public QGLWidget, public QPlotCanvas {
   Q_OBJECT
   friend class QAxis;
+  friend class QCameraLink;
+  friend class QOctreeCloud;
+  friend class QPlotServer;
  public:
   QPlot3D(QWidget* parent=NULL);
   ~QPlot3D();
 
   void addCurve(QCurve3D* curve);
   bool removeCurve(QCurve3D* curve);
-  void clear() { mCurves.clear(); }
+  void clear();
+  const QList<QCurve3D*>& curves() const { return mCurves; }
+  void addCloud(QOctreeCloud* cloud);
+  bool removeCloud(QOctreeCloud* cloud);
+  const QList<QOctreeCloud*>& clouds() const { return mClouds; }
+  void addQuiver(QQuiver3D* quiver);
+  bool removeQuiver(QQuiver3D* quiver);
+  const QList<QQuiver3D*>& quivers() const { return mQuivers; }
+  bool saveScene(const QString& fileName, bool compress = false) const;
+  bool loadScene(const QString& fileName);
+
+  void setSubplotGrid(int rows, int columns);
+  int  subplotRows() const { return mSubplotRows; }
+  int  subplotColumns() const { return mSubplotColumns; }
+  int  subplotCount() const { return mSubplotRows*mSubplotColumns; }
+  int  currentSubplot() const { return mCurrentSubplot; }
+  void setCurrentSubplot(int index);
+  int  subplotAt(const QPoint& pos) const;
+  QRect subplotRect(int index) const;
   void setBackgroundColor(QColor color);
   void setLegendFont(QFont font) { mLegendFont = font; }
   QFont legendFont() const { return mLegendFont; }
+  void setLegendFilter(const QString& filter) { mLegendFilter = filter; mLegendPage = 0; }
+  QString legendFilter() const { return mLegendFilter; }
+  int  legendPage() const { return mLegendPage; }
+  int  legendPageCount() const { return mLegendPageCount; }
+  enum DensityMode {
+    DENSITY_OFF    = 0,
+    DENSITY_VOXELS = 1,  // Translucent voxels
+    DENSITY_PLANES = 2   // Heatmaps projected onto the axis planes
+  };
+  void setDensityMode(DensityMode mode) { mDensityMode = mode; updateGL(); }
+  DensityMode densityMode() const { return mDensityMode; }
+  void setDensityResolution(int value);
+  int  densityResolution() const { return mDensityResolution; }
+  void setCacheLayers(bool value) { mCacheLayers = value; }
+  bool cacheLayers() const { return mCacheLayers; }
+
+  enum QualityLevel {
+    FULL_QUALITY      = 0,
+    NO_MULTISAMPLING  = 1,  // Multisampling is turned off
+    THIN_LINES        = 2,  // ...and curves are drawn with line width 1
+    NO_TICK_LABELS    = 3,  // ...and tick labels and fading trails are not drawn
+    REDUCED_DETAIL    = 4,  // ...and every 2nd, 4th or 8th curve vertex is drawn
+    LOWEST_QUALITY    = 6
+  };
+  void setAdaptiveQuality(bool value) { mAdaptiveQuality = value; }
+  bool adaptiveQuality() const { return mAdaptiveQuality; }
+  void setTargetFrameTime(double ms) { mTargetFrameTime = ms; }
+  double targetFrameTime() const { return mTargetFrameTime; }
+  void setQualityThresholds(double degrade, double recover) { mDegradeThreshold = degrade; mRecoverThreshold = recover; }
+  double degradeThreshold() const { return mDegradeThreshold; }
+  double recoverThreshold() const { return mRecoverThreshold; }
+  void setInteractionTimeout(int ms) { mInteractionTimer.setInterval(ms); }
+  int  qualityLevel() const { return mQualityLevel; }
+  double frameTime() const { return mFrameTime; }
+  QThreadPool* workerPool() { return &mWorkerPool; }
+
+  void startRecording(const QString& fileName);
+  void stopRecording();
+  bool isRecording() const { return mRecording; }
+  int  renderCameraPath(const QCameraPath& path, double framesPerSecond, const QSize& size, const QString& fileName);
+  bool exportFigure(const QString& fileName, const QSize& size = QSize(), double tolerance = 0.5);
+
+  qint64 cpuBytes() const;
+  qint64 gpuBytes() const;
+  qint64 gpuBytes(const QCurve3D* curve) const;
+  qint64 derivedBytes() const;
+  int    droppedCount() const;
+  void   setGpuMemoryBudget(qint64 bytes) { mGpuMemoryBudget = bytes; }
+  qint64 gpuMemoryBudget() const { return mGpuMemoryBudget; }
+  bool   showMemoryUsage() const { return mShowMemoryUsage; }
     
   double    zoom()  const { return mTranslate.z(); }
   QVector3D pan()   const { return mTranslate;     }
@@ -268,16 +1190,30 @@ class QPlot3D: public QGLWidget {
   QAxis&    xAxis() { return mXAxis; }
   QAxis&    yAxis() { return mYAxis; }
   QAxis&    zAxis() { return mZAxis; }
-
+  QPickResult pick(const QPoint& pos, int radius) const;
+  QPickResult pick(const QPoint& pos) const { return pick(pos, mPickRadius); }
+  int       pickRadius() const { return mPickRadius; }
+  bool      showPicking() const { return mShowPicking; }
+  bool      hasTimeWindow() const { return mHasTimeWindow; }
+  double    timeWindowStart() const { return mTimeWindowStart; }
+  double    timeWindowEnd() const { return mTimeWindowEnd; }
+  double    trailLength() const { return mTrailLength; }
+  enum { MAX_CLIP_PLANES = 6 };
+  bool      hasClipPlane(int index) const { return (mClipPlaneMask & (1 << index)) != 0; }
+  QVector4D clipPlane(int index) const { return mClipPlanes[index]; }
+  bool      hasClipBox() const { return mHasClipBox; }
+  QRange    clipBox() const { return mClipBox; }
+  bool      axisFollowsClipBox() const { return mAxisFollowsClipBox; }
 
 
  public slots:
-   void setZoom(double value)   { if(value < 0.0) mTranslate.setZ(value); updateGL(); }
-   void setPan(QVector3D value) { mTranslate = value;     updateGL(); }
+   void setZoom(double value)   { if(value < 0.0) mTranslate.setZ(value); if(!cameraChanged()) updateGL(); }
+   void setPan(QVector3D value) { mTranslate = value;     if(!cameraChanged()) updateGL(); }
    void setShowAzimuthElevation(bool value) { mShowAzimuthElevation = value; }
-   void setAzimuth(double value)   { mRotation.setZ(-value); }
-   void setElevation(double value) { mRotation.setX(value); }
+   void setAzimuth(double value)   { mRotation.setZ(-value); cameraChanged(); }
+   void setElevation(double value) { mRotation.setX(value); cameraChanged(); }
    void setShowLegend(bool value)  { mShowLegend = value; }
+   void setLegendPage(int page)    { mLegendPage = qMax(0, page); updateGL(); }
    void setAxisEqual(bool value)   { mAxisEqual = value; rescaleAxis();}
    void setShowAxis(bool value);
    void setShowAxisBox(bool value);
@@ -289,23 +1225,99 @@ class QPlot3D: public QGLWidget {
    void showContextMenu(const QPoint&);
    void toggleAxisEqual() {setAxisEqual(!mAxisEqual);}
    void replot() {updateGL();}
+   void setShowPicking(bool value);
+   void setPickRadius(int value) { mPickRadius = value; }
+   void setTimeWindow(double t0, double t1);
+   void clearTimeWindow();
+   void setTrailLength(double value) { mTrailLength = value; updateGL(); }
+   void setShowMemoryUsage(bool value) { mShowMemoryUsage = value; updateGL(); }
+   void toggleMemoryUsage() { setShowMemoryUsage(!mShowMemoryUsage); }
+   void setClipPlane(int index, const QVector4D& plane);
+   void clearClipPlane(int index);
+   void setClipBox(const QRange& box);
+   void clearClipBox();
+   void clearClipping();
+   void setAxisFollowsClipBox(bool value);
+
+ signals:
+   void curvePointHovered(QCurve3D* curve, int index);
 
  private:
    double roll()  const { return mRotation.x();  }
    double pitch() const { return mRotation.y();  }
    double yaw()   const { return mRotation.z();  }
    void   drawLegend();
+   void   updateLegendLayout();
+   QRect  legendRect(int* first, int* last);
+   void   paintLegend(QPainter* painter, const QRect& rect, int first, int last);
    void   enable2D();
    void   disable2D();
    void   draw3DLine(QVector3D from, QVector3D to, double lineWidth, QColor color);
+   void   draw3DPlane(QVector3D topLeft, QVector3D bottomRight, QColor color);
+   void   exportView(QPainter* painter);
+   void   exportCurve(QPainter* painter, QCurve3D* curve);
+   void   exportQuiver(QPainter* painter, QQuiver3D* quiver);
+   void   exportLegend(QPainter* painter);
+   QSize  canvasSize() const { return mRenderSize.isValid() ? mRenderSize : size(); }
+   QRect  viewRect() const   { return subplotRect(mCurrentSubplot); }
+   int    viewWidth() const  { return viewRect().width(); }
+   int    viewHeight() const { return viewRect().height(); }
+   QSize  viewSize() const   { return viewRect().size(); }
+   class  Subplot;
+   void   swapSubplot(Subplot* subplot);
+   bool   showsCurve(QCurve3D* curve) const;
+   bool   showsCloud(QOctreeCloud* cloud) const;
+   bool   showsQuiver(QQuiver3D* quiver) const;
+   QList<QCurve3D*> allCurves() const;
+   void   paintView();
+   void   updateDerived();
+   bool   cameraChanged();
+   void   subplotCamera(int subplot, QVector3D* translate, QVector3D* rotation) const;
+   void   applyCamera(int subplot, const QVector3D& translate, const QVector3D& rotation, int components);
+   void   readbackFrame();
+   void   writeRecordedFrame(int frame);
+   void   flushRecording();
+   void   loadCamera();
+   void   drawBackground();
+   void   drawData();
+   void   drawOverlay();
+   bool   beginLayer(QGLFramebufferObject** layer, QByteArray* cachedKey, const QByteArray& key, const QColor& clearColor);
+   void   endLayer();
+   void   drawLayer(QGLFramebufferObject* layer, bool blend);
+   QByteArray backgroundKey() const;
+   QByteArray overlayKey() const;
+   void   drawCurve(QCurve3D* curve);
+   void   updateDensity();
+   void   drawDensity();
+   void   drawCurveRange(QCurve3D* curve, int first, int end, double alpha);
+   bool   initTubes();
+   void   drawTubeRange(QCurve3D* curve, int first, int end, double alpha);
+   int    detailStride() const { return mQualityLevel < REDUCED_DETAIL ? 1 : 1 << (mQualityLevel-REDUCED_DETAIL+1); }
+   bool   showTickLabels() const { return mQualityLevel < NO_TICK_LABELS; }
+   void   beginInteraction();
+   void   updateQuality(double frameTime);
+   void   visibleRange(const QCurve3D* curve, int* first, int* end) const;
+   void   bindColorMap(QCurve3D* curve, QCurveBuffer& buffer);
+   void   releaseCurveBuffer(QCurve3D* curve);
+   void   releaseQuiverBuffer(QQuiver3D* quiver);
+   void   releaseCloudBuffers(QOctreeCloud* cloud);
+   void   forgetCloud(QOctreeCloud* cloud);
+   void   enforceGpuBudget();
+   QString memoryUsageText() const;
+   void   drawColorBar();
+   void   drawPickMarker();
+   void   updateHoverPick(const QPoint& pos);
 
  private slots:
-   void setRoll(double value)   { mRotation.setX(value);  updateGL(); }
-   void setPitch(double value)  { mRotation.setY(value);  updateGL(); }
-   void setYaw(double value)    { mRotation.setZ(value);  updateGL(); }
+   void setRoll(double value)   { mRotation.setX(value);  if(!cameraChanged()) updateGL(); }
+   void setPitch(double value)  { mRotation.setY(value);  if(!cameraChanged()) updateGL(); }
+   void setYaw(double value)    { mRotation.setZ(value);  if(!cameraChanged()) updateGL(); }
    void rescaleAxis();
+   void rescaleDerived();
+   void endInteraction();
    void axisEqual();
    void axisTight();
+   void saveFigure();
    
  protected:
   void initializeGL();
@@ -325,6 +1337,14 @@ class QPlot3D: public QGLWidget {
 
  private:
    QList<QCurve3D*> mCurves;
+   QList<QOctreeCloud*> mClouds;
+   QList<QQuiver3D*> mQuivers;
+   void   drawQuiver(QQuiver3D* quiver);
+   bool   initQuivers();
+   void   drawCloud(QOctreeCloud* cloud);
+   void   drawShadows(QCurve3D* curve, QCurveBuffer& buffer, int first, int end);
+   double screenSize(const QRange& range) const;
+   QHash<QCurve3D*, QCurveBuffer> mCurveBuffers;
    QPoint mLastMousePos;
    QColor mBackgroundColor;
 
@@ -335,6 +1355,313 @@ class QPlot3D: public QGLWidget {
    bool mShowAzimuthElevation, mShowLegend, mAxisEqual;
    QAxis mXAxis, mYAxis, mZAxis;
    QFont mLegendFont;
+
+   // Legend layout, only measured again when the curves, their style, the
+   // font or the filter have changed. The legend is painted into a texture,
+   // which is only painted again when its key changes.
+   QString mLegendFilter;
+   int     mLegendPage, mLegendPageCount;
+   QList<QCurve3D*> mLegendCurves;
+   QByteArray mLegendLayoutKey;
+   double  mLegendTextWidth, mLegendTextHeight;
+   QRect   mLegendRect;
+   GLuint  mLegendTexture;
+   QByteArray mLegendKey;
+
+   // Matrices of the last painted frame, used for picking outside paintGL.
+   GLdouble mModelViewMatrix[16];
+   GLdouble mProjectionMatrix[16];
+   bool mHasMatrices;
+
+   bool mShowPicking;
+   int  mPickRadius;
+   QPickResult mHoverPick;
+
+   bool   mHasTimeWindow;
+   double mTimeWindowStart, mTimeWindowEnd, mTrailLength;
+
+   // Clip planes in data coordinates. The clip box sets all of them.
+   QVector4D mClipPlanes[MAX_CLIP_PLANES];
+   int    mClipPlaneMask;
+   bool   mHasClipBox, mAxisFollowsClipBox;
+   QRange mClipBox;
+   void   enableClipPlanes();
+   void   disableClipPlanes();
+   bool   isClipped(const QVector3D& point) const;
+
+   // Text drawn into a cached layer, painted when the layer is done.
+   class LayerText {
+   public:
+     QPoint  pos;
+     QString string;
+     QFont   font;
+     QColor  color;
+   };
+
+   bool mCacheLayers;
+   QGLFramebufferObject* mBackgroundLayer;
+   QGLFramebufferObject* mOverlayLayer;
+   QGLFramebufferObject* mActiveLayer;
+   QByteArray mBackgroundKey, mOverlayKey;
+   QList<LayerText> mLayerTexts;
+
+   bool   mAdaptiveQuality, mInteracting;
+   int    mQualityLevel, mInteractionQualityLevel;
+   double mTargetFrameTime, mDegradeThreshold, mRecoverThreshold, mFrameTime;
+   QElapsedTimer mFrameTimer;
+   QTimer mInteractionTimer;
+
+   QThreadPool mWorkerPool;
+   // Subplots whose axes are rescaled after painting, see updateDerived()
+   QList<int>  mRescaleSubplots;
+
+   // Offscreen target and size used by renderCameraPath()
+   QSize mRenderSize;
+   QGLFramebufferObject* mRenderTarget;
+
+   // Painter of exportFigure(), which lines, planes and text are drawn
+   // through instead of GL while it is set
+   QPainter* mExportPainter;
+   double    mExportTolerance;
+
+   bool    mRecording;
+   QString mRecordFileName;
+   int     mRecordFrame;
+   QVector<QGLBuffer> mRecordBuffers;
+   QVector<QSize>     mRecordSizes;
+   QSemaphore  mWriterSlots;
+   QThreadPool mWriterPool;
+
+   qint64 mGpuMemoryBudget;
+   bool   mShowMemoryUsage;
+   int    mFrameCounter;
+
+   // The state of the current subplot is kept in the members above, the
+   // other subplots are parked in mSubplots. Empty without a subplot grid.
+   QList<Subplot*> mSubplots;
+   int mSubplotRows, mSubplotColumns, mCurrentSubplot, mHoverSubplot;
+
+   QList<QCameraLink*> mCameraLinks;
+
+   DensityMode mDensityMode;
+   int         mDensityResolution;
+   QDensity*   mDensity;
+
+   // Program that makes tubes and ribbons from the curve buffers, and the
+   // segment templates it draws, by number of sides. Ribbons use key 0.
+   QGLShaderProgram* mTubeProgram;
+   int  mTubeSupport;
+   QHash<int, QGLBuffer> mTubeTemplates;
+
+   // Program that draws an arrow mesh at every sample of a quiver, the
+   // mesh, and the buffer with the samples of each quiver.
+   QGLShaderProgram* mQuiverProgram;
+   int  mQuiverSupport;
+   QGLBuffer mArrowMesh;
+   QHash<QQuiver3D*, QCurveBuffer> mQuiverBuffers;
+};
+
+#ifdef QPLOT3D_SERVER
+/*!
+  Binary protocol of QPlotServer. Every message is a Header followed by
+  size bytes of payload, in the byte order of the machine. Curve ids are
+  chosen by the client and are local to its connection.
+ */
+class QPlotProtocol {
+ public:
+  enum Message {
+    CREATE_CURVE = 1,  // Payload: UTF-8 name
+    APPEND_XYZ   = 2,  // Payload: x, y and z as floats for each point
+    SET_STYLE    = 3,  // Payload: Style
+    CLEAR        = 4,  // No payload
+    PING         = 5,  // Payload: qint64, echoed in a PONG when the data before it is in the curves
+    PONG         = 6,  // Server to client, payload: the qint64 of the PING
+    STATUS       = 7   // Server to client, payload: Status
+  };
+
+  class Header {
+  public:
+    quint32 type;
+    quint32 curve;
+    quint32 size;
+  };
+
+  class Style {
+  public:
+    quint32 rgba;
+    float   lineWidth;
+    quint32 style;
+    float   tubeRadius;
+  };
+
+  // Sent when the server stops or starts reading again because the plot is
+  // behind by more than its queue limit, or has caught up.
+  class Status {
+  public:
+    qint64  queuedPoints;
+    quint32 busy;
+  };
+
+  static const quint32 MAX_PAYLOAD = 64 << 20;
+};
+
+class QPlotServerWorker;
+class QPlotServerOp;
+
+/*!
+  Class that lets other processes feed curves into a plot through a local
+  socket, with the messages of QPlotProtocol. Messages are read and decoded
+  on a thread of the server. The curves are then updated on the GUI thread
+  in bulk, with one repaint for everything decoded since the last one.
+
+  When more than maxQueuedPoints() points are waiting for the GUI thread,
+  the server stops reading, so that writing clients block, and tells the
+  clients and backPressure() until the queue is half empty again.
+
+  Example:
+  \code
+  QPlotServer tServer(&mPlot);
+  tServer.listen("qplot3d");
+  \endcode
+
+  The load generator in tools/loadgen feeds a server and measures its
+  throughput and latency.
+ */
+class QPlotServer: public QObject {
+  Q_OBJECT
+  friend class QPlotServerWorker;
+ public:
+  QPlotServer(QPlot3D* plot, QObject* parent = NULL);
+  ~QPlotServer();
+
+  bool listen(const QString& name);
+  void close();
+  qint64 queuedPoints() const;
+  void   setMaxQueuedPoints(qint64 value) { mMaxQueuedPoints = value; }
+  qint64 maxQueuedPoints() const { return mMaxQueuedPoints; }
+  QList<QCurve3D*> curves() const { return mCurves.values(); }
+
+ signals:
+  void backPressure(bool busy, qint64 queuedPoints);
+
+ private slots:
+  void applyQueued();
+
+ private:
+  bool enqueue(QList<QPlotServerOp>& ops, qint64 points);
+
+  QPointer<QPlot3D> mPlot;
+  QThread  mThread;
+  QPlotServerWorker* mWorker;
+  QHash<quint64, QCurve3D*> mCurves;
+
+  // Decoded messages waiting for the GUI thread
+  mutable QMutex mMutex;
+  QList<QPlotServerOp> mQueue;
+  qint64 mQueuedPoints, mMaxQueuedPoints;
+  bool   mNotified, mBusy;
 };
 
+/*!
+  Reads and decodes the messages of the clients of a QPlotServer on the
+  thread of the server.
+ */
+class QPlotServerWorker: public QObject {
+  Q_OBJECT
+ public:
+  QPlotServerWorker(QPlotServer* server);
+  ~QPlotServerWorker();
+
+ public slots:
+  bool listen(const QString& name);
+  void close();
+  void sendPong(quint32 client, qint64 stamp);
+  void setBusy(bool busy, qint64 queuedPoints);
+
+ private slots:
+  void newConnection();
+  void readClient();
+  void clientDisconnected();
+
+ private:
+  class Client;
+  void readClient(Client* client);
+  void send(Client* client, quint32 type, const void* payload, quint32 size);
+
+  QPlotServer*  mPlotServer;
+  QLocalServer* mServer;
+  QHash<QLocalSocket*, Client*> mClients;
+  quint32 mNextClient;
+  bool    mBusy;
+};
+#endif
+
+#ifdef QPLOT3D_QUICK
+/*!
+  Qt Quick item that shows curves like a QPlot3D, for QML user interfaces.
+  The item is rendered into a framebuffer object on the render thread of
+  the scene graph, so a heavy frame never blocks the GUI thread.
+
+  The curves are copied in the synchronize phase, where only the vertices
+  appended since the last frame are copied, and drawn with the same curve
+  rendering as QPlot3D. The axes are drawn by QAxis like those of QPlot3D,
+  curves with scalars by their colormap, and named curves are listed in a
+  legend. The GUI thread never waits for a frame to finish.
+  Call replot() after adding data to show it.
+
+  Register the item with qmlRegisterType() to use it from QML:
+  \code
+  qmlRegisterType<QPlot3DItem>("QPlot3D", 1, 0, "Plot3D");
+  \endcode
+ */
+class QPlot3DItem: public QQuickFramebufferObject {
+  Q_OBJECT
+  Q_PROPERTY(double azimuth READ azimuth WRITE setAzimuth NOTIFY cameraChanged)
+  Q_PROPERTY(double elevation READ elevation WRITE setElevation NOTIFY cameraChanged)
+  Q_PROPERTY(double zoom READ zoom WRITE setZoom NOTIFY cameraChanged)
+  Q_PROPERTY(QColor backgroundColor READ backgroundColor WRITE setBackgroundColor)
+  Q_PROPERTY(bool axisEqual READ axisEqual WRITE setAxisEqual)
+  friend class QPlot3DItemRenderer;
+ public:
+  QPlot3DItem(QQuickItem* parent = NULL);
+
+  void addCurve(QCurve3D* curve);
+  bool removeCurve(QCurve3D* curve);
+  void clear();
+  const QList<QCurve3D*>& curves() const { return mCurves; }
+
+  double azimuth() const;
+  double elevation() const { return mRotation.x(); }
+  double zoom() const { return mTranslate.z(); }
+  QColor backgroundColor() const { return mBackgroundColor; }
+  bool   axisEqual() const { return mAxisEqual; }
+
+  Renderer* createRenderer() const;
+
+ public slots:
+  void setAzimuth(double value)   { mRotation.setZ(-value); emit cameraChanged(); update(); }
+  void setElevation(double value) { mRotation.setX(value);  emit cameraChanged(); update(); }
+  void setZoom(double value)      { if(value < 0.0) mTranslate.setZ(value); emit cameraChanged(); update(); }
+  void setBackgroundColor(QColor color) { mBackgroundColor = color; update(); }
+  void setAxisEqual(bool value)   { mAxisEqual = value; update(); }
+  void replot() { update(); }
+
+ signals:
+  void cameraChanged();
+
+ protected:
+  void mousePressEvent(QMouseEvent* event);
+  void mouseMoveEvent(QMouseEvent* event);
+  void wheelEvent(QWheelEvent* event);
+
+ private:
+  QList<QCurve3D*> mCurves;
+  QColor    mBackgroundColor;
+  QVector3D mTranslate;
+  QVector3D mRotation;
+  bool      mAxisEqual;
+  QPointF   mLastMousePos;
+};
+#endif
+
 #endif
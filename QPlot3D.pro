@@ -1,5 +1,23 @@
 QT += core gui opengl
 
+# The ingestion server is built when Qt Network is available
+qtHaveModule(network) {
+  QT += network
+  DEFINES += QPLOT3D_SERVER
+}
+
+# Figures can be exported as SVG when Qt SVG is available
+qtHaveModule(svg) {
+  QT += svg
+  DEFINES += QPLOT3D_SVG
+}
+
+# The Qt Quick item is built when Qt Quick is available
+qtHaveModule(quick) {
+  QT += quick
+  DEFINES += QPLOT3D_QUICK
+}
+
 TARGET = QPlot3D-example
 TEMPLATE = app
 
@@ -27,48 +27,51 @@ public:
     mCurve = new QCurve3D(name);
     mCurve->setColor(color);
 
+    // The box is moved by its transform, the vertices stay around the origin
+    mCurve->setTranslation(center);
+
     // Front
-    mCurve->addData(center + QVector3D(-1.0,-1.0,1.0));
-    mCurve->addData(center + QVector3D( 1.0,-1.0,1.0));
-    mCurve->addData(center + QVector3D( 1.0, 1.0,1.0));
-    mCurve->addData(center + QVector3D(-1.0, 1.0,1.0));
-    mCurve->addData(center + QVector3D(-1.0,-1.0,1.0));
+    mCurve->addData(QVector3D(-1.0,-1.0,1.0));
+    mCurve->addData(QVector3D( 1.0,-1.0,1.0));
+    mCurve->addData(QVector3D( 1.0, 1.0,1.0));
+    mCurve->addData(QVector3D(-1.0, 1.0,1.0));
+    mCurve->addData(QVector3D(-1.0,-1.0,1.0));
 
     // Left
-    mCurve->addData(center + QVector3D(-1.0,-1.0, 1.0));
-    mCurve->addData(center + QVector3D(-1.0,-1.0,-1.0));
-    mCurve->addData(center + QVector3D(-1.0, 1.0,-1.0));
-    mCurve->addData(center + QVector3D(-1.0, 1.0, 1.0));
-    mCurve->addData(center + QVector3D(-1.0,-1.0, 1.0));
+    mCurve->addData(QVector3D(-1.0,-1.0, 1.0));
+    mCurve->addData(QVector3D(-1.0,-1.0,-1.0));
+    mCurve->addData(QVector3D(-1.0, 1.0,-1.0));
+    mCurve->addData(QVector3D(-1.0, 1.0, 1.0));
+    mCurve->addData(QVector3D(-1.0,-1.0, 1.0));
 
     // Back
-    mCurve->addData(center + QVector3D(-1.0,-1.0,-1.0));
-    mCurve->addData(center + QVector3D( 1.0,-1.0,-1.0));
-    mCurve->addData(center + QVector3D( 1.0, 1.0,-1.0));
-    mCurve->addData(center + QVector3D(-1.0, 1.0,-1.0));
-    mCurve->addData(center + QVector3D(-1.0,-1.0,-1.0));
-    mCurve->addData(center + QVector3D( 1.0,-1.0,-1.0));
+    mCurve->addData(QVector3D(-1.0,-1.0,-1.0));
+    mCurve->addData(QVector3D( 1.0,-1.0,-1.0));
+    mCurve->addData(QVector3D( 1.0, 1.0,-1.0));
+    mCurve->addData(QVector3D(-1.0, 1.0,-1.0));
+    mCurve->addData(QVector3D(-1.0,-1.0,-1.0));
+    mCurve->addData(QVector3D( 1.0,-1.0,-1.0));
 
     // Bottom 
-    mCurve->addData(center + QVector3D( 1.0,-1.0,-1.0));
-    mCurve->addData(center + QVector3D( 1.0,-1.0, 1.0));
-    mCurve->addData(center + QVector3D(-1.0,-1.0, 1.0));
-    mCurve->addData(center + QVector3D(-1.0,-1.0,-1.0));
+    mCurve->addData(QVector3D( 1.0,-1.0,-1.0));
+    mCurve->addData(QVector3D( 1.0,-1.0, 1.0));
+    mCurve->addData(QVector3D(-1.0,-1.0, 1.0));
+    mCurve->addData(QVector3D(-1.0,-1.0,-1.0));
 
     // Right
-    mCurve->addData(center + QVector3D(1.0,-1.0,-1.0));
-    mCurve->addData(center + QVector3D(1.0,-1.0, 1.0));
-    mCurve->addData(center + QVector3D(1.0,-1.0,-1.0));
-    mCurve->addData(center + QVector3D(1.0, 1.0,-1.0));
-    mCurve->addData(center + QVector3D(1.0, 1.0, 1.0));
-    mCurve->addData(center + QVector3D(1.0,-1.0, 1.0));
+    mCurve->addData(QVector3D(1.0,-1.0,-1.0));
+    mCurve->addData(QVector3D(1.0,-1.0, 1.0));
+    mCurve->addData(QVector3D(1.0,-1.0,-1.0));
+    mCurve->addData(QVector3D(1.0, 1.0,-1.0));
+    mCurve->addData(QVector3D(1.0, 1.0, 1.0));
+    mCurve->addData(QVector3D(1.0,-1.0, 1.0));
 
     // Top
-    mCurve->addData(center + QVector3D( 1.0, 1.0, 1.0));
-    mCurve->addData(center + QVector3D(-1.0, 1.0, 1.0));
-    mCurve->addData(center + QVector3D(-1.0, 1.0,-1.0));
-    mCurve->addData(center + QVector3D( 1.0, 1.0,-1.0));
-    mCurve->addData(center + QVector3D( 1.0, 1.0, 1.0));
+    mCurve->addData(QVector3D( 1.0, 1.0, 1.0));
+    mCurve->addData(QVector3D(-1.0, 1.0, 1.0));
+    mCurve->addData(QVector3D(-1.0, 1.0,-1.0));
+    mCurve->addData(QVector3D( 1.0, 1.0,-1.0));
+    mCurve->addData(QVector3D( 1.0, 1.0, 1.0));
   }
 
   ~Box() { delete mCurve; }
@@ -106,8 +109,29 @@ int main(int argc, char* argv[]) {
   // Set color and linewidth
   spiral.setColor(Qt::blue);
   spiral.setLineWidth(2);
+  spiral.setShowShadows(true);
   // Add spiral curve to the plot 
   plot.addCurve(&spiral);
+
+  // A swirl around the spiral, colored by its strength
+  QQuiver3D swirl("Swirl");
+  for (int x = -4; x <= 4; x += 2) {
+    for (int y = -4; y <= 4; y += 2) {
+      for (int z = -4; z <= 4; z += 2) {
+        swirl.addArrow(QVector3D(x,y,z), 0.1*QVector3D(-y,x,1));
+      }
+    }
+  }
+  QVector<QColor> swirlColors;
+  swirlColors << Qt::blue << Qt::yellow << Qt::red;
+  swirl.setColorMap(swirlColors);
+  plot.addQuiver(&swirl);
+
+#ifdef QPLOT3D_SERVER
+  // Other processes can add curves to the plot, see tools/loadgen
+  QPlotServer server(&plot);
+  server.listen("qplot3d");
+#endif
   // Set axis equal
   plot.setAxisEqual(true);
 
@@ -145,54 +169,53 @@ int main(int argc, char* argv[]) {
   //////////////////////////////////////////////////////////////////////  
   // Example 3: Changeing the  looks
   //////////////////////////////////////////////////////////////////////  
-  // Setup a widget with four subplots...
-  QWidget aWidget;
-  QPlot3D tPlot1;
-  QPlot3D tPlot2;
-  QPlot3D tPlot3;
-  QPlot3D tPlot4;
-  QGridLayout* tLayout = new QGridLayout;
-  aWidget.setLayout(tLayout);
-  tLayout->addWidget(&tPlot1,0,0);
-  tLayout->addWidget(&tPlot2,0,1);
-  tLayout->addWidget(&tPlot3,1,0);
-  tLayout->addWidget(&tPlot4,1,1);
-  
-  tPlot1.addCurve(&bigSpiral);
-  tPlot2.addCurve(&bigSpiral);
-  tPlot3.addCurve(&bigSpiral);
-  tPlot4.addCurve(&bigSpiral);
+  // Setup a plot with four subplots, all drawn in one GL context...
+  QPlot3D aWidget;
+  aWidget.setSubplotGrid(2,2);
+  for (int i = 0; i < aWidget.subplotCount(); i++) {
+    aWidget.setCurrentSubplot(i);
+    aWidget.addCurve(&bigSpiral);
+  }
 
   // Change settings
-  tPlot1.setBackgroundColor(Qt::black);
-  tPlot1.xAxis().setLabelColor(Qt::white);
-  tPlot1.yAxis().setLabelColor(Qt::white);
-  tPlot1.zAxis().setLabelColor(Qt::white);
-  tPlot1.xAxis().setPlaneColor(Qt::gray);
-  tPlot1.yAxis().setPlaneColor(Qt::gray);
-  tPlot1.zAxis().setPlaneColor(Qt::gray);
-  tPlot1.setShowLegend(false);
-  tPlot1.setShowAzimuthElevation(false);
-
-  tPlot2.xAxis().setShowPlane(false);
-  tPlot2.yAxis().setShowPlane(false);
-  tPlot2.zAxis().setShowPlane(false);
-  tPlot2.setBackgroundColor(Qt::gray);
-  tPlot2.xAxis().setGridColor(Qt::yellow);
-  tPlot2.yAxis().setGridColor(Qt::yellow);
-  tPlot2.zAxis().setGridColor(Qt::yellow);
-
-  tPlot3.setXLabel("Forward");
-  tPlot3.setYLabel("Right");
-  tPlot3.setZLabel("Down");
-  tPlot3.setShowAxis(false);
-  tPlot3.setAdjustPlaneView(false);
-  tPlot3.setShowAxisBox(true);
-
-  tPlot4.setShowGrid(false);
-  tPlot4.setShowAxis(false);
-  tPlot4.setAzimuth(90);
-  tPlot4.setElevation(-90);
+  aWidget.setCurrentSubplot(0);
+  aWidget.setBackgroundColor(Qt::black);
+  aWidget.xAxis().setLabelColor(Qt::white);
+  aWidget.yAxis().setLabelColor(Qt::white);
+  aWidget.zAxis().setLabelColor(Qt::white);
+  aWidget.xAxis().setPlaneColor(Qt::gray);
+  aWidget.yAxis().setPlaneColor(Qt::gray);
+  aWidget.zAxis().setPlaneColor(Qt::gray);
+  aWidget.setShowLegend(false);
+  aWidget.setShowAzimuthElevation(false);
+
+  aWidget.setCurrentSubplot(1);
+  aWidget.xAxis().setShowPlane(false);
+  aWidget.yAxis().setShowPlane(false);
+  aWidget.zAxis().setShowPlane(false);
+  aWidget.setBackgroundColor(Qt::gray);
+  aWidget.xAxis().setGridColor(Qt::yellow);
+  aWidget.yAxis().setGridColor(Qt::yellow);
+  aWidget.zAxis().setGridColor(Qt::yellow);
+
+  aWidget.setCurrentSubplot(2);
+  aWidget.setXLabel("Forward");
+  aWidget.setYLabel("Right");
+  aWidget.setZLabel("Down");
+  aWidget.setShowAxis(false);
+  aWidget.setAdjustPlaneView(false);
+  aWidget.setShowAxisBox(true);
+
+  aWidget.setCurrentSubplot(3);
+  aWidget.setShowGrid(false);
+  aWidget.setShowAxis(false);
+  aWidget.setAzimuth(90);
+  aWidget.setElevation(-90);
+
+  // The two upper subplots rotate together
+  QCameraLink tLink(QCameraLink::ROTATION);
+  tLink.addPlot(&aWidget, 0);
+  tLink.addPlot(&aWidget, 1);
   
 
 
@@ -0,0 +1,9 @@
+TEMPLATE = app
+TARGET = loadgen
+CONFIG += console
+CONFIG -= app_bundle
+QT += core network opengl
+DEFINES += QPLOT3D_SERVER
+INCLUDEPATH += ../..
+
+SOURCES += main.cpp
@@ -0,0 +1,112 @@
+/*
+  Load generator for QPlotServer. Connects to a running plot, feeds it a
+  spiral as fast as it is read and measures the throughput and the latency
+  from sending a point until it is in a curve of the plot.
+
+  Usage: loadgen [server name] [seconds] [curves] [points per message]
+ */
+#include <QtCore>
+#include <QtNetwork>
+#include <algorithm>
+#include <cmath>
+#include "QPlot3D.h"
+
+static void Send(QLocalSocket& socket, quint32 type, quint32 curve, const void* payload, quint32 size) {
+  QPlotProtocol::Header tHeader;
+  tHeader.type  = type;
+  tHeader.curve = curve;
+  tHeader.size  = size;
+  socket.write((const char*)&tHeader, sizeof(tHeader));
+  if(size > 0) socket.write((const char*)payload, size);
+}
+
+int main(int argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+  const QStringList tArgs = app.arguments();
+  const QString tName    = tArgs.size() > 1 ? tArgs[1] : QString("qplot3d");
+  const double  tSeconds = tArgs.size() > 2 ? tArgs[2].toDouble() : 10.0;
+  const int     nCurves  = tArgs.size() > 3 ? std::max(1, tArgs[3].toInt()) : 1;
+  const int     nBatch   = tArgs.size() > 4 ? std::max(1, tArgs[4].toInt()) : 65536;
+
+  QLocalSocket tSocket;
+  tSocket.connectToServer(tName);
+  if(!tSocket.waitForConnected(5000)) {
+    qWarning() << "loadgen: could not connect to" << tName << ":" << tSocket.errorString();
+    return 1;
+  }
+
+  for (int c = 0; c < nCurves; c++) {
+    const QByteArray tCurveName = QString("loadgen %1").arg(c).toUtf8();
+    Send(tSocket, QPlotProtocol::CREATE_CURVE, c, tCurveName.constData(), tCurveName.size());
+    QPlotProtocol::Style tStyle;
+    tStyle.rgba       = QColor::fromHsv((c*47) % 360, 255, 200).rgba();
+    tStyle.lineWidth  = 1;
+    tStyle.style      = QCurve3D::LINE_STYLE;
+    tStyle.tubeRadius = 0.05f;
+    Send(tSocket, QPlotProtocol::SET_STYLE, c, &tStyle, sizeof(tStyle));
+  }
+
+  QVector<QVector3D> tPoints(nBatch);
+  QElapsedTimer tTimer;
+  tTimer.start();
+  qint64 tSent = 0, tBusyReports = 0, tNextPing = 0;
+  QVector<double> tLatencies;
+  QByteArray tBuffer;
+
+  while(tTimer.elapsed() < tSeconds*1000) {
+    for (int c = 0; c < nCurves; c++) {
+      for (int i = 0; i < nBatch; i++) {
+        const double t = 1e-3*(tSent/nCurves + i);
+        tPoints[i] = QVector3D(cos(t)*(1+0.1*c), sin(t)*(1+0.1*c), 0.01*t);
+      }
+      Send(tSocket, QPlotProtocol::APPEND_XYZ, c, tPoints.constData(), nBatch*sizeof(QVector3D));
+    }
+    tSent += (qint64)nBatch*nCurves;
+
+    // A ping every 10 ms, answered when the points before it are plotted
+    if(tTimer.elapsed() >= tNextPing) {
+      const qint64 tStamp = tTimer.nsecsElapsed();
+      Send(tSocket, QPlotProtocol::PING, 0, &tStamp, sizeof(tStamp));
+      tNextPing = tTimer.elapsed() + 10;
+    }
+
+    // Blocks while the server has stopped reading
+    tSocket.waitForBytesWritten(-1);
+
+    tSocket.waitForReadyRead(0);
+    tBuffer.append(tSocket.readAll());
+    while(tBuffer.size() >= (int)sizeof(QPlotProtocol::Header)) {
+      QPlotProtocol::Header tHeader;
+      memcpy(&tHeader, tBuffer.constData(), sizeof(tHeader));
+      if(tBuffer.size() < (int)(sizeof(tHeader) + tHeader.size)) break;
+      const char* tPayload = tBuffer.constData() + sizeof(tHeader);
+      if(tHeader.type == QPlotProtocol::PONG && tHeader.size >= sizeof(qint64)) {
+        qint64 tStamp;
+        memcpy(&tStamp, tPayload, sizeof(tStamp));
+        tLatencies.push_back(1e-6*(tTimer.nsecsElapsed() - tStamp));
+      } else if(tHeader.type == QPlotProtocol::STATUS && tHeader.size >= sizeof(QPlotProtocol::Status)) {
+        QPlotProtocol::Status tStatus;
+        memcpy(&tStatus, tPayload, sizeof(tStatus));
+        if(tStatus.busy) tBusyReports++;
+      }
+      tBuffer.remove(0, sizeof(tHeader) + tHeader.size);
+    }
+  }
+  const double tElapsed = 1e-3*tTimer.elapsed();
+  tSocket.disconnectFromServer();
+
+  printf("Sent %lld points in %.2f s: %.1f M points/s\n", tSent, tElapsed, 1e-6*tSent/tElapsed);
+  printf("Server busy reports: %lld\n", tBusyReports);
+  if(tLatencies.isEmpty()) {
+    printf("No latency samples\n");
+    return 0;
+  }
+  std::sort(tLatencies.begin(), tLatencies.end());
+  double tSum = 0;
+  for (int i = 0; i < tLatencies.size(); i++) tSum += tLatencies[i];
+  printf("Latency (ms) over %d pings: min %.2f avg %.2f p99 %.2f max %.2f\n", tLatencies.size(),
+         tLatencies.first(), tSum/tLatencies.size(),
+         tLatencies[std::min(tLatencies.size()-1, (int)(0.99*tLatencies.size()))], tLatencies.last());
+  return 0;
+}
@@ -0,0 +1,267 @@
+/*
+  Builds the octree file of a QOctreeCloud from a raw file of x, y and z
+  floats, in the byte order of the machine. The points are never all in
+  memory: every node is built by streaming the points below it from a
+  temporary file, keeping an evenly spread sample for the node and writing
+  the rest to one temporary file per child.
+
+  Usage: octree <input.xyz> <output.qoct> [points per node]
+ */
+#include <QtCore>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include "QPlot3D.h"
+
+// Points read or written at a time
+static const int CHUNK_POINTS = 1 << 16;
+
+// Nodes deeper than this keep all their points, which ends the subdivision
+// of repeated points
+static const int MAX_DEPTH = 21;
+
+// A node whose points are in a temporary file until it is built
+class PendingNode {
+ public:
+  int     index;
+  int     depth;
+  QString fileName;
+  qint64  count;
+  float   min[3], max[3];
+};
+
+// File of points written in chunks
+class PointWriter {
+ public:
+  PointWriter(const QString& fileName): mFile(fileName), mCount(0) {
+    mFile.open(QIODevice::WriteOnly);
+    mBuffer.reserve(CHUNK_POINTS);
+  }
+  ~PointWriter() { flush(); }
+  bool isOpen() const { return mFile.isOpen(); }
+  void add(const QVector3D& point) {
+    mBuffer.push_back(point);
+    mCount++;
+    if(mBuffer.size() == CHUNK_POINTS) flush();
+  }
+  void flush() {
+    if(mBuffer.isEmpty()) return;
+    mFile.write((const char*)mBuffer.constData(), mBuffer.size()*sizeof(QVector3D));
+    mBuffer.clear();
+  }
+  qint64 count() const { return mCount; }
+
+ private:
+  QFile  mFile;
+  QVector<QVector3D> mBuffer;
+  qint64 mCount;
+};
+
+// Calls process with each chunk of the points in fileName
+template<class Function>
+static bool ForEachChunk(const QString& fileName, Function process) {
+  QFile tFile(fileName);
+  if(!tFile.open(QIODevice::ReadOnly)) return false;
+  QVector<QVector3D> tChunk(CHUNK_POINTS);
+  while(true) {
+    const qint64 tBytes = tFile.read((char*)tChunk.data(), CHUNK_POINTS*sizeof(QVector3D));
+    if(tBytes <= 0) break;
+    process(tChunk.constData(), (int)(tBytes/sizeof(QVector3D)));
+  }
+  return true;
+}
+
+class BoundsCounter {
+ public:
+  BoundsCounter(float* min, float* max, qint64* count): mMin(min), mMax(max), mCount(count) {}
+  void operator()(const QVector3D* points, int n) {
+    for (int i = 0; i < n; i++) {
+      for (int a = 0; a < 3; a++) {
+        mMin[a] = std::min(mMin[a], points[i][a]);
+        mMax[a] = std::max(mMax[a], points[i][a]);
+      }
+    }
+    *mCount += n;
+  }
+ private:
+  float* mMin;
+  float* mMax;
+  qint64* mCount;
+};
+
+// Keeps every stride:th point for the node and sends the others to the
+// child of the octant they are in
+class Splitter {
+ public:
+  Splitter(PointWriter* node, PointWriter** children, PendingNode* childNodes, const QVector3D& center, qint64 stride):
+    mNode(node), mChildren(children), mChildNodes(childNodes), mCenter(center), mStride(stride), mIndex(0) {}
+  void operator()(const QVector3D* points, int n) {
+    for (int i = 0; i < n; i++, mIndex++) {
+      if(mIndex % mStride == 0) {
+        mNode->add(points[i]);
+        continue;
+      }
+      const int tOctant = (points[i].x() >= mCenter.x() ? 1 : 0) |
+                          (points[i].y() >= mCenter.y() ? 2 : 0) |
+                          (points[i].z() >= mCenter.z() ? 4 : 0);
+      mChildren[tOctant]->add(points[i]);
+      PendingNode& tChild = mChildNodes[tOctant];
+      for (int a = 0; a < 3; a++) {
+        tChild.min[a] = std::min(tChild.min[a], points[i][a]);
+        tChild.max[a] = std::max(tChild.max[a], points[i][a]);
+      }
+    }
+  }
+ private:
+  PointWriter*  mNode;
+  PointWriter** mChildren;
+  PendingNode*  mChildNodes;
+  QVector3D mCenter;
+  qint64    mStride;
+  qint64    mIndex;
+};
+
+// Appends the points of a file to the output
+class Copier {
+ public:
+  Copier(PointWriter* out): mOut(out) {}
+  void operator()(const QVector3D* points, int n) {
+    for (int i = 0; i < n; i++) mOut->add(points[i]);
+  }
+ private:
+  PointWriter* mOut;
+};
+
+int main(int argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+  const QStringList tArgs = app.arguments();
+  if(tArgs.size() < 3) {
+    fprintf(stderr, "Usage: octree <input.xyz> <output.qoct> [points per node]\n");
+    return 1;
+  }
+  const QString tInput  = tArgs[1];
+  const QString tOutput = tArgs[2];
+  const qint64  nNodePoints = tArgs.size() > 3 ? std::max(1, tArgs[3].toInt()) : 65536;
+
+  QTemporaryDir tTemp(QFileInfo(tOutput).absolutePath() + "/octree-XXXXXX");
+  if(!tTemp.isValid()) {
+    fprintf(stderr, "Could not create a temporary directory\n");
+    return 1;
+  }
+
+  // The bounds and count of all points
+  PendingNode tRoot;
+  tRoot.index    = 0;
+  tRoot.depth    = 0;
+  tRoot.fileName = tInput;
+  tRoot.count    = 0;
+  for (int a = 0; a < 3; a++) {
+    tRoot.min[a] =  std::numeric_limits<float>::max();
+    tRoot.max[a] = -std::numeric_limits<float>::max();
+  }
+  if(!ForEachChunk(tInput, BoundsCounter(tRoot.min, tRoot.max, &tRoot.count)) || tRoot.count == 0) {
+    fprintf(stderr, "Could not read points from %s\n", qPrintable(tInput));
+    return 1;
+  }
+
+  // The points of the nodes are written after the header, in the order the
+  // nodes are built
+  QOctreeFormat::Header tHeader;
+  memset(&tHeader, 0, sizeof(tHeader));
+  tHeader.magic      = QOctreeFormat::MAGIC;
+  tHeader.version    = QOctreeFormat::VERSION;
+  tHeader.pointCount = tRoot.count;
+  std::copy(tRoot.min, tRoot.min+3, tHeader.min);
+  std::copy(tRoot.max, tRoot.max+3, tHeader.max);
+  {
+    QFile tFile(tOutput);
+    if(!tFile.open(QIODevice::WriteOnly)) {
+      fprintf(stderr, "Could not write %s\n", qPrintable(tOutput));
+      return 1;
+    }
+    tFile.write((const char*)&tHeader, sizeof(tHeader));
+  }
+
+  QVector<QOctreeFormat::Node> tNodes(1);
+  QQueue<PendingNode> tQueue;
+  tQueue.enqueue(tRoot);
+  qint64 tOffset = sizeof(tHeader);
+  int tTempCount = 0;
+  while(!tQueue.isEmpty()) {
+    const PendingNode tPending = tQueue.dequeue();
+    QOctreeFormat::Node& tNode = tNodes[tPending.index];
+    memset(&tNode, 0, sizeof(tNode));
+    std::copy(tPending.min, tPending.min+3, tNode.min);
+    std::copy(tPending.max, tPending.max+3, tNode.max);
+    std::fill(tNode.children, tNode.children+8, -1);
+    tNode.offset = tOffset;
+
+    // The node is appended to the output as it is written
+    const QString tNodeFile = tTemp.filePath(QString("node%1").arg(tTempCount++));
+    if(tPending.count <= nNodePoints || tPending.depth >= MAX_DEPTH) {
+      PointWriter tWriter(tNodeFile);
+      ForEachChunk(tPending.fileName, Copier(&tWriter));
+      tWriter.flush();
+      tNode.count = (quint32)tWriter.count();
+    } else {
+      PointWriter* tChildren[8];
+      PendingNode  tChildNodes[8];
+      for (int c = 0; c < 8; c++) {
+        tChildNodes[c].fileName = tTemp.filePath(QString("node%1").arg(tTempCount++));
+        tChildNodes[c].depth    = tPending.depth + 1;
+        for (int a = 0; a < 3; a++) {
+          tChildNodes[c].min[a] =  std::numeric_limits<float>::max();
+          tChildNodes[c].max[a] = -std::numeric_limits<float>::max();
+        }
+        tChildren[c] = new PointWriter(tChildNodes[c].fileName);
+      }
+      const QVector3D tCenter(0.5f*(tPending.min[0]+tPending.max[0]),
+                              0.5f*(tPending.min[1]+tPending.max[1]),
+                              0.5f*(tPending.min[2]+tPending.max[2]));
+      const qint64 tStride = (tPending.count + nNodePoints - 1)/nNodePoints;
+      PointWriter tWriter(tNodeFile);
+      ForEachChunk(tPending.fileName, Splitter(&tWriter, tChildren, tChildNodes, tCenter, tStride));
+      tWriter.flush();
+      tNode.count = (quint32)tWriter.count();
+
+      for (int c = 0; c < 8; c++) {
+        tChildNodes[c].count = tChildren[c]->count();
+        delete tChildren[c];
+        if(tChildNodes[c].count == 0) {
+          QFile::remove(tChildNodes[c].fileName);
+          continue;
+        }
+        tChildNodes[c].index = tNodes.size();
+        tNodes[tPending.index].children[c] = tChildNodes[c].index;
+        tNodes.push_back(QOctreeFormat::Node());
+        tQueue.enqueue(tChildNodes[c]);
+      }
+    }
+    if(tPending.fileName != tInput) QFile::remove(tPending.fileName);
+
+    // Append the points of the node to the output
+    {
+      QFile tFile(tOutput);
+      tFile.open(QIODevice::Append);
+      QFile tIn(tNodeFile);
+      tIn.open(QIODevice::ReadOnly);
+      while(!tIn.atEnd()) tFile.write(tIn.read(CHUNK_POINTS*sizeof(QVector3D)));
+    }
+    QFile::remove(tNodeFile);
+    tOffset += (qint64)tNodes[tPending.index].count*sizeof(QVector3D);
+  }
+
+  // The node table at the end, and the header that points to it
+  QFile tFile(tOutput);
+  if(!tFile.open(QIODevice::ReadWrite)) return 1;
+  tHeader.nodeCount       = tNodes.size();
+  tHeader.nodeTableOffset = tOffset;
+  tFile.seek(tOffset);
+  tFile.write((const char*)tNodes.constData(), tNodes.size()*sizeof(QOctreeFormat::Node));
+  tFile.seek(0);
+  tFile.write((const char*)&tHeader, sizeof(tHeader));
+
+  printf("Wrote %lld points in %d nodes to %s\n", tRoot.count, tNodes.size(), qPrintable(tOutput));
+  return 0;
+}
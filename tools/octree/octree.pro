@@ -0,0 +1,8 @@
+TEMPLATE = app
+TARGET = octree
+CONFIG += console
+CONFIG -= app_bundle
+QT += core opengl
+INCLUDEPATH += ../..
+
+SOURCES += main.cpp